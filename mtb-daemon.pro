@@ -14,10 +14,24 @@ SOURCES += \
 	src/server.cpp \
 	src/logging.cpp \
 	src/qjsonsafe.cpp \
+	src/coalescer.cpp \
+	src/stats.cpp \
+	src/codec.cpp \
+	src/session.cpp \
+	src/eventlog.cpp \
+	src/sharedstate.cpp \
+	src/dvpoller.cpp \
+	src/bushealth.cpp \
+	src/firmwarestore.cpp \
+	src/fwupgrader.cpp \
+	src/rules.cpp \
+	src/outputpulses.cpp \
+	src/scenes.cpp \
 	src/modules/module.cpp \
 	src/modules/uni.cpp \
 	src/modules/unis.cpp \
-	src/modules/rc.cpp
+	src/modules/rc.cpp \
+	src/modules/firmware.cpp
 
 HEADERS += \
 	src/main.h \
@@ -28,19 +42,35 @@ HEADERS += \
 	src/server.h \
 	src/logging.h \
 	src/qjsonsafe.h \
+	src/coalescer.h \
+	src/stats.h \
+	src/codec.h \
+	src/session.h \
+	src/eventlog.h \
+	src/sharedstate.h \
+	src/dvpoller.h \
+	src/bushealth.h \
+	src/firmwarestore.h \
+	src/fwupgrader.h \
+	src/rules.h \
+	src/outputpulses.h \
+	src/scenes.h \
 	src/modules/module.h \
 	src/modules/uni.h \
 	src/modules/unis.h \
 	src/modules/rc.h \
+	src/modules/firmware.h \
 	src/errors.h \
 	src/utils.h \
-	lib/termcolor.h
+	lib/termcolor.h \
+	shm/mtb-shm.h
 
 INCLUDEPATH += \
 	src \
 	lib \
 	src/mtbusb \
-	src/modules
+	src/modules \
+	shm
 
 CONFIG += c++17
 QMAKE_CXXFLAGS += -Wall -Wextra -pedantic -std=c++17
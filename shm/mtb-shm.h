@@ -0,0 +1,178 @@
+#ifndef _MTB_SHM_H_
+#define _MTB_SHM_H_
+
+/* Shared-memory export of MTB modules state.
+ *
+ * MTB Daemon optionally maintains a memory-mapped file (config 'sharedState')
+ * with fixed binary layout: header followed by one slot per module address.
+ * Each slot is guarded by a seqlock: writer increments 'seq' to odd value
+ * before update and to even value after it. Readers copy the slot and retry
+ * when 'seq' changed in the meantime. Reads thus never block the daemon and
+ * cost the daemon no CPU at all.
+ *
+ * This file is self-contained (no Qt, C++17 only), so readers can simply copy
+ * it. Reader is implemented for POSIX systems.
+ *
+ * Example:
+ *   MtbShm::Reader reader("/dev/shm/mtb-daemon-state");
+ *   MtbShm::ModuleState state;
+ *   if ((reader.isOpen()) && (reader.read(1, state))) {
+ *       bool in0 = state.active && (state.inputs & 1);
+ *   }
+ * When read() fails because the daemon stopped or restarted (isValid() is
+ * false), reopen the file.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace MtbShm {
+
+constexpr uint32_t MAGIC = 0x5342544D; // "MTBS"
+constexpr uint32_t LAYOUT_VERSION = 1;
+constexpr size_t MODULES_CNT = 256;
+constexpr size_t OUTPUTS_CNT = 32;
+constexpr size_t RC_INPUTS_CNT = 8;
+constexpr size_t RC_ADDRS_CNT = 8; // DCC addresses stored per RC input, more addresses are counted only
+constexpr size_t READ_MAX_RETRIES = 1000; // slot locked longer = writer died during update
+
+struct ModuleState {
+	uint8_t active;
+	uint8_t type; // type_code (see tcp-protocol/messages.md)
+	uint8_t inputsCnt;
+	uint8_t outputsCnt;
+	uint32_t inputs; // bit i = state of input i (MTB-UNI, MTB-UNIS)
+	// Confirmed outputs: plain: 0/1, s-com: 0x80 | code, flicker: 0x40 | frequency code
+	uint8_t outputs[OUTPUTS_CNT];
+	uint16_t rcAddrsCnt[RC_INPUTS_CNT]; // MTB-RC: number of DCC addresses on each input (may exceed RC_ADDRS_CNT)
+	uint16_t rcAddrs[RC_INPUTS_CNT][RC_ADDRS_CNT];
+	uint64_t version; // state version as in 'modules' response
+};
+
+struct alignas(64) ModuleSlot {
+	std::atomic<uint32_t> seq; // odd = update in progress
+	uint32_t reserved;
+	ModuleState state;
+};
+
+struct Header {
+	uint32_t magic; // written last -> file is valid when magic matches
+	uint32_t layoutVersion;
+	uint32_t slotSize;
+	uint32_t modulesCnt;
+	uint32_t daemonPid;
+	uint32_t reserved;
+	std::atomic<uint64_t> changes; // incremented after each slot update, readers may poll it
+};
+
+struct alignas(64) File {
+	Header header;
+	ModuleSlot modules[MODULES_CNT];
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free,
+              "Shared-memory atomics must be lock-free");
+
+inline void write(ModuleSlot &slot, const ModuleState &state) {
+	const uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+	slot.seq.store(seq+1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	std::memcpy(&slot.state, &state, sizeof(state));
+	slot.seq.store(seq+2, std::memory_order_release);
+}
+
+// Returns false when slot was being updated during the read -> retry
+inline bool tryRead(const ModuleSlot &slot, ModuleState &state) {
+	const uint32_t seq = slot.seq.load(std::memory_order_acquire);
+	if (seq & 1)
+		return false;
+	std::memcpy(&state, &slot.state, sizeof(state));
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return (slot.seq.load(std::memory_order_relaxed) == seq);
+}
+
+#ifndef _WIN32
+class Reader {
+public:
+	Reader() = default;
+	explicit Reader(const char *path) { this->open(path); }
+	~Reader() { this->close(); }
+	Reader(const Reader&) = delete;
+	Reader& operator=(const Reader&) = delete;
+
+	// Returns false when the file does not exist or its layout is not compatible
+	bool open(const char *path) {
+		this->close();
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if ((fstat(fd, &st) != 0) || (static_cast<size_t>(st.st_size) < sizeof(File))) {
+			::close(fd);
+			return false;
+		}
+		void *mapped = mmap(nullptr, sizeof(File), PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (mapped == MAP_FAILED)
+			return false;
+		this->file = static_cast<const File*>(mapped);
+
+		const Header &header = this->file->header;
+		if ((header.magic != MAGIC) || (header.layoutVersion != LAYOUT_VERSION) ||
+		    (header.slotSize != sizeof(ModuleSlot)) || (header.modulesCnt != MODULES_CNT)) {
+			this->close();
+			return false;
+		}
+		this->pid = header.daemonPid;
+		return true;
+	}
+
+	void close() {
+		if (this->file != nullptr)
+			munmap(const_cast<File*>(this->file), sizeof(File));
+		this->file = nullptr;
+	}
+
+	bool isOpen() const { return (this->file != nullptr); }
+	uint32_t daemonPid() const { return this->file->header.daemonPid; }
+	uint64_t changes() const { return this->file->header.changes.load(std::memory_order_acquire); }
+
+	// False when the daemon which wrote the file at open() stopped or another daemon took the file over
+	bool isValid() const {
+		if (this->file == nullptr)
+			return false;
+		const Header &header = this->file->header;
+		const bool valid = (header.magic == MAGIC) && (header.daemonPid == this->pid);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return valid;
+	}
+
+	// Consistent snapshot of module state; inactive module has 'active' = 0 & 'type' = 0
+	// Returns false when the file is not valid anymore or the slot stays locked
+	bool read(uint8_t addr, ModuleState &state) const {
+		for (size_t i = 0; i < READ_MAX_RETRIES; i++) {
+			if (!this->isValid())
+				return false;
+			if (tryRead(this->file->modules[addr], state))
+				return this->isValid();
+		}
+		return false;
+	}
+
+private:
+	const File *file = nullptr;
+	uint32_t pid = 0;
+};
+#endif
+
+} // namespace MtbShm
+
+#endif
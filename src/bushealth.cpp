@@ -0,0 +1,136 @@
+#include <QJsonArray>
+#include "bushealth.h"
+#include "main.h"
+#include "eventlog.h"
+#include "logging.h"
+
+BusHealth busHealth;
+
+QString busHealthLevelToStr(BusHealthLevel level) {
+	switch (level) {
+	case BusHealthLevel::Ok: return "ok";
+	case BusHealthLevel::Degraded: return "degraded";
+	case BusHealthLevel::Bad: return "bad";
+	default: return "unknown";
+	}
+}
+
+BusHealth::BusHealth() {
+	QObject::connect(&this->timer, &QTimer::timeout, [this]() { this->evaluate(); });
+}
+
+void BusHealth::start() {
+	this->timer.start(BUS_HEALTH_PERIOD_MS);
+}
+
+void BusHealth::evaluate() {
+	for (size_t addr = 0; addr < Mtb::_MAX_MODULES; addr++)
+		if ((modules[addr] != nullptr) && (modules[addr]->isActive()))
+			this->evaluate(addr, this->links[addr]);
+}
+
+std::optional<double> BusHealth::ratio(std::optional<uint32_t> lastPart, std::optional<uint32_t> part,
+                                       std::optional<uint32_t> lastOther, std::optional<uint32_t> other) {
+	// Counters could be reset (module rebooted) -> no sample
+	if ((!lastPart) || (!part) || (!lastOther) || (!other) || (*part < *lastPart) || (*other < *lastOther))
+		return std::nullopt;
+	const uint32_t dPart = *part - *lastPart;
+	const uint32_t dTotal = dPart + (*other - *lastOther);
+	if (dTotal == 0)
+		return std::nullopt;
+	return static_cast<double>(dPart) / dTotal;
+}
+
+void BusHealth::evaluate(uint8_t addr, Link &link) {
+	const Mtb::LinkStats &stats = mtbusb.linkStats(addr);
+	const uint64_t responses = stats.responses - link.last.responses;
+	const uint64_t firstAttempt = stats.attempts[0] - link.last.attempts[0];
+	const uint64_t failed = (stats.noResponse - link.last.noResponse) + (stats.timeouts - link.last.timeouts);
+	const uint64_t requests = responses + failed;
+	if (requests > 0) {
+		ewma(link.retryRate, static_cast<double>(responses - firstAttempt) / requests);
+		ewma(link.failRate, static_cast<double>(failed) / requests);
+	}
+	ewma(link.inquiryMisses, stats.inquiryMisses - link.last.inquiryMisses);
+	link.last = stats;
+
+	const MtbModule &module = *modules[addr];
+	const Counters dv{
+		module.dvCounter(Mtb::DVCommon::MtbBusReceived),
+		module.dvCounter(Mtb::DVCommon::MtbBusBadCrc),
+		module.dvCounter(Mtb::DVCommon::MtbBusSent),
+		module.dvCounter(Mtb::DVCommon::MtbBusNotSent),
+	};
+	if (auto sample = ratio(link.lastDv.badCrc, dv.badCrc, link.lastDv.received, dv.received))
+		ewma(link.badCrcRate, sample.value());
+	if (auto sample = ratio(link.lastDv.notSent, dv.notSent, link.lastDv.sent, dv.sent))
+		ewma(link.notSentRate, sample.value());
+	link.lastDv = dv;
+
+	// Module's counters are read for the next evaluation (not during FW upgrade, module ignores them)
+	if (!modules[addr]->isFirmwareUpgrading())
+		for (uint8_t dvi : {Mtb::DVCommon::MtbBusReceived, Mtb::DVCommon::MtbBusBadCrc,
+		                    Mtb::DVCommon::MtbBusSent, Mtb::DVCommon::MtbBusNotSent})
+			modules[addr]->pollDv(dvi, []() {});
+
+	const double loss = link.failRate + link.retryRate/2 + link.badCrcRate.value_or(0) + link.notSentRate.value_or(0) +
+	                    BUS_HEALTH_INQUIRY_MISS_PENALTY*link.inquiryMisses;
+	link.score = 100 * (1 - std::min(loss, 1.0));
+
+	BusHealthLevel level = BusHealthLevel::Ok;
+	if (link.score < BUS_HEALTH_BAD)
+		level = BusHealthLevel::Bad;
+	else if (link.score < BUS_HEALTH_DEGRADED)
+		level = BusHealthLevel::Degraded;
+
+	const bool changed = ((link.level != BusHealthLevel::Unknown) && (level != link.level));
+	link.level = level;
+	if (changed) {
+		log("Module "+QString::number(addr)+": MTBbus health "+busHealthLevelToStr(level)+
+		    " (score "+QString::number(link.score, 'f', 1)+")",
+		    (level == BusHealthLevel::Ok) ? Mtb::LogLevel::Info : Mtb::LogLevel::Warning);
+		this->sendLevelChanged(addr);
+	}
+}
+
+QJsonObject BusHealth::json(uint8_t addr) const {
+	const Link &link = this->links[addr];
+	const Mtb::LinkStats &stats = mtbusb.linkStats(addr);
+	QJsonArray attempts;
+	for (uint64_t count : stats.attempts)
+		attempts.push_back(static_cast<qint64>(count));
+
+	return {
+		{"address", addr},
+		{"level", busHealthLevelToStr(link.level)},
+		{"score", link.score},
+		{"rates", QJsonObject{
+			{"retry", link.retryRate},
+			{"fail", link.failRate},
+			{"bad_crc", link.badCrcRate ? QJsonValue(*link.badCrcRate) : QJsonValue()},
+			{"not_sent", link.notSentRate ? QJsonValue(*link.notSentRate) : QJsonValue()},
+			{"inquiry_misses", link.inquiryMisses},
+		}},
+		{"counters", QJsonObject{
+			{"responses", static_cast<qint64>(stats.responses)},
+			{"attempts", attempts},
+			{"no_response", static_cast<qint64>(stats.noResponse)},
+			{"timeouts", static_cast<qint64>(stats.timeouts)},
+			{"inquiry_misses", static_cast<qint64>(stats.inquiryMisses)},
+			{"failures", static_cast<qint64>(stats.failures)},
+		}},
+	};
+}
+
+void BusHealth::sendLevelChanged(uint8_t addr) const {
+	const QJsonObject event = eventLog.record({
+		{"command", "module_bus_health_changed"},
+		{"type", "event"},
+		{"module_bus_health_changed", this->json(addr)},
+	}, addr);
+	for (ClientSession *session : sessions.topoSubscribers())
+		server.send(*session, event);
+	for (ClientSession *session : sessions.subscribers(addr))
+		if (!session->topoSubscribed)
+			server.send(*session, event);
+}
@@ -0,0 +1,79 @@
+#ifndef _BUSHEALTH_H_
+#define _BUSHEALTH_H_
+
+/* MTBbus link quality of each module.
+ * Periodically combines MTB-USB counters (attempts needed to get response,
+ * no-response errors, timeouts, missed inquiries) with module's own MTBbus
+ * counters (DVs 'mtbbus_*', read by BusHealth each period) into rates
+ * (exponentially weighted) and health score 0-100. Change of health level
+ * is reported as 'module_bus_health_changed' event.
+ */
+
+#include <QJsonObject>
+#include <QTimer>
+#include <array>
+#include <optional>
+#include "mtbusb.h"
+
+constexpr size_t BUS_HEALTH_PERIOD_MS = 10000;
+constexpr double BUS_HEALTH_EWMA_ALPHA = 0.3; // weight of the newest period
+constexpr double BUS_HEALTH_DEGRADED = 90; // score below -> degraded
+constexpr double BUS_HEALTH_BAD = 60; // score below -> bad
+constexpr double BUS_HEALTH_INQUIRY_MISS_PENALTY = 0.05; // per missed inquiry per period
+
+enum class BusHealthLevel {
+	Unknown,
+	Ok,
+	Degraded,
+	Bad,
+};
+
+QString busHealthLevelToStr(BusHealthLevel);
+
+class BusHealth {
+public:
+	BusHealth();
+	void start();
+	QJsonObject json(uint8_t addr) const;
+	bool known(uint8_t addr) const { return (this->links[addr].level != BusHealthLevel::Unknown); }
+	void moduleDeleted(uint8_t addr) { this->links[addr] = Link(); }
+
+private:
+	struct Counters {
+		std::optional<uint32_t> received;
+		std::optional<uint32_t> badCrc;
+		std::optional<uint32_t> sent;
+		std::optional<uint32_t> notSent;
+	};
+
+	struct Link {
+		Mtb::LinkStats last; // MTB-USB counters at previous evaluation
+		Counters lastDv; // module's counters at previous evaluation
+		double retryRate = 0; // responses which needed more than 1 attempt / requests
+		double failRate = 0; // requests without response / requests
+		std::optional<double> badCrcRate; // frames with bad CRC received by the module / all frames received
+		std::optional<double> notSentRate; // frames the module failed to send / all frames; empty = no sample yet
+		double inquiryMisses = 0; // missed inquiries per period
+		double score = 100;
+		BusHealthLevel level = BusHealthLevel::Unknown;
+	};
+
+	std::array<Link, Mtb::_MAX_MODULES> links;
+	QTimer timer;
+
+	void evaluate();
+	void evaluate(uint8_t addr, Link&);
+	void sendLevelChanged(uint8_t addr) const;
+	static void ewma(double &value, double sample) {
+		value = BUS_HEALTH_EWMA_ALPHA*sample + (1-BUS_HEALTH_EWMA_ALPHA)*value;
+	}
+	static void ewma(std::optional<double> &value, double sample) {
+		ewma(value.emplace(value.value_or(0)), sample);
+	}
+	static std::optional<double> ratio(std::optional<uint32_t> lastPart, std::optional<uint32_t> part,
+	                                   std::optional<uint32_t> lastOther, std::optional<uint32_t> other);
+};
+
+extern BusHealth busHealth;
+
+#endif
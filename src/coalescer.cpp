@@ -0,0 +1,126 @@
+#include <QJsonArray>
+#include "coalescer.h"
+#include "main.h"
+#include "eventlog.h"
+
+EventCoalescer coalescer;
+
+void EventCoalescer::setWindow(QIODevice *socket, size_t windowMs, bool edges) {
+	if (windowMs == 0) {
+		auto it = this->clients.find(socket);
+		if (it != this->clients.end()) {
+			this->flush(socket); // do not lose already collected changes
+			this->clients.erase(socket);
+		}
+		return;
+	}
+
+	Client &client = this->clients[socket];
+	client.windowMs = windowMs;
+	client.edges = edges;
+	if (client.timer == nullptr) {
+		client.timer = std::make_unique<QTimer>();
+		client.timer->setSingleShot(true);
+		QObject::connect(client.timer.get(), &QTimer::timeout, [this, socket]() { this->flush(socket); });
+	}
+}
+
+void EventCoalescer::clientDisconnected(QIODevice *socket) {
+	this->clients.erase(socket);
+}
+
+bool EventCoalescer::isCoalescing(const QIODevice *socket) const {
+	return this->clients.find(socket) != this->clients.end();
+}
+
+QJsonObject EventCoalescer::json(const QIODevice *socket) const {
+	auto it = this->clients.find(socket);
+	if (it == this->clients.end())
+		return {{"coalesce_ms", 0}};
+	return {
+		{"coalesce_ms", static_cast<int>(it->second.windowMs)},
+		{"edges", it->second.edges},
+	};
+}
+
+void EventCoalescer::inputsChanged(QIODevice *socket, uint8_t addr, uint32_t changedInputs) {
+	auto it = this->clients.find(socket);
+	if (it == this->clients.end())
+		return;
+	Client &client = it->second;
+
+	PendingModule &pending = client.pending[addr];
+	pending.inputs = true;
+	pending.inputEvents++;
+	for (size_t i = 0; (i < COALESCE_MAX_INPUTS) && (changedInputs != 0); i++, changedInputs >>= 1)
+		if (changedInputs & 1)
+			pending.edges[i]++;
+
+	this->schedule(socket, client);
+}
+
+void EventCoalescer::outputsChanged(QIODevice *socket, uint8_t addr) {
+	auto it = this->clients.find(socket);
+	if (it == this->clients.end())
+		return;
+	Client &client = it->second;
+
+	client.pending[addr].outputs = true;
+	this->schedule(socket, client);
+}
+
+void EventCoalescer::schedule(QIODevice*, Client &client) {
+	// Window starts with the first change -> event latency is bounded by the window
+	if (!client.timer->isActive())
+		client.timer->start(client.windowMs);
+}
+
+void EventCoalescer::flush(QIODevice *socket) {
+	auto it = this->clients.find(socket);
+	if ((it == this->clients.end()) || (it->second.pending.empty()))
+		return;
+	Client &client = it->second;
+	client.timer->stop();
+
+	QJsonObject jsonModules;
+	for (const auto &[addr, pending] : client.pending) {
+		if (modules[addr] == nullptr)
+			continue; // module deleted in the meantime
+
+		const MtbModule &module = *modules[addr];
+		QJsonObject jsonModule{
+			{"address", addr},
+			{"type", moduleTypeToStr(module.moduleType())},
+			{"type_code", static_cast<int>(module.moduleType())},
+		};
+		if (pending.inputs) {
+			jsonModule["inputs"] = module.inputsJson();
+			if (client.edges) {
+				QJsonObject edges;
+				for (size_t i = 0; i < COALESCE_MAX_INPUTS; i++)
+					if (pending.edges[i] > 0)
+						edges[QString::number(i)] = static_cast<int>(pending.edges[i]);
+				jsonModule["input_edges"] = edges;
+				jsonModule["input_events"] = static_cast<int>(pending.inputEvents);
+			}
+		}
+		if (pending.outputs)
+			jsonModule["outputs"] = module.outputsJson();
+
+		jsonModules[QString::number(addr)] = jsonModule;
+	}
+	client.pending.clear();
+
+	if (!jsonModules.isEmpty()) {
+		ClientSession *session = sessions.find(socket);
+		if (session != nullptr)
+			session->stats.events++;
+		// All changes up to the current seq are included -> client can resume from it
+		server.send(socket, {
+			{"command", "module_states_changed"},
+			{"type", "event"},
+			{"seq", static_cast<qint64>(eventLog.lastSeq())},
+			{"module_states_changed", QJsonObject{{"modules", jsonModules}}},
+		});
+	}
+}
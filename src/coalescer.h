@@ -0,0 +1,57 @@
+#ifndef _COALESCER_H_
+#define _COALESCER_H_
+
+/* Time-window coalescing of module events.
+ * Client may opt-in (via module_subscribe's 'coalesce_ms') to receive single
+ * 'module_states_changed' event per time window instead of separate
+ * 'module_inputs_changed' & 'module_outputs_changed' events. The event contains
+ * latest state of each changed module. Optionally, number of edges of each
+ * input is reported, so no transition is hidden from the client.
+ */
+
+#include <QIODevice>
+#include <QTimer>
+#include <QJsonObject>
+#include <array>
+#include <map>
+#include <memory>
+
+constexpr size_t COALESCE_MIN_MS = 5;
+constexpr size_t COALESCE_MAX_MS = 1000;
+constexpr size_t COALESCE_MAX_INPUTS = 32;
+
+class EventCoalescer {
+public:
+	void setWindow(QIODevice*, size_t windowMs, bool edges);
+	void clientDisconnected(QIODevice*);
+	bool isCoalescing(const QIODevice*) const;
+	QJsonObject json(const QIODevice*) const;
+
+	// 'changedInputs' = bitmask of inputs changed in this event
+	void inputsChanged(QIODevice*, uint8_t addr, uint32_t changedInputs);
+	void outputsChanged(QIODevice*, uint8_t addr);
+
+private:
+	struct PendingModule {
+		bool inputs = false;
+		bool outputs = false;
+		size_t inputEvents = 0;
+		std::array<size_t, COALESCE_MAX_INPUTS> edges = {0, };
+	};
+
+	struct Client {
+		size_t windowMs;
+		bool edges;
+		std::map<uint8_t, PendingModule> pending;
+		std::unique_ptr<QTimer> timer;
+	};
+
+	std::map<const QIODevice*, Client> clients;
+
+	void schedule(QIODevice*, Client&);
+	void flush(QIODevice*);
+};
+
+extern EventCoalescer coalescer;
+
+#endif
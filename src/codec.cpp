@@ -0,0 +1,34 @@
+#include "codec.h"
+
+JsonCodecPool::~JsonCodecPool() {
+	this->stop();
+}
+
+void JsonCodecPool::start(size_t workers, QObject *resultContext) {
+	this->stop();
+	this->resultContext = resultContext;
+	for (size_t i = 0; i < workers; i++) {
+		auto worker = std::make_unique<Worker>();
+		worker->context = std::make_unique<QObject>();
+		worker->context->moveToThread(&worker->thread);
+		worker->thread.setObjectName("json-codec-"+QString::number(i));
+		worker->thread.start();
+		this->workers.push_back(std::move(worker));
+	}
+}
+
+void JsonCodecPool::stop() {
+	for (auto &worker : this->workers) {
+		worker->thread.quit();
+		worker->thread.wait();
+		worker->context.reset(); // thread finished -> safe to destroy context from here
+	}
+	this->workers.clear();
+	this->next = 0;
+}
+
+size_t JsonCodecPool::assign() {
+	size_t worker = this->next;
+	this->next = (this->next+1) % this->workers.size();
+	return worker;
+}
@@ -0,0 +1,51 @@
+#ifndef _CODEC_H_
+#define _CODEC_H_
+
+/* Pool of JSON codec worker threads.
+ * Parsing of received messages and serialization of sent messages are the
+ * most expensive parts of client handling. Workers do this work out of the
+ * main thread (which owns MTB-USB connection and all the state). Each client
+ * is pinned to single worker, worker processes jobs in FIFO order and results
+ * are delivered back to the main thread in FIFO order -> per-client ordering
+ * of messages is preserved.
+ */
+
+#include <QObject>
+#include <QThread>
+#include <QMetaObject>
+#include <memory>
+#include <vector>
+
+class JsonCodecPool {
+public:
+	~JsonCodecPool();
+
+	// 'resultContext' = object living in the main thread, results are delivered in its thread
+	void start(size_t workers, QObject *resultContext);
+	void stop();
+	bool enabled() const { return !this->workers.empty(); }
+	size_t size() const { return this->workers.size(); }
+	size_t assign(); // choose worker for new client
+
+	// Execute 'work' in worker thread, then call 'done' with work's result in main thread
+	template <typename Work, typename Done>
+	void post(size_t worker, Work work, Done done) {
+		QObject *resultContext = this->resultContext;
+		QMetaObject::invokeMethod(this->workers[worker]->context.get(), [work, done, resultContext]() {
+			auto result = work();
+			QMetaObject::invokeMethod(resultContext, [done, result]() { done(result); }, Qt::QueuedConnection);
+		}, Qt::QueuedConnection);
+	}
+
+private:
+	struct Worker {
+		QThread thread;
+		std::unique_ptr<QObject> context; // lives in 'thread'
+	};
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	QObject *resultContext = nullptr;
+	size_t next = 0;
+};
+
+#endif
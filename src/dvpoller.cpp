@@ -0,0 +1,98 @@
+#include <QJsonArray>
+#include "dvpoller.h"
+#include "main.h"
+#include "qjsonsafe.h"
+
+DvPoller dvPoller;
+
+DvPoller::DvPoller() {
+	QObject::connect(&this->timer, &QTimer::timeout, [this]() { this->tick(); });
+}
+
+static std::vector<QString> parseDvs(const QJsonArray &json) {
+	std::vector<QString> result;
+	for (const auto &value : json)
+		result.push_back(QJsonSafe::safeString(value));
+	return result;
+}
+
+void DvPoller::loadConfig(const QJsonObject &config) {
+	this->timer.stop();
+	this->busShare = config["busShare"].toDouble(0);
+	if ((this->busShare < 0) || (this->busShare > 1))
+		throw JsonParseError("dvPoller: 'busShare' must be in range 0-1!");
+
+	this->dvsAll.clear();
+	this->dvsType.clear();
+	const QJsonObject dvs = config["dvs"].toObject();
+	for (const QString &key : dvs.keys()) {
+		const QJsonArray array = QJsonSafe::safeArray(dvs, key);
+		if (key == "all") {
+			this->dvsAll = parseDvs(array);
+		} else {
+			bool ok;
+			const unsigned type = key.toUInt(&ok);
+			if ((!ok) || (type > 0xFF))
+				throw JsonParseError("dvPoller: invalid module type code: "+key);
+			this->dvsType[type] = parseDvs(array);
+		}
+	}
+
+	if (this->enabled())
+		this->timer.start(this->periodMs());
+}
+
+QJsonObject DvPoller::json() const {
+	return {
+		{"enabled", this->enabled()},
+		{"bus_share", this->busShare},
+		{"period_ms", static_cast<int>(this->periodMs())},
+		{"polled", static_cast<qint64>(this->polled)},
+	};
+}
+
+size_t DvPoller::periodMs() const {
+	if (!this->enabled())
+		return 0;
+	const double busTimeMs = mtbusb.busTimeUs(DV_POLL_FRAME_BYTES) / 1000.0;
+	return std::max(static_cast<size_t>(busTimeMs / this->busShare), DV_POLL_MIN_PERIOD_MS);
+}
+
+std::vector<uint8_t> DvPoller::dvs(const MtbModule &module) const {
+	std::vector<uint8_t> result;
+	auto add = [&module, &result](const std::vector<QString> &names) {
+		for (const QString &name : names) {
+			std::optional<uint8_t> dvi = module.StrToDV(name);
+			if (dvi.has_value())
+				result.push_back(dvi.value()); // unknown DVs of specific module type are silently skipped
+		}
+	};
+	add(this->dvsAll);
+	auto it = this->dvsType.find(static_cast<uint8_t>(module.moduleType()));
+	if (it != this->dvsType.end())
+		add(it->second);
+	return result;
+}
+
+void DvPoller::tick() {
+	this->timer.setInterval(this->periodMs()); // MTBbus speed could have changed
+	if ((this->polling) || (!mtbusb.connected()))
+		return;
+
+	// Find next DV to poll: round-robin over active modules & their DVs
+	for (size_t i = 0; i <= Mtb::_MAX_MODULES; i++) {
+		MtbModule *module = modules[this->addr].get();
+		if ((module != nullptr) && (module->isActive()) && (!module->isFirmwareUpgrading())) {
+			const std::vector<uint8_t> moduleDvs = this->dvs(*module);
+			if (this->dvIndex < moduleDvs.size()) {
+				this->polling = true;
+				this->polled++;
+				module->pollDv(moduleDvs[this->dvIndex], [this]() { this->polling = false; });
+				this->dvIndex++;
+				return;
+			}
+		}
+		this->addr = (this->addr + 1) % Mtb::_MAX_MODULES;
+		this->dvIndex = 0;
+	}
+}
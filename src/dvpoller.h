@@ -0,0 +1,46 @@
+#ifndef _DVPOLLER_H_
+#define _DVPOLLER_H_
+
+/* Background polling of diagnostic values (DVs) of modules.
+ * Configured DVs of all active modules are read one by one in round-robin.
+ * Rate of reading is derived from MTBbus time budget, so bus load caused by
+ * diagnostics is constant regardless of number of clients showing them.
+ * Values are stored in DV cache of each module ('module_diag' with
+ * 'max_age_ms'), changes are reported via 'module_diag_changed' event.
+ */
+
+#include <QJsonObject>
+#include <QTimer>
+#include <map>
+#include <vector>
+
+constexpr size_t DV_POLL_FRAME_BYTES = 16; // request + response with short DV
+constexpr size_t DV_POLL_MIN_PERIOD_MS = 10;
+
+class MtbModule;
+
+class DvPoller {
+public:
+	DvPoller();
+	void loadConfig(const QJsonObject&); // throws JsonParseError
+	bool enabled() const { return (this->busShare > 0); }
+	QJsonObject json() const;
+
+private:
+	double busShare = 0;
+	std::vector<QString> dvsAll; // DVs polled on all modules
+	std::map<uint8_t, std::vector<QString>> dvsType; // type code -> DVs
+	QTimer timer;
+	size_t addr = 0; // next module to poll
+	size_t dvIndex = 0; // next DV of the module to poll
+	bool polling = false; // waiting for response
+	size_t polled = 0;
+
+	void tick();
+	std::vector<uint8_t> dvs(const MtbModule&) const;
+	size_t periodMs() const;
+};
+
+extern DvPoller dvPoller;
+
+#endif
@@ -2,6 +2,7 @@
 #define _ERRORS_H_
 
 constexpr size_t MTB_INVALID_JSON = 1000;
+constexpr size_t MTB_MESSAGE_TOO_LONG = 1001;
 constexpr size_t MTB_MODULE_INVALID_ADDR = 1100;
 constexpr size_t MTB_MODULE_INVALID_PORT = 1101;
 constexpr size_t MTB_MODULE_FAILED = 1102;
@@ -11,6 +12,7 @@ constexpr size_t MTB_MODULE_ACTIVE = 1107;
 constexpr size_t MTB_FILE_CANNOT_ACCESS = 1010;
 constexpr size_t MTB_MODULE_ALREADY_WRITING = 1110;
 constexpr size_t MTB_UNKNOWN_COMMAND = 1020;
+constexpr size_t MTB_BUS_QUOTA_EXCEEDED = 1030;
 
 constexpr size_t MTB_DEVICE_DISCONNECTED = 2004;
 constexpr size_t MTB_ALREADY_STARTED = 2012;
@@ -20,6 +22,8 @@ constexpr size_t MTB_MODULE_IN_BOOTLOADER = 3111;
 constexpr size_t MTB_MODULE_CONFIG_SETTING = 3112;
 constexpr size_t MTB_MODULE_REBOOTING = 3113;
 constexpr size_t MTB_MODULE_FWUPGD_ERROR = 3114;
+constexpr size_t MTB_FIRMWARE_UNKNOWN = 3115;
+constexpr size_t MTB_SCENE_UNKNOWN = 3116;
 
 // Codes directly from MTB-USB errors
 constexpr size_t MTB_MODULE_UNKNOWN_COMMAND = 0x1001;
@@ -28,5 +32,7 @@ constexpr size_t MTB_MODULE_BAD_ADDRESS = 0x1003;
 constexpr size_t MTB_SERIAL_PORT_CLOSED = 0x1010;
 constexpr size_t MTB_USB_NO_RESPONSE = 0x1011;
 constexpr size_t MTB_BUS_NO_RESPONSE = 0x1012;
+constexpr size_t MTB_CMD_EXPIRED = 0x1014;
+constexpr size_t MTB_CMD_CANCELLED = 0x1015;
 
 #endif
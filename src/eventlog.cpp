@@ -0,0 +1,45 @@
+#include "eventlog.h"
+
+EventLog eventLog;
+
+void EventLog::setCapacity(size_t capacity) {
+	// History is dropped, but 'seq' continues -> resuming clients get gap
+	this->ring.assign(std::max<size_t>(capacity, 1), Entry());
+	this->head = 0;
+	this->count = 0;
+}
+
+QJsonObject EventLog::record(QJsonObject event, int addr) {
+	this->seq++;
+	event["seq"] = static_cast<qint64>(this->seq);
+
+	const size_t capacity = this->ring.size();
+	Entry &entry = this->ring[(this->head + this->count) % capacity];
+	entry.seq = this->seq;
+	entry.addr = addr;
+	entry.event = event;
+	if (this->count < capacity)
+		this->count++;
+	else
+		this->head = (this->head + 1) % capacity; // oldest entry overwritten
+
+	return event;
+}
+
+std::optional<std::vector<QJsonObject>> EventLog::since(
+		uint64_t from, const std::bitset<Mtb::_MAX_MODULES> &subscriptions) const {
+	if (from > this->seq)
+		return std::nullopt; // seq from previous run of the daemon
+	const uint64_t oldest = (this->count > 0) ? this->ring[this->head].seq : this->seq+1;
+	if (from+1 < oldest)
+		return std::nullopt; // some events already overwritten
+
+	std::vector<QJsonObject> result;
+	const size_t capacity = this->ring.size();
+	for (size_t i = 0; i < this->count; i++) {
+		const Entry &entry = this->ring[(this->head + i) % capacity];
+		if ((entry.seq > from) && ((entry.addr == EVENT_GLOBAL) || (subscriptions[entry.addr])))
+			result.push_back(entry.event);
+	}
+	return result;
+}
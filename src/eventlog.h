@@ -0,0 +1,48 @@
+#ifndef _EVENTLOG_H_
+#define _EVENTLOG_H_
+
+/* Log of recently emitted events.
+ * Each event gets global sequence number ('seq'). Last N events are held in
+ * a ring buffer, so a client which lost connection can resubscribe with
+ * 'resume_from' and get the events it missed instead of full state transfer.
+ */
+
+#include <QJsonObject>
+#include <bitset>
+#include <vector>
+#include "mtbusb.h"
+
+constexpr size_t EVENT_LOG_DEFAULT_SIZE = 1000;
+constexpr size_t EVENT_LOG_MAX_SIZE = 1000000;
+constexpr int EVENT_GLOBAL = -1; // event not bound to any module (e.g. mtbusb)
+
+class EventLog {
+public:
+	EventLog(size_t capacity = EVENT_LOG_DEFAULT_SIZE) { this->setCapacity(capacity); }
+	void setCapacity(size_t);
+
+	// Assigns 'seq' to the event & stores it. 'addr' = module the event belongs to or EVENT_GLOBAL.
+	QJsonObject record(QJsonObject event, int addr);
+	uint64_t lastSeq() const { return this->seq; }
+
+	// Events with seq > 'from' relevant to 'subscriptions'.
+	// Returns empty optional when some of the events are not available anymore (gap).
+	std::optional<std::vector<QJsonObject>> since(uint64_t from,
+	                                              const std::bitset<Mtb::_MAX_MODULES> &subscriptions) const;
+
+private:
+	struct Entry {
+		uint64_t seq = 0;
+		int addr = EVENT_GLOBAL;
+		QJsonObject event;
+	};
+
+	std::vector<Entry> ring;
+	size_t head = 0; // index of the oldest entry
+	size_t count = 0;
+	uint64_t seq = 0;
+};
+
+extern EventLog eventLog;
+
+#endif
@@ -0,0 +1,102 @@
+#include <QCryptographicHash>
+#include "firmwarestore.h"
+#include "qjsonsafe.h"
+
+FirmwareStore firmwareStore;
+
+FirmwareImage parseFirmware(const QJsonObject &request, size_t pageSize) {
+	FirmwareImage image(pageSize);
+
+	try {
+		if (request.contains("firmware_data")) {
+			const QString format = request["firmware_format"].toString("ihex");
+			const QByteArray data = QJsonSafe::safeString(request, "firmware_data").toLatin1();
+			if (format == "ihex") {
+				image.loadIntelHex(data.constData(), data.size());
+			} else if (format == "binary") {
+				// fromBase64 silently skips invalid characters -> corrupted upload would be flashed shifted
+				const auto decoded = QByteArray::fromBase64Encoding(data, QByteArray::AbortOnBase64DecodingErrors);
+				if (!decoded)
+					throw JsonParseError("Invalid base64 in firmware_data!");
+				const QByteArray &binary = decoded.decoded;
+				const size_t addr = request.contains("firmware_address") ?
+					QJsonSafe::safeUInt(request, "firmware_address") : 0;
+				image.loadBinary(addr, reinterpret_cast<const uint8_t*>(binary.constData()), binary.size());
+			} else {
+				throw JsonParseError("Unknown firmware_format: "+format);
+			}
+		} else {
+			const QJsonObject firmware = QJsonSafe::safeObject(request, "firmware");
+			for (auto it = firmware.begin(); it != firmware.end(); ++it) {
+				const QByteArray data = QJsonSafe::safeString(it.value()).toLatin1();
+				image.loadHexString(it.key().toUInt(), data.constData(), data.size());
+			}
+		}
+	} catch (const FirmwareError &e) {
+		throw JsonParseError(QString("Invalid firmware: ")+e.what());
+	}
+
+	image.finish();
+	if (image.empty())
+		throw JsonParseError("Firmware is empty!");
+	return image;
+}
+
+QString FirmwareStore::add(FirmwareImage &&image, bool &alreadyStored) {
+	// Used blocks are hashed too: explicit 0xFF block is written, omitted block is not
+	const std::vector<uint8_t> &bytes = image.bytes();
+	QByteArray content(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+	for (bool used : image.pagesUsed())
+		content.append(used ? '\x01' : '\x00');
+	const QString hash = QCryptographicHash::hash(content, QCryptographicHash::Sha256).toHex();
+
+	this->uploads++;
+	alreadyStored = (this->images.find(hash) != this->images.end());
+	if (!alreadyStored) {
+		this->evict();
+		this->images.emplace(hash, Entry{std::move(image), {}, {}});
+	}
+	this->images[hash].lastUsed = QDateTime::currentDateTime();
+	return hash;
+}
+
+std::shared_ptr<const FirmwareImage> FirmwareStore::get(const QString &hash, size_t pageSize) {
+	auto it = this->images.find(hash.toLower());
+	if (it == this->images.end())
+		return nullptr;
+
+	Entry &entry = it->second;
+	entry.lastUsed = QDateTime::currentDateTime();
+	std::shared_ptr<const FirmwareImage> &aligned = entry.aligned[pageSize];
+	if (aligned == nullptr)
+		aligned = std::make_shared<const FirmwareImage>(entry.image.realigned(pageSize));
+	else
+		this->hits++;
+	return aligned;
+}
+
+void FirmwareStore::evict() {
+	// Images being written stay alive in modules (shared_ptr), only the store forgets them
+	while (this->images.size() >= FIRMWARE_STORE_MAX_IMAGES) {
+		auto oldest = this->images.begin();
+		for (auto it = this->images.begin(); it != this->images.end(); ++it)
+			if (it->second.lastUsed < oldest->second.lastUsed)
+				oldest = it;
+		this->images.erase(oldest);
+	}
+}
+
+QJsonObject FirmwareStore::json() const {
+	qint64 bytes = 0;
+	for (const auto &[hash, entry] : this->images) {
+		bytes += entry.image.size();
+		for (const auto &[pageSize, aligned] : entry.aligned)
+			bytes += aligned->size();
+	}
+	return {
+		{"images", static_cast<int>(this->images.size())},
+		{"bytes", bytes},
+		{"uploads", static_cast<qint64>(this->uploads)},
+		{"shared_hits", static_cast<qint64>(this->hits)},
+	};
+}
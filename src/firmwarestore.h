@@ -0,0 +1,51 @@
+#ifndef _FIRMWARESTORE_H_
+#define _FIRMWARESTORE_H_
+
+/* Content-addressed store of firmware images.
+ * Client uploads an image once ('firmware_upload') and references it by hash
+ * in any number of 'module_upgrade_fw' requests. Image is decoded once, image
+ * aligned for specific page size is prepared once per page size and shared
+ * (immutable) by all modules being upgraded.
+ * Hash = SHA-256 of the image from address 0 to the end of the last used
+ * 64-byte block, unused bytes filled with 0xFF, followed by one byte per
+ * 64-byte block (1 = block contains data, 0 = not written).
+ */
+
+#include <QJsonObject>
+#include <QString>
+#include <QDateTime>
+#include <map>
+#include <memory>
+#include "firmware.h"
+
+constexpr size_t FIRMWARE_STORE_MAX_IMAGES = 8;
+
+// Parses firmware from request ('firmware' or 'firmware_data'), throws JsonParseError
+FirmwareImage parseFirmware(const QJsonObject &request, size_t pageSize);
+
+class FirmwareStore {
+public:
+	// Returns hash of the image, image must be loaded with FirmwareImage::BLOCK_SIZE pages
+	QString add(FirmwareImage&&, bool &alreadyStored);
+	bool contains(const QString &hash) const { return (this->images.find(hash.toLower()) != this->images.end()); }
+	// Returns nullptr when image with 'hash' is not stored
+	std::shared_ptr<const FirmwareImage> get(const QString &hash, size_t pageSize);
+	QJsonObject json() const;
+
+private:
+	struct Entry {
+		FirmwareImage image;
+		std::map<size_t, std::shared_ptr<const FirmwareImage>> aligned; // page size -> image
+		QDateTime lastUsed;
+	};
+
+	std::map<QString, Entry> images;
+	size_t uploads = 0;
+	size_t hits = 0;
+
+	void evict();
+};
+
+extern FirmwareStore firmwareStore;
+
+#endif
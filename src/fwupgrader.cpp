@@ -0,0 +1,230 @@
+#include <QJsonArray>
+#include <algorithm>
+#include "fwupgrader.h"
+#include "firmwarestore.h"
+#include "main.h"
+#include "eventlog.h"
+#include "logging.h"
+#include "qjsonsafe.h"
+
+FwUpgrader fwUpgrader;
+
+FwUpgrader::FwUpgrader() {
+	this->writeTimer.setSingleShot(true);
+	QObject::connect(&this->writeTimer, &QTimer::timeout, [this]() { this->pace(); });
+}
+
+void FwUpgrader::start(QIODevice *socket, const QJsonObject &request) {
+	if (this->running())
+		return sendError(socket, request, MTB_MODULE_UPGRADING_FW, "Another firmware upgrade is in progress!");
+
+	std::vector<uint8_t> addrs;
+	for (const auto &value : QJsonSafe::safeArray(request, "addresses")) {
+		const size_t addr = QJsonSafe::safeUInt(value);
+		if ((!Mtb::isValidModuleAddress(addr)) || (modules[addr] == nullptr) || (!modules[addr]->isActive()))
+			return sendError(socket, request, MTB_MODULE_INVALID_ADDR, "Invalid module address: "+QString::number(addr));
+		if (modules[addr]->fwPageSize() == 0)
+			return sendError(socket, request, MTB_MODULE_UNSUPPORTED_COMMAND,
+			                 "Module "+QString::number(addr)+" does not support firmware upgrading!");
+		if (modules[addr]->isFirmwareUpgrading())
+			return sendError(socket, request, MTB_MODULE_UPGRADING_FW,
+			                 "Firmware of module "+QString::number(addr)+" is already being upgraded!");
+		if (std::find(addrs.begin(), addrs.end(), addr) != addrs.end())
+			throw JsonParseError("Duplicate address: "+QString::number(addr));
+		addrs.push_back(addr);
+	}
+	if (addrs.empty())
+		throw JsonParseError("No module to upgrade!");
+
+	const double busShare = request["bus_share"].toDouble(FW_UPGRADE_DEFAULT_BUS_SHARE);
+	if ((busShare <= 0) || (busShare > 1))
+		throw JsonParseError("bus_share must be in range (0, 1]");
+	const size_t maxParallel = request.contains("max_parallel") ?
+		QJsonSafe::safeUInt(request, "max_parallel") : addrs.size();
+	if (maxParallel == 0)
+		throw JsonParseError("max_parallel must be at least 1");
+
+	// Firmware sent in the request is stored too -> single image per page size shared by all modules
+	QString hash;
+	if (request.contains("firmware_hash")) {
+		hash = QJsonSafe::safeString(request, "firmware_hash").toLower();
+		if (!firmwareStore.contains(hash))
+			return sendError(socket, request, MTB_FIRMWARE_UNKNOWN, "Unknown firmware_hash!");
+	} else {
+		bool alreadyStored;
+		hash = firmwareStore.add(parseFirmware(request, FirmwareImage::BLOCK_SIZE), alreadyStored);
+	}
+
+	Job job{ServerRequest(socket, request), request["command"].toString(), hash, {}, {}, maxParallel, 0, busShare, {}};
+	for (uint8_t addr : addrs) {
+		job.modules[addr] = Module();
+		job.waiting.push_back(addr);
+	}
+	job.timer.start();
+	this->job = job;
+	this->clock.start();
+	this->nextWriteUs = 0;
+
+	log("Firmware upgrade of "+QString::number(addrs.size())+" modules started", Mtb::LogLevel::Info);
+	this->startNext();
+}
+
+void FwUpgrader::startNext() {
+	if (this->starting)
+		return; // module finished synchronously while being started, loop below continues
+	this->starting = true;
+
+	Job &job = this->job.value();
+	while ((job.running < job.maxParallel) && (!job.waiting.empty())) {
+		const uint8_t addr = job.waiting.front();
+		job.waiting.pop_front();
+		Module &state = job.modules[addr];
+		state.timer.start();
+
+		MtbModule *module = modules[addr].get();
+		if ((module == nullptr) || (!module->isActive()) || (module->isFirmwareUpgrading())) {
+			state.state = "failed";
+			state.error = "Module not available";
+			this->sendProgress(addr);
+			continue;
+		}
+		std::shared_ptr<const FirmwareImage> image = firmwareStore.get(job.hash, module->fwPageSize());
+		if (image == nullptr) { // evicted from store in the meantime
+			state.state = "failed";
+			state.error = "Firmware not available";
+			this->sendProgress(addr);
+			continue;
+		}
+
+		state.state = "upgrading";
+		state.total = image->blocksCnt();
+		job.running++;
+		this->sendProgress(addr);
+
+		module->upgradeFw(job.request, image, {
+			[this, addr](std::function<void()> write) { this->beforeWrite(addr, write); },
+			[this, addr](size_t written, size_t total) { this->progress(addr, written, total); },
+			[this, addr](const QString &error) { this->done(addr, error); },
+		});
+	}
+	this->starting = false;
+
+	if ((job.running == 0) && (job.waiting.empty()))
+		this->finish();
+}
+
+void FwUpgrader::beforeWrite(uint8_t addr, std::function<void()> write) {
+	this->writes.emplace_back(addr, write);
+	this->pace();
+}
+
+void FwUpgrader::pace() {
+	// Block writes of all modules share single MTBbus time budget
+	while (!this->writes.empty()) {
+		const qint64 now = this->clock.nsecsElapsed() / 1000;
+		if (now < this->nextWriteUs) {
+			if (!this->writeTimer.isActive())
+				this->writeTimer.start(static_cast<int>((this->nextWriteUs - now + 999) / 1000));
+			return;
+		}
+
+		const double busShare = this->job.has_value() ? this->job->busShare : FW_UPGRADE_DEFAULT_BUS_SHARE;
+		this->nextWriteUs = std::max(now, this->nextWriteUs) +
+			static_cast<qint64>(mtbusb.busTimeUs(FW_UPGRADE_BLOCK_FRAME_BYTES) / busShare);
+
+		std::function<void()> write = this->writes.front().second;
+		this->writes.pop_front();
+		write();
+	}
+}
+
+void FwUpgrader::progress(uint8_t addr, size_t written, size_t total) {
+	Module &state = this->job->modules[addr];
+	state.written = written;
+	state.total = total;
+	const size_t percent = (total > 0) ? (written*100 / total) : 100;
+	if (percent != state.percent) {
+		state.percent = percent;
+		this->sendProgress(addr);
+	}
+}
+
+void FwUpgrader::done(uint8_t addr, const QString &error) {
+	// Failed module (e.g. MTB-USB disconnected) could have a write waiting for bus budget
+	this->writes.erase(std::remove_if(this->writes.begin(), this->writes.end(),
+	                                  [addr](const auto &write) { return (write.first == addr); }),
+	                   this->writes.end());
+
+	Job &job = this->job.value();
+	Module &state = job.modules[addr];
+	state.state = error.isEmpty() ? "done" : "failed";
+	state.error = error;
+	state.durationMs = state.timer.elapsed();
+	job.running--;
+	this->sendProgress(addr);
+	this->startNext();
+}
+
+void FwUpgrader::finish() {
+	const Job job = this->job.value();
+	this->job.reset();
+	this->writes.clear();
+	this->writeTimer.stop();
+
+	QJsonObject jsonModules;
+	size_t failed = 0;
+	for (const auto &[addr, state] : job.modules) {
+		QJsonObject jsonModule{
+			{"status", (state.state == "done") ? "ok" : "error"},
+			{"duration_ms", static_cast<qint64>(state.durationMs)},
+		};
+		if (state.state != "done") {
+			jsonModule["error"] = jsonError(MTB_MODULE_FWUPGD_ERROR, state.error);
+			failed++;
+		}
+		jsonModules[QString::number(addr)] = jsonModule;
+	}
+
+	log("Firmware upgrade of "+QString::number(job.modules.size())+" modules finished in "+
+	    QString::number(job.timer.elapsed())+" ms, failed: "+QString::number(failed),
+	    (failed > 0) ? Mtb::LogLevel::Warning : Mtb::LogLevel::Info);
+
+	QJsonObject response{
+		{"command", job.command},
+		{"type", "response"},
+		{"status", (failed > 0) ? "error" : "ok"},
+		{"modules", jsonModules},
+		{"duration_ms", static_cast<qint64>(job.timer.elapsed())},
+	};
+	if (failed > 0)
+		response["error"] = jsonError(MTB_MODULE_FWUPGD_ERROR,
+		                              "Firmware upgrade of "+QString::number(failed)+" module(s) failed");
+	if (job.request.id.has_value())
+		response["id"] = static_cast<int>(job.request.id.value());
+	server.send(job.request.socket, response);
+}
+
+void FwUpgrader::sendProgress(uint8_t addr) const {
+	const Module &state = this->job->modules.at(addr);
+	QJsonObject progress{
+		{"address", addr},
+		{"state", state.state},
+		{"written_blocks", static_cast<int>(state.written)},
+		{"total_blocks", static_cast<int>(state.total)},
+	};
+	if (!state.error.isEmpty())
+		progress["error"] = state.error;
+
+	server.send(this->job->request.socket, {
+		{"command", "module_fw_upgrade_progress"},
+		{"type", "event"},
+		{"seq", static_cast<qint64>(eventLog.lastSeq())},
+		{"module_fw_upgrade_progress", progress},
+	});
+}
+
+void FwUpgrader::clientDisconnected(QIODevice *socket) {
+	// Modules could be in bootloader -> upgrade continues without the client
+	if ((this->job.has_value()) && (this->job->request.socket == socket))
+		this->job->request.socket = nullptr;
+}
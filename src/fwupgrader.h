@@ -0,0 +1,74 @@
+#ifndef _FWUPGRADER_H_
+#define _FWUPGRADER_H_
+
+/* Concurrent firmware upgrade of multiple modules ('modules_upgrade_fw').
+ * Modules are upgraded in parallel: while one module programs its flash,
+ * blocks of other modules are transferred over MTBbus. Block writes of all
+ * modules are paced by single MTBbus time budget, so the rest of the bus
+ * traffic keeps running. Client gets 'module_fw_upgrade_progress' events and
+ * a single response when all modules finish.
+ */
+
+#include <QIODevice>
+#include <QJsonObject>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <deque>
+#include <functional>
+#include <map>
+#include <optional>
+#include "server.h"
+#include "firmware.h"
+
+constexpr double FW_UPGRADE_DEFAULT_BUS_SHARE = 0.5;
+constexpr size_t FW_UPGRADE_BLOCK_FRAME_BYTES = FirmwareImage::BLOCK_SIZE + 10; // write request + ack
+
+class FwUpgrader {
+public:
+	FwUpgrader();
+	void start(QIODevice*, const QJsonObject &request); // throws JsonParseError
+	bool running() const { return this->job.has_value(); }
+	void clientDisconnected(QIODevice*);
+
+private:
+	struct Module {
+		QString state = "waiting"; // waiting/upgrading/done/failed
+		size_t written = 0; // blocks
+		size_t total = 0;
+		size_t percent = 0; // last reported
+		QString error;
+		QElapsedTimer timer;
+		qint64 durationMs = 0;
+	};
+
+	struct Job {
+		ServerRequest request;
+		QString command;
+		QString hash; // firmware in store
+		std::map<uint8_t, Module> modules;
+		std::deque<uint8_t> waiting; // modules not started yet
+		size_t maxParallel;
+		size_t running = 0;
+		double busShare;
+		QElapsedTimer timer;
+	};
+
+	std::optional<Job> job;
+	std::deque<std::pair<uint8_t, std::function<void()>>> writes; // block writes waiting for bus budget
+	QElapsedTimer clock;
+	qint64 nextWriteUs = 0;
+	QTimer writeTimer;
+	bool starting = false;
+
+	void startNext();
+	void beforeWrite(uint8_t addr, std::function<void()> write);
+	void pace();
+	void progress(uint8_t addr, size_t written, size_t total);
+	void done(uint8_t addr, const QString &error);
+	void finish();
+	void sendProgress(uint8_t addr) const;
+};
+
+extern FwUpgrader fwUpgrader;
+
+#endif
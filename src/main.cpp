@@ -4,10 +4,23 @@
 #include <QFile>
 #include <QIODevice>
 #include <QJsonDocument>
+#include <QElapsedTimer>
+#include <QTcpSocket>
+#include <QThread>
 #include "main.h"
 #include "mtbusb-common.h"
 #include "errors.h"
 #include "logging.h"
+#include "coalescer.h"
+#include "eventlog.h"
+#include "sharedstate.h"
+#include "dvpoller.h"
+#include "bushealth.h"
+#include "firmwarestore.h"
+#include "fwupgrader.h"
+#include "rules.h"
+#include "outputpulses.h"
+#include "scenes.h"
 
 #include "uni.h"
 #include "unis.h"
@@ -20,8 +33,6 @@
 Mtb::MtbUsb mtbusb;
 DaemonServer server;
 std::array<std::unique_ptr<MtbModule>, Mtb::_MAX_MODULES> modules;
-std::array<std::unordered_set<QTcpSocket*>, Mtb::_MAX_MODULES> subscribes;
-std::unordered_set<QTcpSocket*> topoSubscribes;
 
 #ifdef Q_OS_WIN
 static BOOL WINAPI console_ctrl_handler(DWORD dwCtrlType);
@@ -43,7 +54,8 @@ const QJsonObject DEFAULT_CONFIG = {
 		{"host", "127.0.0.1"},
 		{"port", static_cast<int>(SERVER_DEFAULT_PORT)},
 		{"keepAlive", true},
-		{"allowedClients", QJsonArray{"127.0.0.1"}}
+		{"allowedClients", QJsonArray{"127.0.0.1"}},
+		{"maxMessageSize", static_cast<int>(SERVER_DEFAULT_MAX_MESSAGE_SIZE)},
 	}},
 	{"mtb-usb", QJsonObject{
 		{"port", "auto"},
@@ -62,12 +74,28 @@ const QJsonObject DEFAULT_CONFIG = {
 };
 
 
+// Optional integer config value, throws JsonParseError when out of range
+static int configInt(const QJsonObject &json, const QString &key, int defaultValue, int min, int max) {
+	if (!json.contains(key))
+		return defaultValue;
+	const double value = json[key].toDouble(min-1.0);
+	if ((value < min) || (value > max) || (value != static_cast<int>(value)))
+		throw JsonParseError(key+" must be an integer in range "+QString::number(min)+"-"+QString::number(max));
+	return static_cast<int>(value);
+}
+
 DaemonCoreApplication::DaemonCoreApplication(int &argc, char **argv)
      : QCoreApplication(argc, argv) {
-	QObject::connect(&server, SIGNAL(jsonReceived(QTcpSocket*, const QJsonObject&)),
-	                 this, SLOT(serverReceived(QTcpSocket*, const QJsonObject&)), Qt::DirectConnection);
-	QObject::connect(&server, SIGNAL(clientDisconnected(QTcpSocket*)),
-	                 this, SLOT(serverClientDisconnected(QTcpSocket*)), Qt::DirectConnection);
+	QObject::connect(&server, SIGNAL(jsonReceived(QIODevice*, const QJsonObject&)),
+	                 this, SLOT(serverReceived(QIODevice*, const QJsonObject&)), Qt::DirectConnection);
+	QObject::connect(&server, SIGNAL(clientConnected(QIODevice*)),
+	                 this, SLOT(serverClientConnected(QIODevice*)), Qt::DirectConnection);
+	QObject::connect(&server, SIGNAL(clientDisconnected(QIODevice*)),
+	                 this, SLOT(serverClientDisconnected(QIODevice*)), Qt::DirectConnection);
+	QObject::connect(&server, SIGNAL(errorSent(QIODevice*, const QJsonObject&)),
+	                 this, SLOT(serverErrorSent(QIODevice*, const QJsonObject&)), Qt::DirectConnection);
+
+	this->registerCommands();
 
 	QObject::connect(&t_reconnect, SIGNAL(timeout()), this, SLOT(tReconnectTick()));
 	QObject::connect(&t_reactivate, SIGNAL(timeout()), this, SLOT(tReactivateTick()));
@@ -84,6 +112,8 @@ DaemonCoreApplication::DaemonCoreApplication(int &argc, char **argv)
 	                 this, SLOT(mtbUsbOnInputsChange(uint8_t, const std::vector<uint8_t>&)), Qt::DirectConnection);
 	QObject::connect(&mtbusb, SIGNAL(onModuleDiagStateChange(uint8_t, const std::vector<uint8_t>&)),
 	                 this, SLOT(mtbUsbOnDiagStateChange(uint8_t, const std::vector<uint8_t>&)), Qt::DirectConnection);
+	QObject::connect(&mtbusb, SIGNAL(onBusTime(Mtb::CmdOrigin, uint32_t)),
+	                 this, SLOT(mtbUsbOnBusTime(Mtb::CmdOrigin, uint32_t)), Qt::DirectConnection);
 
 #ifdef Q_OS_WIN
 	SetConsoleOutputCP(CP_UTF8);
@@ -118,6 +148,24 @@ DaemonCoreApplication::DaemonCoreApplication(int &argc, char **argv)
 		const QJsonObject serverConfig = this->config["server"].toObject();
 		size_t port = serverConfig["port"].toInt();
 		bool keepAlive = serverConfig["keepAlive"].toBool(true);
+		size_t workers;
+		try {
+			server.setMaxMessageSize(configInt(serverConfig, "maxMessageSize",
+			                                   static_cast<int>(SERVER_DEFAULT_MAX_MESSAGE_SIZE),
+			                                   static_cast<int>(SERVER_MIN_MAX_MESSAGE_SIZE),
+			                                   static_cast<int>(SERVER_MAX_MAX_MESSAGE_SIZE)));
+			eventLog.setCapacity(configInt(serverConfig, "eventHistory", static_cast<int>(EVENT_LOG_DEFAULT_SIZE),
+			                               1, static_cast<int>(EVENT_LOG_MAX_SIZE)));
+			workers = configInt(serverConfig, "workers", 0, 0, std::max(QThread::idealThreadCount(), 1));
+		} catch (const JsonParseError &e) {
+			log(QString("Invalid server config: ")+e.what(), Mtb::LogLevel::Error);
+			startError = StartupError::ConfigLoad;
+			return;
+		}
+		if (workers > 0) {
+			log("Starting "+QString::number(workers)+" JSON codec workers...", Mtb::LogLevel::Info);
+			server.startWorkers(workers);
+		}
 		QHostAddress host(serverConfig["host"].toString());
 		log("Starting server: "+host.toString()+":"+QString::number(port)+"...", Mtb::LogLevel::Info);
 		try {
@@ -127,8 +175,36 @@ DaemonCoreApplication::DaemonCoreApplication(int &argc, char **argv)
 			startError = StartupError::ServerStart;
 			return;
 		}
+
+		if (serverConfig.contains("local")) {
+			const QJsonObject localConfig = serverConfig["local"].toObject();
+			const QString path = localConfig["path"].toString();
+			log("Starting local server: "+path+"...", Mtb::LogLevel::Info);
+			try {
+				server.listenLocal(path, localSocketOptions(localConfig));
+			} catch (const std::exception& e) {
+				log(e.what(), Mtb::LogLevel::Error);
+				startError = StartupError::ServerStart;
+				return;
+			}
+		}
+	}
+
+	if (this->config.contains("sharedState")) {
+		const QString path = this->config["sharedState"].toObject()["path"].toString();
+		log("Exporting modules state to "+path+"...", Mtb::LogLevel::Info);
+		try {
+			sharedState.open(path);
+			for (size_t addr = 0; addr < Mtb::_MAX_MODULES; addr++)
+				if (modules[addr] != nullptr)
+					sharedState.update(addr, *modules[addr]);
+		} catch (const std::exception& e) {
+			log(e.what(), Mtb::LogLevel::Error); // not fatal, TCP clients are served anyway
+		}
 	}
 
+	busHealth.start();
+
 	this->mtbUsbConnect();
 	if (!mtbusb.connected()) {
 		this->t_reconnect.start(T_RECONNECT_PERIOD);
@@ -137,6 +213,13 @@ DaemonCoreApplication::DaemonCoreApplication(int &argc, char **argv)
 	this->t_reactivate.start(T_REACTIVATE_PERIOD);
 }
 
+DaemonCoreApplication::~DaemonCoreApplication() {
+	// Modules release their outputs in 'sessions' on destruction; 'modules' is a constant-initialized
+	// global, so it would be destroyed only after dynamically-initialized 'sessions'
+	for (auto &module : modules)
+		module.reset();
+}
+
 /* MTB-USB handling ----------------------------------------------------------*/
 
 void DaemonCoreApplication::mtbUsbConnect() {
@@ -302,8 +385,9 @@ void DaemonCoreApplication::mtbUsbOnNewModule(uint8_t addr) {
 		this->newTimerPending = true;
 		QTimer::singleShot(T_MTBUSB_EVENT_PERIOD, [this]() {
 			this->newTimerPending = false;
-			for (auto& socket : topoSubscribes)
-				server.send(socket, this->mtbUsbEvent());
+			const QJsonObject event = this->mtbUsbEvent();
+			for (ClientSession *session : sessions.topoSubscribers())
+				server.send(*session, event);
 		});
 	}
 }
@@ -321,8 +405,9 @@ void DaemonCoreApplication::mtbUsbOnModuleFail(uint8_t addr) {
 		this->failTimerPending = true;
 		QTimer::singleShot(T_MTBUSB_EVENT_PERIOD, [this]() {
 			this->failTimerPending = false;
-			for (auto& socket : topoSubscribes)
-				server.send(socket, this->mtbUsbEvent());
+			const QJsonObject event = this->mtbUsbEvent();
+			for (ClientSession *session : sessions.topoSubscribers())
+				server.send(*session, event);
 		});
 	}
 }
@@ -337,6 +422,11 @@ void DaemonCoreApplication::mtbUsbOnDiagStateChange(uint8_t addr, const std::vec
 		modules[addr]->mtbBusDiagStateChanged(data);
 }
 
+void DaemonCoreApplication::mtbUsbOnBusTime(Mtb::CmdOrigin origin, uint32_t us) {
+	if (ClientSession *session = sessions.findById(origin))
+		session->busQuota.consume(us);
+}
+
 void DaemonCoreApplication::tReconnectTick() {
 	if (mtbusb.connected())
 		this->t_reconnect.stop();
@@ -375,64 +465,68 @@ void DaemonCoreApplication::tReactivateTick() {
 
 /* JSON server handling ------------------------------------------------------*/
 
-void DaemonCoreApplication::serverReceived(QTcpSocket *socket, const QJsonObject &request) {
+void DaemonCoreApplication::registerCommands() {
+	using App = DaemonCoreApplication;
+	this->commands = {
+		{"mtbusb", {&App::serverCmdMtbusb}}, // write access checked inside (only speed change)
+		{"version", {&App::serverCmdVersion}},
+		{"save_config", {&App::serverCmdSaveConfig, true}},
+		{"load_config", {&App::serverCmdLoadConfig, true}},
+		{"module", {&App::serverCmdModule}},
+		{"module_delete", {&App::serverCmdModuleDelete}},
+		{"modules", {&App::serverCmdModules}},
+		{"module_subscribe", {&App::serverCmdModuleSubscribe}},
+		{"module_unsubscribe", {&App::serverCmdModuleUnsubscribe}},
+		{"my_module_subscribes", {&App::serverCmdMyModuleSubscribes}},
+		{"module_set_config", {&App::serverCmdModuleSetConfig, true, false, true}}, // can create new module
+		{"module_specific_command", {&App::serverCmdModuleSpecificCommand, true, false, true}},
+		{"set_address", {&App::serverCmdSetAddress, false, false, true}},
+		{"reset_my_outputs", {&App::serverCmdResetMyOutputs, true}},
+		{"topology_subscribe", {&App::serverCmdTopoSubscribe}},
+		{"topology_unsubscribe", {&App::serverCmdTopoUnsubscribe}},
+		{"stats", {&App::serverCmdStats}},
+		{"bus_health", {&App::serverCmdBusHealth}},
+		{"heartbeat", {&App::serverCmdHeartbeat}},
+		{"firmware_upload", {&App::serverCmdFirmwareUpload, true}},
+		{"modules_upgrade_fw", {&App::serverCmdModulesUpgradeFw, true}},
+		{"rules", {&App::serverCmdRules}},
+		{"rules_set", {&App::serverCmdRulesSet, true}},
+		{"scenes", {&App::serverCmdScenes}},
+		{"scene_set", {&App::serverCmdSceneSet, true}},
+		{"scene_delete", {&App::serverCmdSceneDelete, true}},
+		{"scene_apply", {&App::serverCmdSceneApply, true, false, true}},
+	};
+
+	// Commands handled by specific module
+	const QHash<QString, MtbModule::JsonCommand>& moduleCommands = MtbModule::jsonCommands();
+	for (auto it = moduleCommands.begin(); it != moduleCommands.end(); ++it) {
+		if (this->commands.contains(it.key()))
+			continue; // daemon-level command takes precedence
+		auto handler = it.value().handler;
+		this->commands[it.key()] = ServerCommand{
+			[handler](DaemonCoreApplication*, QIODevice *socket, const QJsonObject &request) {
+				(modules[request["address"].toInt()].get()->*handler)(socket, request);
+			},
+			it.value().needsWriteAccess,
+			true,
+			true,
+		};
+	}
+}
+
+void DaemonCoreApplication::serverReceived(QIODevice *socket, const QJsonObject &request) {
 	try {
 		if (!request.contains("command"))
 			return; // probably some kind of empty ping or something like this -> no response
 		QString command = QJsonSafe::safeString(request, "command");
 
-		if (command == "mtbusb") {
-			this->serverCmdMtbusb(socket, request);
-
-		} else if (command == "version") {
-			this->serverCmdVersion(socket, request);
-
-		} else if (command == "save_config") {
-			this->serverCmdSaveConfig(socket, request);
-
-		} else if (command == "load_config") {
-			this->serverCmdLoadConfig(socket, request);
-
-		} else if (command == "module") {
-			this->serverCmdModule(socket, request);
-
-		} else if (command == "module_delete") {
-			this->serverCmdModuleDelete(socket, request);
-
-		} else if (command == "modules") {
-			this->serverCmdModules(socket, request);
-
-		} else if (command == "module_subscribe") {
-			this->serverCmdModuleSubscribe(socket, request);
-
-		} else if (command == "module_unsubscribe") {
-			this->serverCmdModuleUnsubscribe(socket, request);
-
-		} else if (command == "my_module_subscribes") {
-			this->serverCmdMyModuleSubscribes(socket, request);
-
-		} else if (command == "module_set_config") {
-			this->serverCmdModuleSetConfig(socket, request);
-
-		} else if (command == "module_specific_command") {
-			this->serverCmdModuleSpecificCommand(socket, request);
-
-		} else if (command == "set_address") {
-			this->serverCmdSetAddress(socket, request);
-
-		} else if (command == "reset_my_outputs") {
-			this->serverCmdResetMyOutputs(socket, request);
-
-		} else if (command == "topology_subscribe") {
-			this->serverCmdTopoSubscribe(socket, request);
-
-		} else if (command == "topology_unsubscribe") {
-			this->serverCmdTopoUnsubscribe(socket, request);
-
+		auto it = this->commands.find(command);
+		if (it != this->commands.end()) {
+			this->dispatch(it.value(), socket, request);
 		} else if (command.startsWith("module_")) {
 			size_t addr = request["address"].toInt();
 			if ((Mtb::isValidModuleAddress(addr)) && (modules[addr] != nullptr)) {
-				modules[addr]->jsonCommand(socket, request, this->hasWriteAccess(socket));
+				sendError(socket, request, MTB_UNKNOWN_COMMAND, "Unknown command!");
 			} else {
 				sendError(socket, request, MTB_MODULE_INVALID_ADDR, "Invalid module address");
 			}
@@ -450,7 +544,60 @@ void DaemonCoreApplication::serverReceived(QTcpSocket *socket, const QJsonObject
 	}
 }
 
-void DaemonCoreApplication::serverCmdMtbusb(QTcpSocket *socket, const QJsonObject &request) {
+void DaemonCoreApplication::serverErrorSent(QIODevice*, const QJsonObject &response) {
+	// Any error response counts, including errors reported asynchronously (e.g. no response from module)
+	auto it = this->commands.find(response["command"].toString());
+	if (it != this->commands.end())
+		it.value().stats.errors++;
+}
+
+void DaemonCoreApplication::dispatch(ServerCommand &command, QIODevice *socket, const QJsonObject &request) {
+	QElapsedTimer timer;
+	timer.start();
+	auto account = [&command, socket, &timer]() {
+		const uint64_t us = timer.nsecsElapsed() / 1000;
+		command.stats.add(us);
+		ClientSession *session = sessions.find(socket); // lookup again: handler could end the session
+		if (session != nullptr) {
+			session->stats.requests++;
+			session->stats.handlingUs += us;
+		}
+	};
+
+	try {
+		if (command.needsModule) {
+			size_t addr = request["address"].toInt();
+			if ((!Mtb::isValidModuleAddress(addr)) || (modules[addr] == nullptr)) {
+				sendError(socket, request, MTB_MODULE_INVALID_ADDR, "Invalid module address");
+				return account();
+			}
+		}
+		if ((command.needsWriteAccess) && (!this->hasWriteAccess(socket))) {
+			sendAccessDenied(socket, request);
+			return account();
+		}
+		ClientSession *session = sessions.find(socket);
+		if ((command.usesBus) && (session != nullptr) && (!session->busQuota.admit())) {
+			sendError(socket, request, MTB_BUS_QUOTA_EXCEEDED, "MTBbus quota exceeded, retry after "+
+			          QString::number(session->busQuota.retryAfterMs())+" ms");
+			return account();
+		}
+
+		// MTBbus commands sent by handler are accounted to the client & dropped after client's deadline
+		QDeadlineTimer deadline(QDeadlineTimer::Forever);
+		if (request.contains("deadline_ms"))
+			deadline = QDeadlineTimer(static_cast<qint64>(QJsonSafe::safeUInt(request, "deadline_ms")));
+		Mtb::MtbUsb::OriginScope origin(mtbusb, (session != nullptr) ? session->id : Mtb::ORIGIN_DAEMON, deadline);
+		command.handler(this, socket, request);
+	} catch (...) {
+		account(); // error is counted when the error response is sent by serverReceived
+		throw;
+	}
+
+	account();
+}
+
+void DaemonCoreApplication::serverCmdMtbusb(QIODevice *socket, const QJsonObject &request) {
 	if (request.contains("mtbusb")) { // Changing MTB-USB
 		QJsonObject jsonMtbUsb = QJsonSafe::safeObject(request, "mtbusb");
 		if (jsonMtbUsb.contains("speed")) { // Change MTBbus speed
@@ -483,7 +630,7 @@ void DaemonCoreApplication::serverCmdMtbusb(QTcpSocket *socket, const QJsonObjec
 	server.send(socket, response);
 }
 
-void DaemonCoreApplication::serverCmdVersion(QTcpSocket *socket, const QJsonObject &request) {
+void DaemonCoreApplication::serverCmdVersion(QIODevice *socket, const QJsonObject &request) {
 	QJsonObject response = jsonOkResponse(request);
 	QJsonObject version{
 		{"sw_version", VERSION},
@@ -494,10 +641,7 @@ void DaemonCoreApplication::serverCmdVersion(QTcpSocket *socket, const QJsonObje
 	server.send(socket, response);
 }
 
-void DaemonCoreApplication::serverCmdSaveConfig(QTcpSocket *socket, const QJsonObject &request) {
-	if (!this->hasWriteAccess(socket))
-		return sendAccessDenied(socket, request);
-
+void DaemonCoreApplication::serverCmdSaveConfig(QIODevice *socket, const QJsonObject &request) {
 	QString filename = this->configFileName;
 	if (request.contains("filename"))
 		filename = QJsonSafe::safeString(request, "filename");
@@ -520,10 +664,7 @@ void DaemonCoreApplication::serverCmdSaveConfig(QTcpSocket *socket, const QJsonO
 	server.send(socket, response);
 }
 
-void DaemonCoreApplication::serverCmdLoadConfig(QTcpSocket *socket, const QJsonObject &request) {
-	if (!this->hasWriteAccess(socket))
-		return sendAccessDenied(socket, request);
-
+void DaemonCoreApplication::serverCmdLoadConfig(QIODevice *socket, const QJsonObject &request) {
 	QString filename = this->configFileName;
 	if (request.contains("filename"))
 		filename = QJsonSafe::safeString(request, "filename");
@@ -551,12 +692,12 @@ void DaemonCoreApplication::serverCmdLoadConfig(QTcpSocket *socket, const QJsonO
 	server.send(socket, response);
 }
 
-void DaemonCoreApplication::serverCmdModule(QTcpSocket *socket, const QJsonObject &request) {
+void DaemonCoreApplication::serverCmdModule(QIODevice *socket, const QJsonObject &request) {
 	QJsonObject response = jsonOkResponse(request);
 
 	size_t addr = request["address"].toInt();
 	if ((Mtb::isValidModuleAddress(addr)) && (modules[addr] != nullptr)) {
-		response["module"] = modules[addr]->moduleInfo(request["state"].toBool(), true);
+		response["module"] = modules[addr]->cachedModuleInfo(request["state"].toBool(), true);
 		response["status"] = "ok";
 	} else {
 		response["status"] = "error";
@@ -566,7 +707,7 @@ void DaemonCoreApplication::serverCmdModule(QTcpSocket *socket, const QJsonObjec
 	server.send(socket, response);
 }
 
-void DaemonCoreApplication::serverCmdModuleDelete(QTcpSocket *socket, const QJsonObject &request) {
+void DaemonCoreApplication::serverCmdModuleDelete(QIODevice *socket, const QJsonObject &request) {
 	QJsonObject response = jsonOkResponse(request);
 
 	size_t addr = request["address"].toInt();
@@ -578,38 +719,71 @@ void DaemonCoreApplication::serverCmdModuleDelete(QTcpSocket *socket, const QJso
 	} else if (modules[addr]->isActive() || modules[addr]->isActivating()) {
 		response["status"] = "error";
 		response["error"] = DaemonServer::error(MTB_MODULE_ACTIVE, "Cannot delete active module");
+	} else if (modules[addr]->isFirmwareUpgrading()) {
+		response["status"] = "error";
+		response["error"] = DaemonServer::error(MTB_MODULE_UPGRADING_FW, "Firmware of module is being upgraded!");
 	} else {
 		modules[addr] = nullptr;
+		this->moduleDeletedVersion[addr] = MtbModule::nextGlobalVersion();
+		sharedState.clear(addr);
+		busHealth.moduleDeleted(addr);
+		if (rulesEngine.moduleDeleted(addr))
+			this->config["rules"] = rulesEngine.configJson(); // persisted by 'save_config'
+		if (sceneStore.moduleDeleted(addr))
+			this->config["scenes"] = sceneStore.configJson();
 		log("Module "+QString::number(addr)+": deleted on client request!", Mtb::LogLevel::Info);
 
 		// Send module-delete event
-		std::unordered_set<QTcpSocket*> clients(topoSubscribes);
-		clients.insert(subscribes[addr].begin(), subscribes[addr].end());
-		for (auto& sock : clients) {
-			if (socket != sock) {
-				server.send(sock, {
-					{"command", "module_deleted"},
-					{"type", "event"},
-					{"module", static_cast<int>(addr)},
-				});
-			}
-		}
+		const QJsonObject event = eventLog.record({
+			{"command", "module_deleted"},
+			{"type", "event"},
+			{"module", static_cast<int>(addr)},
+		}, addr);
+		for (ClientSession *session : sessions.topoSubscribers())
+			if (session->socket != socket)
+				server.send(*session, event);
+		for (ClientSession *session : sessions.subscribers(addr))
+			if ((!session->topoSubscribed) && (session->socket != socket))
+				server.send(*session, event);
 	}
 
 	server.send(socket, response);
 }
 
-void DaemonCoreApplication::serverCmdModules(QTcpSocket *socket, const QJsonObject &request) {
+void DaemonCoreApplication::serverCmdModules(QIODevice *socket, const QJsonObject &request) {
 	QJsonObject response = jsonOkResponse(request);
 	QJsonObject jsonModules;
+	const bool state = request["state"].toBool();
+
+	// Client sends 'version' from previous response -> only modules changed since then are sent
+	std::optional<uint64_t> sinceVersion;
+	if (request.contains("since_version")) {
+		const double since = request["since_version"].toDouble(-1);
+		if (since < 0)
+			throw JsonParseError("since_version must be a non-negative number");
+		sinceVersion = static_cast<uint64_t>(since);
+		if (!request.contains("epoch"))
+			throw JsonParseError("since_version requires epoch");
+		if ((static_cast<qint64>(request["epoch"].toDouble(-1)) != this->runEpoch) ||
+		    (sinceVersion.value() > MtbModule::globalVersion()))
+			sinceVersion.reset(); // version from previous run of the daemon -> send everything
+	}
 
+	QJsonArray deleted;
 	for (size_t i = 0; i < Mtb::_MAX_MODULES; i++) {
-		if (modules[i] != nullptr)
-			jsonModules[QString::number(i)] = modules[i]->moduleInfo(
-				request["state"].toBool(), true
-			);
+		if (modules[i] != nullptr) {
+			if ((!sinceVersion.has_value()) || (modules[i]->stateVersion() > sinceVersion.value()))
+				jsonModules[QString::number(i)] = modules[i]->cachedModuleInfo(state, true);
+		} else if ((sinceVersion.has_value()) && (this->moduleDeletedVersion[i] > sinceVersion.value())) {
+			deleted.push_back(static_cast<int>(i));
+		}
 	}
 	response["modules"] = jsonModules;
+	response["version"] = static_cast<qint64>(MtbModule::globalVersion());
+	response["epoch"] = this->runEpoch;
+	response["full"] = !sinceVersion.has_value();
+	if (sinceVersion.has_value())
+		response["deleted"] = deleted;
 
 	server.send(socket, response);
 }
@@ -627,9 +801,36 @@ bool DaemonCoreApplication::validateAddrs(const QJsonArray &addrs, QJsonObject&
 	return true;
 }
 
-void DaemonCoreApplication::serverCmdModuleSubscribe(QTcpSocket *socket, const QJsonObject &request) {
+void DaemonCoreApplication::serverCmdModuleSubscribe(QIODevice *socket, const QJsonObject &request) {
 	// First validate addresses (do not change anything if validation fails)
 	QJsonObject response = jsonOkResponse(request);
+	ClientSession &session = sessions.at(socket);
+
+	std::optional<size_t> coalesceMs;
+	if (request.contains("coalesce_ms")) {
+		coalesceMs = QJsonSafe::safeUInt(request, "coalesce_ms");
+		if ((coalesceMs.value() != 0) && ((coalesceMs.value() < COALESCE_MIN_MS) || (coalesceMs.value() > COALESCE_MAX_MS)))
+			throw JsonParseError("coalesce_ms must be 0 or "+QString::number(COALESCE_MIN_MS)+"-"+
+			                     QString::number(COALESCE_MAX_MS));
+	}
+	const bool edges = request.contains("edges") ? QJsonSafe::safeBool(request, "edges") : false;
+	std::optional<bool> diag;
+	if (request.contains("diag"))
+		diag = QJsonSafe::safeBool(request, "diag");
+	std::optional<bool> inputsDelta;
+	if (request.contains("inputs_delta"))
+		inputsDelta = QJsonSafe::safeBool(request, "inputs_delta");
+	std::optional<uint64_t> resumeFrom;
+	if (request.contains("resume_from")) {
+		const double from = request["resume_from"].toDouble(-1);
+		if (from < 0)
+			throw JsonParseError("resume_from must be a non-negative number");
+		resumeFrom = static_cast<uint64_t>(from);
+		if (!request.contains("epoch"))
+			throw JsonParseError("resume_from requires epoch");
+	}
+	std::vector<QJsonObject> missed;
+
 	if (request.contains("addresses")) {
 		const QJsonArray reqAddrs = QJsonSafe::safeArray(request, "addresses");
 		if (!DaemonCoreApplication::validateAddrs(reqAddrs, response))
@@ -637,21 +838,55 @@ void DaemonCoreApplication::serverCmdModuleSubscribe(QTcpSocket *socket, const Q
 
 		// Addresses already validated
 		for (const auto &value : reqAddrs)
-			subscribes[QJsonSafe::safeUInt(value)].emplace(socket);
+			sessions.subscribe(session, QJsonSafe::safeUInt(value));
 		response["addresses"] = reqAddrs;
 	} else {
 		// Subscribe to all addresses
 		for (size_t addr = 1; addr < Mtb::_MAX_MODULES; addr++)
-			subscribes[addr].emplace(socket);
+			sessions.subscribe(session, addr);
+	}
+
+	if (coalesceMs.has_value()) {
+		coalescer.setWindow(socket, coalesceMs.value(), edges);
+		session.coalescing = coalescer.isCoalescing(socket);
+		response["coalescing"] = coalescer.json(socket);
+	}
+
+	if (diag.has_value()) {
+		session.diagEvents = diag.value();
+		response["diag"] = session.diagEvents;
+	}
+
+	if (inputsDelta.has_value()) {
+		session.inputsDelta = inputsDelta.value();
+		response["inputs_delta"] = session.inputsDelta;
+	}
+
+	if (resumeFrom.has_value()) {
+		// Missed events of all client's subscribed modules are sent after the response
+		// 'seq' from previous run of the daemon -> events are not available (even if 'seq' is lower)
+		const bool sameRun = (static_cast<qint64>(request["epoch"].toDouble(-1)) == this->runEpoch);
+		auto events = sameRun ? eventLog.since(resumeFrom.value(), session.subscriptions) : std::nullopt;
+		response["resume"] = QJsonObject{
+			{"status", events.has_value() ? "ok" : "gap"},
+			{"events", events.has_value() ? static_cast<int>(events.value().size()) : 0},
+			{"seq", static_cast<qint64>(eventLog.lastSeq())},
+		};
+		if (events.has_value())
+			missed = std::move(events.value());
 	}
 
 cmdModuleSubscribeEnd:
+	response["epoch"] = this->runEpoch;
 	server.send(socket, response);
+	for (const QJsonObject &event : missed)
+		server.send(socket, event);
 }
 
-void DaemonCoreApplication::serverCmdModuleUnsubscribe(QTcpSocket *socket, const QJsonObject &request) {
+void DaemonCoreApplication::serverCmdModuleUnsubscribe(QIODevice *socket, const QJsonObject &request) {
 	// First validate addresses (do not change anything if validation fails)
 	QJsonObject response = jsonOkResponse(request);
+	ClientSession &session = sessions.at(socket);
 	if (request.contains("addresses")) {
 		const QJsonArray reqAddrs = QJsonSafe::safeArray(request, "addresses");
 		if (!DaemonCoreApplication::validateAddrs(reqAddrs, response))
@@ -659,21 +894,21 @@ void DaemonCoreApplication::serverCmdModuleUnsubscribe(QTcpSocket *socket, const
 
 		// Addresses already validated
 		for (const auto &value : reqAddrs)
-			subscribes[QJsonSafe::safeUInt(value)].erase(socket);
+			sessions.unsubscribe(session, QJsonSafe::safeUInt(value));
 
 		response["addresses"] = reqAddrs;
 	} else {
 		// Unsubscribe to all addresses
-		for (size_t addr = 0; addr < Mtb::_MAX_MODULES; addr++)
-			subscribes[addr].erase(socket);
+		sessions.unsubscribeAll(session);
 	}
 cmdModuleUnsubscribeEnd:
 	server.send(socket, response);
 }
 
-void DaemonCoreApplication::serverCmdMyModuleSubscribes(QTcpSocket *socket, const QJsonObject &request) {
+void DaemonCoreApplication::serverCmdMyModuleSubscribes(QIODevice *socket, const QJsonObject &request) {
 	// First validate addresses (do not change anything if validation fails)
 	QJsonObject response = jsonOkResponse(request);
+	ClientSession &session = sessions.at(socket);
 
 	if (request.contains("addresses")) {
 		const QJsonArray reqAddrs = QJsonSafe::safeArray(request, "addresses");
@@ -681,28 +916,23 @@ void DaemonCoreApplication::serverCmdMyModuleSubscribes(QTcpSocket *socket, cons
 			goto cmdMyModuleSubscribesEnd;
 
 		// Remove all subscriptions of the client
-		for (size_t addr = 0; addr < Mtb::_MAX_MODULES; addr++)
-			subscribes[addr].erase(socket);
+		sessions.unsubscribeAll(session);
 
 		// Subscribe to specific addresses
 		for (const auto &value : reqAddrs)
-			subscribes[QJsonSafe::safeUInt(value)].emplace(socket);
+			sessions.subscribe(session, QJsonSafe::safeUInt(value));
 	}
 
 cmdMyModuleSubscribesEnd:
 	QJsonArray clientsSubscribes;
 	for (size_t addr = 0; addr < Mtb::_MAX_MODULES; addr++)
-		if (subscribes[addr].find(socket) != subscribes[addr].end())
+		if (session.subscriptions[addr])
 			clientsSubscribes.push_back(static_cast<int>(addr));
 	response["addresses"] = clientsSubscribes;
 	server.send(socket, response);
 }
 
-void DaemonCoreApplication::serverCmdModuleSetConfig(QTcpSocket *socket, const QJsonObject &request) {
-	// Set config can create new module
-	if (!this->hasWriteAccess(socket))
-		return sendAccessDenied(socket, request);
-
+void DaemonCoreApplication::serverCmdModuleSetConfig(QIODevice *socket, const QJsonObject &request) {
 	size_t addr = request["address"].toInt();
 	if (!Mtb::isValidModuleAddress(addr))
 		return sendError(socket, request, MTB_MODULE_INVALID_ADDR, "Invalid module address");
@@ -719,10 +949,7 @@ void DaemonCoreApplication::serverCmdModuleSetConfig(QTcpSocket *socket, const Q
 	modules[addr]->jsonSetConfig(socket, request);
 }
 
-void DaemonCoreApplication::serverCmdModuleSpecificCommand(QTcpSocket *socket, const QJsonObject &request) {
-	if (!this->hasWriteAccess(socket))
-		return sendAccessDenied(socket, request);
-
+void DaemonCoreApplication::serverCmdModuleSpecificCommand(QIODevice *socket, const QJsonObject &request) {
 	const QJsonArray &dataAr = QJsonSafe::safeArray(request, "data");
 	std::vector<uint8_t> data;
 	for (const auto var : dataAr) {
@@ -774,7 +1001,7 @@ void DaemonCoreApplication::serverCmdModuleSpecificCommand(QTcpSocket *socket, c
 	}
 }
 
-void DaemonCoreApplication::serverCmdSetAddress(QTcpSocket *socket, const QJsonObject &request) {
+void DaemonCoreApplication::serverCmdSetAddress(QIODevice *socket, const QJsonObject &request) {
 	uint8_t newaddr = QJsonSafe::safeUInt(request, "new_address");
 	mtbusb.send(
 		Mtb::CmdMtbModuleChangeAddr(
@@ -790,10 +1017,7 @@ void DaemonCoreApplication::serverCmdSetAddress(QTcpSocket *socket, const QJsonO
 	);
 }
 
-void DaemonCoreApplication::serverCmdResetMyOutputs(QTcpSocket *socket, const QJsonObject &request) {
-	if (!this->hasWriteAccess(socket))
-		return sendAccessDenied(socket, request);
-
+void DaemonCoreApplication::serverCmdResetMyOutputs(QIODevice *socket, const QJsonObject &request) {
 	this->clientResetOutputs(
 		socket,
 		[socket, request]() { server.send(socket, jsonOkResponse(request)); },
@@ -801,18 +1025,145 @@ void DaemonCoreApplication::serverCmdResetMyOutputs(QTcpSocket *socket, const QJ
 	);
 }
 
-void DaemonCoreApplication::serverCmdTopoSubscribe(QTcpSocket *socket, const QJsonObject &request) {
+void DaemonCoreApplication::serverCmdTopoSubscribe(QIODevice *socket, const QJsonObject &request) {
+	QJsonObject response = jsonOkResponse(request);
+	sessions.topoSubscribe(sessions.at(socket));
+	server.send(socket, response);
+}
+
+void DaemonCoreApplication::serverCmdTopoUnsubscribe(QIODevice *socket, const QJsonObject &request) {
+	QJsonObject response = jsonOkResponse(request);
+	sessions.topoUnsubscribe(sessions.at(socket));
+	server.send(socket, response);
+}
+
+void DaemonCoreApplication::serverCmdStats(QIODevice *socket, const QJsonObject &request) {
+	const bool reset = request.contains("reset") ? QJsonSafe::safeBool(request, "reset") : false;
+	if ((reset) && (!this->hasWriteAccess(socket)))
+		return sendAccessDenied(socket, request);
+
+	QJsonObject jsonCommands;
+	for (auto it = this->commands.begin(); it != this->commands.end(); ++it) {
+		if ((it.value().stats.count > 0) || (it.value().stats.errors > 0))
+			jsonCommands[it.key()] = it.value().stats.json();
+		if (reset)
+			it.value().stats.reset();
+	}
+
+	QJsonArray jsonClients;
+	for (const auto &pair : sessions.all()) {
+		jsonClients.push_back(pair.second->statsJson());
+		if (reset)
+			pair.second->stats = ClientSession::Stats();
+	}
+
+	QJsonObject response = jsonOkResponse(request);
+	response["stats"] = QJsonObject{
+		{"commands", jsonCommands},
+		{"clients", jsonClients},
+		{"histogram_buckets", static_cast<int>(STATS_HISTOGRAM_BUCKETS)},
+		{"dv_poller", dvPoller.json()},
+		{"firmware_store", firmwareStore.json()},
+		{"output_pulses", outputPulses.json()},
+		{"outputs_reset", QJsonObject{
+			{"batches", static_cast<qint64>(this->outputsResetStats.batches)},
+			{"modules", static_cast<qint64>(this->outputsResetStats.modules)},
+			{"failed", static_cast<qint64>(this->outputsResetStats.failed)},
+			{"last_ms", this->outputsResetStats.lastMs},
+			{"max_ms", this->outputsResetStats.maxMs},
+		}},
+	};
+	server.send(socket, response);
+}
+
+void DaemonCoreApplication::serverCmdBusHealth(QIODevice *socket, const QJsonObject &request) {
+	QJsonObject jsonModules;
+	if (request.contains("address")) {
+		size_t addr = QJsonSafe::safeUInt(request, "address");
+		if ((!Mtb::isValidModuleAddress(addr)) || (modules[addr] == nullptr))
+			return sendError(socket, request, MTB_MODULE_INVALID_ADDR, "Invalid module address");
+		jsonModules[QString::number(addr)] = busHealth.json(addr);
+	} else {
+		for (size_t addr = 0; addr < Mtb::_MAX_MODULES; addr++)
+			if ((modules[addr] != nullptr) && (busHealth.known(addr)))
+				jsonModules[QString::number(addr)] = busHealth.json(addr);
+	}
+
+	QJsonObject response = jsonOkResponse(request);
+	response["modules"] = jsonModules;
+	server.send(socket, response);
+}
+
+void DaemonCoreApplication::serverCmdHeartbeat(QIODevice *socket, const QJsonObject &request) {
+	const size_t timeoutMs = QJsonSafe::safeUInt(request, "timeout_ms");
+	if ((timeoutMs != 0) &&
+	    ((timeoutMs < SERVER_HEARTBEAT_MIN_TIMEOUT_MS) || (timeoutMs > SERVER_HEARTBEAT_MAX_TIMEOUT_MS)))
+		throw JsonParseError("timeout_ms must be 0 or "+QString::number(SERVER_HEARTBEAT_MIN_TIMEOUT_MS)+"-"+
+		                     QString::number(SERVER_HEARTBEAT_MAX_TIMEOUT_MS));
+	server.setHeartbeat(socket, timeoutMs);
+
+	QJsonObject response = jsonOkResponse(request);
+	response["timeout_ms"] = static_cast<int>(timeoutMs);
+	server.send(socket, response);
+}
+
+void DaemonCoreApplication::serverCmdFirmwareUpload(QIODevice *socket, const QJsonObject &request) {
+	FirmwareImage image = parseFirmware(request, FirmwareImage::BLOCK_SIZE);
+	const size_t size = image.size();
+	bool alreadyStored;
+	const QString hash = firmwareStore.add(std::move(image), alreadyStored);
+
+	QJsonObject response = jsonOkResponse(request);
+	response["firmware_hash"] = hash;
+	response["size"] = static_cast<int>(size);
+	response["already_stored"] = alreadyStored;
+	server.send(socket, response);
+}
+
+void DaemonCoreApplication::serverCmdModulesUpgradeFw(QIODevice *socket, const QJsonObject &request) {
+	fwUpgrader.start(socket, request);
+}
+
+void DaemonCoreApplication::serverCmdRules(QIODevice *socket, const QJsonObject &request) {
+	QJsonObject response = jsonOkResponse(request);
+	response["rules"] = rulesEngine.json();
+	server.send(socket, response);
+}
+
+void DaemonCoreApplication::serverCmdRulesSet(QIODevice *socket, const QJsonObject &request) {
+	const QJsonArray rules = QJsonSafe::safeArray(request, "rules");
+	rulesEngine.set(rules);
+	this->config["rules"] = rules; // persisted by 'save_config'
+
 	QJsonObject response = jsonOkResponse(request);
-	topoSubscribes.emplace(socket);
+	response["rules_count"] = static_cast<int>(rulesEngine.count());
 	server.send(socket, response);
 }
 
-void DaemonCoreApplication::serverCmdTopoUnsubscribe(QTcpSocket *socket, const QJsonObject &request) {
+void DaemonCoreApplication::serverCmdScenes(QIODevice *socket, const QJsonObject &request) {
 	QJsonObject response = jsonOkResponse(request);
-	topoSubscribes.erase(socket);
+	response["scenes"] = sceneStore.json();
 	server.send(socket, response);
 }
 
+void DaemonCoreApplication::serverCmdSceneSet(QIODevice *socket, const QJsonObject &request) {
+	sceneStore.set(QJsonSafe::safeString(request, "name"), QJsonSafe::safeObject(request, "outputs"));
+	this->config["scenes"] = sceneStore.configJson(); // persisted by 'save_config'
+	server.send(socket, jsonOkResponse(request));
+}
+
+void DaemonCoreApplication::serverCmdSceneDelete(QIODevice *socket, const QJsonObject &request) {
+	const QString name = QJsonSafe::safeString(request, "name");
+	if (!sceneStore.remove(name))
+		return sendError(socket, request, MTB_SCENE_UNKNOWN, "Unknown scene: "+name);
+	this->config["scenes"] = sceneStore.configJson();
+	server.send(socket, jsonOkResponse(request));
+}
+
+void DaemonCoreApplication::serverCmdSceneApply(QIODevice *socket, const QJsonObject &request) {
+	sceneStore.apply(socket, request);
+}
+
 QJsonObject DaemonCoreApplication::mtbUsbJson() const {
 	QJsonObject status;
 	bool connected = (mtbusb.connected() && mtbusb.mtbUsbInfo().has_value() && mtbusb.activeModules().has_value());
@@ -839,11 +1190,11 @@ QJsonObject DaemonCoreApplication::mtbUsbJson() const {
 }
 
 QJsonObject DaemonCoreApplication::mtbUsbEvent() const {
-	return {
+	return eventLog.record({
 		{"command", "mtbusb"},
 		{"type", "event"},
 		{"mtbusb", this->mtbUsbJson()},
-	};
+	}, EVENT_GLOBAL);
 }
 
 /* Configuration ------------------------------------------------------------ */
@@ -899,7 +1250,67 @@ void DaemonCoreApplication::loadConfig(const QString& filename) {
 		this->writeAccess.clear();
 		for (const auto& value : QJsonSafe::safeArray(serverConfig, "allowedClients"))
 			this->writeAccess.insert(QHostAddress(QJsonSafe::safeString(value)));
+
+		// Local clients: access is limited by socket file permissions, optionally by peer's uid
+		this->localWriteAccess.reset();
+		const QJsonObject localConfig = serverConfig["local"].toObject();
+		if (localConfig.contains("allowedUids")) {
+			this->localWriteAccess.emplace();
+			for (const auto& value : QJsonSafe::safeArray(localConfig, "allowedUids"))
+				this->localWriteAccess->insert(QJsonSafe::safeUInt(value));
+		}
+
+		// MTBbus quotas, classes by access
+		const QJsonObject quotaConfig = serverConfig["busQuota"].toObject();
+		this->busQuotaWrite = busQuotaConfig(quotaConfig["write"].toObject());
+		this->busQuotaReadOnly = busQuotaConfig(quotaConfig["readOnly"].toObject());
+
+		for (const auto &pair : sessions.all()) {
+			pair.second->writeAccess = this->clientWriteAccess(pair.first);
+			this->applyBusQuota(*pair.second);
+		}
+	}
+
+	dvPoller.loadConfig(this->config["dvPoller"].toObject());
+	// Refer to modules -> after modules
+	rulesEngine.load(this->config["rules"].toArray());
+	sceneStore.load(this->config["scenes"].toObject());
+}
+
+DaemonCoreApplication::BusQuotaConfig DaemonCoreApplication::busQuotaConfig(const QJsonObject &json) {
+	BusQuotaConfig config;
+	if (json.isEmpty())
+		return config;
+	config.share = json["share"].toDouble(0);
+	if ((config.share < 0) || (config.share > 1))
+		throw JsonParseError("Bus quota 'share' must be in range 0-1!");
+	config.burstUs = static_cast<uint64_t>(
+		configInt(json, "burstMs", BUS_QUOTA_DEFAULT_BURST_MS, 1, BUS_QUOTA_MAX_BURST_MS)) * 1000;
+	return config;
+}
+
+void DaemonCoreApplication::applyBusQuota(ClientSession &session) const {
+	const BusQuotaConfig &config = session.writeAccess ? this->busQuotaWrite : this->busQuotaReadOnly;
+	session.busQuota.configure(config.share, config.burstUs);
+}
+
+QLocalServer::SocketOptions DaemonCoreApplication::localSocketOptions(const QJsonObject &localConfig) {
+	if (!localConfig.contains("access"))
+		return QLocalServer::UserAccessOption | QLocalServer::GroupAccessOption;
+
+	QLocalServer::SocketOptions options = QLocalServer::NoOptions;
+	for (const auto& value : QJsonSafe::safeArray(localConfig, "access")) {
+		const QString access = QJsonSafe::safeString(value);
+		if (access == "user")
+			options |= QLocalServer::UserAccessOption;
+		else if (access == "group")
+			options |= QLocalServer::GroupAccessOption;
+		else if (access == "other")
+			options |= QLocalServer::OtherAccessOption;
+		else
+			throw JsonParseError("Invalid local socket access: "+access);
 	}
+	return options;
 }
 
 void DaemonCoreApplication::saveConfig(const QString &filename) {
@@ -925,52 +1336,105 @@ void DaemonCoreApplication::saveConfig(const QString &filename) {
 	file.close();
 }
 
-std::vector<QTcpSocket*> outputSetters() {
-	std::vector<QTcpSocket*> result;
-	for (const auto& modulePtr : modules) {
-		if (modulePtr != nullptr) {
-			for (QTcpSocket* socket : modulePtr->outputSetters())
-				if (std::find(result.begin(), result.end(), socket) == result.end())
-					result.push_back(socket);
-		}
-	}
-	return result;
+void DaemonCoreApplication::serverClientConnected(QIODevice* socket) {
+	ClientSession &session = sessions.open(socket, this->clientWriteAccess(socket));
+	this->applyBusQuota(session);
 }
 
-void DaemonCoreApplication::serverClientDisconnected(QTcpSocket* socket) {
-	for (size_t i = 0; i < Mtb::_MAX_MODULES; i++) {
-		subscribes[i].erase(socket);
+void DaemonCoreApplication::serverClientDisconnected(QIODevice* socket) {
+	// Nobody waits for responses to client's queued requests anymore -> save MTBbus time
+	if (const ClientSession *session = sessions.find(socket))
+		mtbusb.purgeOrigin(session->id);
+
+	for (size_t i = 0; i < Mtb::_MAX_MODULES; i++)
 		if (modules[i] != nullptr)
 			modules[i]->clientDisconnected(socket);
-	}
-	topoSubscribes.erase(socket);
+	coalescer.clientDisconnected(socket);
+	fwUpgrader.clientDisconnected(socket);
 
+	// Session is closed after reset: reset uses owned outputs index in the session
 	this->clientResetOutputs(socket, [](){}, [](){});
+	sessions.close(socket);
 }
 
 void DaemonCoreApplication::clientResetOutputs(
-		QTcpSocket* socket,
+		QIODevice* socket,
 		std::function<void()> onOk,
 		std::function<void()> onError) {
-	const std::vector<QTcpSocket*>& setters = outputSetters();
+	const std::vector<ClientSession*>& setters = sessions.outputSetters();
+
+	// Resets of all modules form single batch, its completion time is reported
+	struct Batch {
+		size_t modules;
+		size_t remaining;
+		size_t failed = 0;
+		QElapsedTimer timer;
+	};
+	auto batchDone = [this, onOk, onError](const Batch &batch) {
+		if (batch.modules > 0) {
+			const qint64 ms = batch.timer.elapsed();
+			OutputsResetStats &stats = this->outputsResetStats;
+			stats.batches++;
+			stats.modules += batch.modules;
+			stats.failed += batch.failed;
+			stats.lastMs = ms;
+			stats.maxMs = std::max(stats.maxMs, ms);
+			log("Outputs of "+QString::number(batch.modules)+" module(s) reset in "+QString::number(ms)+" ms"+
+			    ((batch.failed > 0) ? ", failed: "+QString::number(batch.failed) : ""),
+			    (batch.failed > 0) ? Mtb::LogLevel::Warning : Mtb::LogLevel::Info);
+		}
+		if (batch.failed > 0)
+			onError();
+		else
+			onOk();
+	};
 
 	if (setters.size() >= 2) {
-		for (size_t i = 0; i < Mtb::_MAX_MODULES; i++)
-			if (modules[i] != nullptr)
-				modules[i]->resetOutputsOfClient(socket);
-		onOk();
-	} else if ((setters.size() == 1) && (setters[0] == socket)) {
+		// Touch only modules with outputs owned by the client
+		const ClientSession *session = sessions.find(socket);
+		std::vector<uint8_t> addrs;
+		if (session != nullptr)
+			for (const auto &pair : session->ownedOutputs)
+				addrs.push_back(pair.first);
+
+		// +1: batch must not finish until all modules are processed (modules could finish synchronously)
+		auto batch = std::make_shared<Batch>(Batch{addrs.size(), addrs.size()+1, 0, {}});
+		batch->timer.start();
+		auto moduleDone = [batch, batchDone](const QJsonObject &error) {
+			if (!error.isEmpty())
+				batch->failed++;
+			if (--batch->remaining == 0)
+				batchDone(*batch);
+		};
+
+		// Each module sends single set-outputs command merged with its waiting outputs, queued with priority;
+		// reset changes ownedOutputs -> iterate over copy
+		for (uint8_t addr : addrs) {
+			if (modules[addr] != nullptr)
+				modules[addr]->resetOutputsOfClient(socket, moduleDone);
+			else
+				moduleDone({});
+		}
+		moduleDone({});
+	} else if ((setters.size() == 1) && (setters[0]->socket == socket)) {
 		// Reset outputs of all modules with broadcast
-		for (size_t i = 0; i < Mtb::_MAX_MODULES; i++)
-			if (modules[i] != nullptr)
+		auto batch = std::make_shared<Batch>(Batch{0, 1, 0, {}});
+		batch->timer.start();
+		for (size_t i = 0; i < Mtb::_MAX_MODULES; i++) {
+			if (modules[i] != nullptr) {
 				modules[i]->allOutputsReset();
+				batch->modules++;
+			}
+		}
 
+		Mtb::MtbUsb::PriorityScope priority(mtbusb);
 		mtbusb.send(
 			Mtb::CmdMtbModuleResetOutputs(
-				{[onOk](void*) { onOk(); }},
-				{[onError](Mtb::CmdError, void*) {
+				{[batch, batchDone](void*) { batchDone(*batch); }},
+				{[batch, batchDone](Mtb::CmdError, void*) {
 					log("Unable to reset MTB modules outputs!", Mtb::LogLevel::Error);
-					onError();
+					batch->failed = batch->modules;
+					batchDone(*batch);
 				}}
 			)
 		);
@@ -979,8 +1443,20 @@ void DaemonCoreApplication::clientResetOutputs(
 	}
 }
 
-bool DaemonCoreApplication::hasWriteAccess(const QTcpSocket *socket) {
-	return this->writeAccess.contains(socket->peerAddress());
+bool DaemonCoreApplication::hasWriteAccess(const QIODevice *socket) const {
+	const ClientSession *session = sessions.find(socket);
+	return (session != nullptr) && (session->writeAccess);
+}
+
+bool DaemonCoreApplication::clientWriteAccess(const QIODevice *socket) const {
+	if (auto tcpSocket = dynamic_cast<const QTcpSocket*>(socket))
+		return this->writeAccess.contains(tcpSocket->peerAddress());
+
+	// Local socket
+	if (!this->localWriteAccess.has_value())
+		return true;
+	const std::optional<uint32_t> uid = server.peerUid(socket);
+	return (uid.has_value()) && (this->localWriteAccess->count(uid.value()) > 0);
 }
 
 std::unique_ptr<MtbModule> DaemonCoreApplication::newModule(size_t type, uint8_t addr) {
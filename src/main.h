@@ -2,20 +2,22 @@
 #define _MAIN_H_
 
 #include <QCoreApplication>
-#include <QTcpSocket>
-#include <unordered_set>
+#include <QDateTime>
+#include <QIODevice>
 #include <QSet>
+#include <QHash>
 #include <array>
+#include <set>
 #include "mtbusb.h"
 #include "server.h"
 #include "module.h"
 #include "qjsonsafe.h"
+#include "stats.h"
+#include "session.h"
 
 extern Mtb::MtbUsb mtbusb;
 extern DaemonServer server;
 extern std::array<std::unique_ptr<MtbModule>, Mtb::_MAX_MODULES> modules;
-extern std::array<std::unordered_set<QTcpSocket*>, Mtb::_MAX_MODULES> subscribes;
-extern std::unordered_set<QTcpSocket*> topoSubscribes;
 
 constexpr size_t T_RECONNECT_PERIOD = 1000; // 1 s
 constexpr size_t T_REACTIVATE_PERIOD = 500; // 500 ms
@@ -23,8 +25,6 @@ constexpr size_t T_MTBUSB_EVENT_PERIOD = 500; // 500 ms
 
 const QString DEFAULT_CONFIG_FILENAME = "mtb-daemon.json";
 
-std::vector<QTcpSocket*> outputSetters();
-
 struct ConfigNotFound : public std::logic_error {
 	ConfigNotFound(const std::string &str) : std::logic_error(str) {}
 	ConfigNotFound(const QString &str) : logic_error(str.toStdString()) {}
@@ -42,13 +42,29 @@ enum class StartupError {
 	ServerStart = 2,
 };
 
+class DaemonCoreApplication;
+
+struct ServerCommand {
+	using Handler = std::function<void(DaemonCoreApplication*, QIODevice*, const QJsonObject&)>;
+
+	Handler handler;
+	bool needsWriteAccess;
+	bool needsModule; // 'address' must be a valid address of existing module
+	bool usesBus; // subject to client's MTBbus quota
+	CommandStats stats;
+
+	ServerCommand(Handler handler = nullptr, bool needsWriteAccess = false, bool needsModule = false,
+	              bool usesBus = false)
+	    : handler(handler), needsWriteAccess(needsWriteAccess), needsModule(needsModule), usesBus(usesBus) {}
+};
+
 class DaemonCoreApplication : public QCoreApplication {
 	Q_OBJECT
 public:
 	DaemonCoreApplication(int &argc, char **argv);
-	~DaemonCoreApplication() override = default;
+	~DaemonCoreApplication() override;
 
-	bool hasWriteAccess(const QTcpSocket*);
+	bool hasWriteAccess(const QIODevice*) const;
 	StartupError startupError() const { return startError; }
 
 private:
@@ -57,9 +73,33 @@ private:
 	QTimer t_reconnect;
 	QTimer t_reactivate;
 	QSet<QHostAddress> writeAccess;
+	std::optional<std::set<uint32_t>> localWriteAccess; // empty = all local clients can write
 	StartupError startError = StartupError::Ok;
 	bool failTimerPending = false;
 	bool newTimerPending = false;
+	QHash<QString, ServerCommand> commands;
+	std::array<uint64_t, Mtb::_MAX_MODULES> moduleDeletedVersion = {0, };
+	// Differs between runs of the daemon; 'version' of modules is valid only within single epoch
+	const qint64 runEpoch = QDateTime::currentMSecsSinceEpoch();
+
+	struct BusQuotaConfig {
+		double share = 0; // 0 = unlimited
+		uint64_t burstUs = 0;
+	};
+	BusQuotaConfig busQuotaWrite;
+	BusQuotaConfig busQuotaReadOnly;
+
+	struct OutputsResetStats { // safe-state resets of outputs of disconnected clients
+		size_t batches = 0;
+		size_t modules = 0;
+		size_t failed = 0;
+		qint64 lastMs = 0;
+		qint64 maxMs = 0;
+	};
+	OutputsResetStats outputsResetStats;
+
+	void registerCommands();
+	void dispatch(ServerCommand&, QIODevice*, const QJsonObject&);
 
 	QJsonObject mtbUsbJson() const;
 	QJsonObject mtbUsbEvent() const;
@@ -73,29 +113,44 @@ private:
 	static std::unique_ptr<MtbModule> newModule(size_t type, uint8_t addr);
 
 	void loadConfig(const QString &filename);
+	static QLocalServer::SocketOptions localSocketOptions(const QJsonObject&);
+	bool clientWriteAccess(const QIODevice*) const;
+	static BusQuotaConfig busQuotaConfig(const QJsonObject&);
+	void applyBusQuota(ClientSession&) const;
 	void saveConfig(const QString &filename);
 
 	void mtbUsbConnect();
 
-	void clientResetOutputs(QTcpSocket*, std::function<void()> onOk,
+	void clientResetOutputs(QIODevice*, std::function<void()> onOk,
 	                        std::function<void()> onError);
 
-	void serverCmdMtbusb(QTcpSocket*, const QJsonObject&);
-	void serverCmdVersion(QTcpSocket*, const QJsonObject&);
-	void serverCmdSaveConfig(QTcpSocket*, const QJsonObject&);
-	void serverCmdLoadConfig(QTcpSocket*, const QJsonObject&);
-	void serverCmdModule(QTcpSocket*, const QJsonObject&);
-	void serverCmdModuleDelete(QTcpSocket*, const QJsonObject&);
-	void serverCmdModules(QTcpSocket*, const QJsonObject&);
-	void serverCmdModuleSubscribe(QTcpSocket*, const QJsonObject&);
-	void serverCmdMyModuleSubscribes(QTcpSocket*, const QJsonObject&);
-	void serverCmdModuleUnsubscribe(QTcpSocket*, const QJsonObject&);
-	void serverCmdModuleSetConfig(QTcpSocket*, const QJsonObject&);
-	void serverCmdModuleSpecificCommand(QTcpSocket*, const QJsonObject&);
-	void serverCmdSetAddress(QTcpSocket*, const QJsonObject&);
-	void serverCmdResetMyOutputs(QTcpSocket*, const QJsonObject&);
-	void serverCmdTopoSubscribe(QTcpSocket*, const QJsonObject&);
-	void serverCmdTopoUnsubscribe(QTcpSocket*, const QJsonObject&);
+	void serverCmdMtbusb(QIODevice*, const QJsonObject&);
+	void serverCmdVersion(QIODevice*, const QJsonObject&);
+	void serverCmdSaveConfig(QIODevice*, const QJsonObject&);
+	void serverCmdLoadConfig(QIODevice*, const QJsonObject&);
+	void serverCmdModule(QIODevice*, const QJsonObject&);
+	void serverCmdModuleDelete(QIODevice*, const QJsonObject&);
+	void serverCmdModules(QIODevice*, const QJsonObject&);
+	void serverCmdModuleSubscribe(QIODevice*, const QJsonObject&);
+	void serverCmdMyModuleSubscribes(QIODevice*, const QJsonObject&);
+	void serverCmdModuleUnsubscribe(QIODevice*, const QJsonObject&);
+	void serverCmdModuleSetConfig(QIODevice*, const QJsonObject&);
+	void serverCmdModuleSpecificCommand(QIODevice*, const QJsonObject&);
+	void serverCmdSetAddress(QIODevice*, const QJsonObject&);
+	void serverCmdResetMyOutputs(QIODevice*, const QJsonObject&);
+	void serverCmdTopoSubscribe(QIODevice*, const QJsonObject&);
+	void serverCmdTopoUnsubscribe(QIODevice*, const QJsonObject&);
+	void serverCmdStats(QIODevice*, const QJsonObject&);
+	void serverCmdBusHealth(QIODevice*, const QJsonObject&);
+	void serverCmdHeartbeat(QIODevice*, const QJsonObject&);
+	void serverCmdFirmwareUpload(QIODevice*, const QJsonObject&);
+	void serverCmdModulesUpgradeFw(QIODevice*, const QJsonObject&);
+	void serverCmdRules(QIODevice*, const QJsonObject&);
+	void serverCmdRulesSet(QIODevice*, const QJsonObject&);
+	void serverCmdScenes(QIODevice*, const QJsonObject&);
+	void serverCmdSceneSet(QIODevice*, const QJsonObject&);
+	void serverCmdSceneDelete(QIODevice*, const QJsonObject&);
+	void serverCmdSceneApply(QIODevice*, const QJsonObject&);
 
 	static bool validateAddrs(const QJsonArray &addrs, QJsonObject& response);
 
@@ -107,9 +162,12 @@ private slots:
 	void mtbUsbOnModuleFail(uint8_t addr);
 	void mtbUsbOnInputsChange(uint8_t addr, const std::vector<uint8_t> &data);
 	void mtbUsbOnDiagStateChange(uint8_t addr, const std::vector<uint8_t> &data);
+	void mtbUsbOnBusTime(Mtb::CmdOrigin origin, uint32_t us);
 
-	void serverReceived(QTcpSocket*, const QJsonObject&);
-	void serverClientDisconnected(QTcpSocket*);
+	void serverReceived(QIODevice*, const QJsonObject&);
+	void serverClientConnected(QIODevice*);
+	void serverClientDisconnected(QIODevice*);
+	void serverErrorSent(QIODevice*, const QJsonObject &response);
 
 	void tReconnectTick();
 	void tReactivateTick();
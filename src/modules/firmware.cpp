@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <array>
+#include "firmware.h"
+
+// Value of hex digit or 0xFF for other characters
+static const std::array<uint8_t, 256> HEX_NIBBLE = []() {
+	std::array<uint8_t, 256> table;
+	table.fill(0xFF);
+	for (uint8_t i = 0; i < 10; i++)
+		table['0'+i] = i;
+	for (uint8_t i = 0; i < 6; i++)
+		table['A'+i] = table['a'+i] = 10+i;
+	return table;
+}();
+
+// Decodes 'cnt' bytes from hex string 'src' to 'dst', returns false on invalid character
+static bool hexDecode(const char *src, uint8_t *dst, size_t cnt) {
+	uint8_t invalid = 0;
+	for (size_t i = 0; i < cnt; i++) {
+		const uint8_t high = HEX_NIBBLE[static_cast<uint8_t>(src[2*i])];
+		const uint8_t low = HEX_NIBBLE[static_cast<uint8_t>(src[2*i+1])];
+		invalid |= (high | low);
+		dst[i] = static_cast<uint8_t>((high << 4) | low);
+	}
+	return ((invalid & 0xF0) == 0);
+}
+
+FirmwareImage::FirmwareImage(size_t pageSize)
+    : pageSize(std::max(pageSize - (pageSize % BLOCK_SIZE), BLOCK_SIZE)) {
+	this->data.reserve(MAX_SIZE); // whole flash is small, no reallocations while loading
+}
+
+uint8_t *FirmwareImage::reserve(size_t addr, size_t len) {
+	if ((addr >= MAX_SIZE) || (len > MAX_SIZE - addr))
+		throw FirmwareError("Firmware data out of flash range (address "+std::to_string(addr)+", length "+
+		                    std::to_string(len)+")");
+
+	const size_t end = ((addr + len + this->pageSize - 1) / this->pageSize) * this->pageSize;
+	if (end > this->data.size()) {
+		this->data.resize(end, 0xFF);
+		this->usedPages.resize(end / this->pageSize, false);
+	}
+	if (len > 0)
+		for (size_t page = addr / this->pageSize; page <= (addr+len-1) / this->pageSize; page++)
+			this->usedPages[page] = true;
+	return this->data.data() + addr;
+}
+
+void FirmwareImage::loadHexString(size_t addr, const char *data, size_t len) {
+	if (len % 2 != 0)
+		throw FirmwareError("Odd length of firmware data at address "+std::to_string(addr));
+	if (!hexDecode(data, this->reserve(addr, len/2), len/2))
+		throw FirmwareError("Invalid character in firmware data at address "+std::to_string(addr));
+}
+
+void FirmwareImage::loadIntelHex(const char *data, size_t len) {
+	size_t base = 0;
+	size_t line = 0;
+	size_t i = 0;
+
+	while (i < len) {
+		if ((data[i] == '\r') || (data[i] == '\n') || (data[i] == ' ') || (data[i] == '\t')) {
+			if (data[i] == '\n')
+				line++;
+			i++;
+			continue;
+		}
+
+		const auto error = [line](const std::string &msg) {
+			return FirmwareError("Intel HEX line "+std::to_string(line+1)+": "+msg);
+		};
+		if (data[i] != ':')
+			throw error("record does not start with ':'");
+		i++;
+
+		uint8_t head[4]; // byte count, address (2 bytes), record type
+		if ((len - i < 2*sizeof(head)) || (!hexDecode(data+i, head, sizeof(head))))
+			throw error("invalid record header");
+		i += 2*sizeof(head);
+
+		const size_t cnt = head[0];
+		const size_t addr = (head[1] << 8) | head[2];
+		const uint8_t type = head[3];
+		if (len - i < 2*(cnt+1))
+			throw error("record too short");
+
+		uint8_t payload[256];
+		if (!hexDecode(data+i, payload, cnt+1))
+			throw error("invalid character");
+		i += 2*(cnt+1);
+
+		uint8_t checksum = head[0] + head[1] + head[2] + head[3];
+		for (size_t j = 0; j <= cnt; j++)
+			checksum += payload[j];
+		if (checksum != 0)
+			throw error("checksum mismatch");
+
+		switch (type) {
+		case 0x00: // data
+			std::copy(payload, payload+cnt, this->reserve(base+addr, cnt));
+			break;
+		case 0x01: // end of file
+			return;
+		case 0x02: // extended segment address
+			if (cnt != 2)
+				throw error("invalid extended segment address record");
+			base = ((payload[0] << 8) | payload[1]) << 4;
+			break;
+		case 0x04: // extended linear address
+			if (cnt != 2)
+				throw error("invalid extended linear address record");
+			base = static_cast<size_t>((payload[0] << 8) | payload[1]) << 16;
+			break;
+		case 0x03: // start segment address
+		case 0x05: // start linear address
+			break;
+		default:
+			throw error("unknown record type "+std::to_string(type));
+		}
+	}
+}
+
+void FirmwareImage::loadBinary(size_t addr, const uint8_t *data, size_t len) {
+	std::copy(data, data+len, this->reserve(addr, len));
+}
+
+void FirmwareImage::finish() {
+	const size_t blocksPerPage = this->pageSize / BLOCK_SIZE;
+	this->blocks.clear();
+	for (size_t page = 0; page < this->usedPages.size(); page++)
+		if (this->usedPages[page])
+			for (size_t i = 0; i < blocksPerPage; i++)
+				this->blocks.push_back(static_cast<uint16_t>(page*blocksPerPage + i));
+}
+
+void FirmwareImage::clear() {
+	this->data = {};
+	this->usedPages = {};
+	this->blocks = {};
+}
+
+FirmwareImage FirmwareImage::realigned(size_t pageSize) const {
+	FirmwareImage result(pageSize);
+	const size_t end = ((this->data.size() + result.pageSize - 1) / result.pageSize) * result.pageSize;
+	result.data.assign(this->data.begin(), this->data.end());
+	result.data.resize(end, 0xFF);
+	result.usedPages.resize(end / result.pageSize, false);
+	for (size_t page = 0; page < this->usedPages.size(); page++)
+		if (this->usedPages[page])
+			result.usedPages[(page*this->pageSize) / result.pageSize] = true;
+	result.finish();
+	return result;
+}
+
+std::vector<uint8_t> FirmwareImage::block(size_t i) const {
+	const auto begin = this->data.begin() + (this->blocks[i]*BLOCK_SIZE);
+	return std::vector<uint8_t>(begin, begin+BLOCK_SIZE);
+}
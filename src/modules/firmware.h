@@ -0,0 +1,62 @@
+#ifndef _FIRMWARE_H_
+#define _FIRMWARE_H_
+
+/* Firmware image for module firmware upgrade.
+ * Image is decoded in a single pass directly into a contiguous buffer covering
+ * the whole flash from address 0 to the end of the last used page (unused
+ * bytes are 0xFF). Only pages containing any data are written to the module,
+ * each page is written block by block; block i is addressed by index.
+ * Image loaded with BLOCK_SIZE pages could be realigned to any page size, so
+ * one decoded image serves modules with different page sizes.
+ * This file does not depend on Qt, parse errors are reported via FirmwareError.
+ */
+
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct FirmwareError : public std::runtime_error {
+	FirmwareError(const std::string &str) : runtime_error(str) {}
+};
+
+class FirmwareImage {
+public:
+	static constexpr size_t BLOCK_SIZE = 64;
+	static constexpr size_t MAX_SIZE = 0x10000; // flash addresses are 16-bit
+
+	FirmwareImage() = default;
+	explicit FirmwareImage(size_t pageSize);
+
+	// Legacy format: hex string 'data' starting at 'addr'
+	void loadHexString(size_t addr, const char *data, size_t len);
+	// Content of Intel HEX file
+	void loadIntelHex(const char *data, size_t len);
+	// Raw binary image starting at 'addr'
+	void loadBinary(size_t addr, const uint8_t *data, size_t len);
+
+	// Builds list of blocks to write, must be called after all loads
+	void finish();
+	void clear();
+	// 'pageSize' must be a multiple of page size of this image
+	FirmwareImage realigned(size_t pageSize) const;
+
+	bool empty() const { return this->blocks.empty(); }
+	size_t blocksCnt() const { return this->blocks.size(); }
+	uint16_t blockAddr(size_t i) const { return static_cast<uint16_t>(this->blocks[i]*BLOCK_SIZE); }
+	std::vector<uint8_t> block(size_t i) const;
+	size_t size() const { return this->data.size(); } // including padding
+	const std::vector<uint8_t> &bytes() const { return this->data; } // from address 0, including padding
+	const std::vector<bool> &pagesUsed() const { return this->usedPages; } // page contains any data
+
+private:
+	size_t pageSize = BLOCK_SIZE;
+	std::vector<uint8_t> data;
+	std::vector<bool> usedPages;
+	std::vector<uint16_t> blocks; // indexes of blocks to write, ascending
+
+	uint8_t *reserve(size_t addr, size_t len);
+};
+
+#endif
@@ -3,8 +3,43 @@
 #include "main.h"
 #include "logging.h"
 #include "utils.h"
+#include "coalescer.h"
+#include "eventlog.h"
+#include "sharedstate.h"
+#include "firmwarestore.h"
+#include "rules.h"
+#include "outputpulses.h"
 
-MtbModule::MtbModule(uint8_t addr) : address(addr), name("Module "+QString::number(addr)) {}
+uint64_t MtbModule::s_globalVersion = 0;
+std::map<MtbModuleType, double> MtbModule::s_fwPageWriteMs;
+
+SetOutputsRequest::SetOutputsRequest(QIODevice *socket, std::optional<size_t> id,
+                                     std::function<void(const QJsonObject&)> onDone)
+    : ServerRequest(socket, id), onDone(onDone), origin(mtbusb.origin()) {}
+
+Mtb::CmdOrigin requestsOrigin(const std::vector<SetOutputsRequest> &requests) {
+	for (const SetOutputsRequest &request : requests)
+		if (request.origin != Mtb::ORIGIN_DAEMON)
+			return request.origin;
+	return Mtb::ORIGIN_DAEMON;
+}
+
+MtbModule::MtbModule(uint8_t addr)
+    : address(addr), name("Module "+QString::number(addr)), version(nextGlobalVersion()) {}
+
+void MtbModule::stateChanged() const {
+	this->version = nextGlobalVersion();
+	for (auto &cached : this->infoCache)
+		cached.reset();
+	sharedState.update(this->address, *this);
+}
+
+const QJsonObject& MtbModule::cachedModuleInfo(bool state, bool config) const {
+	std::optional<QJsonObject> &cached = this->infoCache[(state ? 2 : 0) + (config ? 1 : 0)];
+	if (!cached.has_value())
+		cached = this->moduleInfo(state, config);
+	return cached.value();
+}
 
 MtbModuleType MtbModule::moduleType() const { return this->type; }
 
@@ -49,6 +84,8 @@ void MtbModule::mtbBusActivate(Mtb::ModuleInfo moduleInfo) {
 	this->busModuleInfo = moduleInfo;
 	this->rebooting.activatedByMtbUsb = true;
 	this->type = static_cast<MtbModuleType>(moduleInfo.type);
+	this->dvCache.clear(); // could be different firmware
+	this->stateChanged();
 
 	if (this->fwDeprecated()) {
 		this->mlog("FW of the module is deprecated: "+this->busModuleInfo.fw_version()+", upgrade the firmware!",
@@ -66,6 +103,9 @@ void MtbModule::mtbBusLost() {
 
 void MtbModule::mtbUsbDisconnected() {
 	this->active = false;
+	this->stateChanged();
+	if (this->isFirmwareUpgrading())
+		this->fwUpgdError("MTB-USB disconnected");
 }
 
 void MtbModule::mtbBusInputsChanged(const std::vector<uint8_t>&) {
@@ -97,48 +137,37 @@ void MtbModule::mtbBusDiagStateChanged(bool isError, bool isWarning) {
 	}
 }
 
-void MtbModule::jsonCommand(QTcpSocket *socket, const QJsonObject &request, bool hasWriteAccess) {
-	QString command = QJsonSafe::safeString(request, "command");
-
-	// Commands for clients with read-only access
-	if (command == "module_diag")
-		return this->jsonGetDiag(socket, request);
-
-	if (!hasWriteAccess)
-		return sendAccessDenied(socket, request);
-
-	// Commands for clients with write access
-	if (command == "module_set_outputs")
-		return this->jsonSetOutput(socket, request);
-	if (command == "module_set_config")
-		return this->jsonSetConfig(socket, request);
-	if (command == "module_upgrade_fw")
-		return this->jsonUpgradeFw(socket, request);
-	if (command == "module_reboot")
-		return this->jsonReboot(socket, request);
-	if (command == "module_specific_command")
-		return this->jsonSpecificCommand(socket, request);
-	if (command == "module_beacon")
-		return this->jsonBeacon(socket, request);
-	if (command == "module_set_address")
-		return this->jsonSetAddress(socket, request);
-
-	// Explicitly answer "unknown command"
-	sendError(socket, request, MTB_UNKNOWN_COMMAND, "Unknown command!");
+const QHash<QString, MtbModule::JsonCommand>& MtbModule::jsonCommands() {
+	// Handlers are virtual -> pointer-to-member call dispatches to specific module type
+	static const QHash<QString, JsonCommand> commands {
+		// Commands for clients with read-only access
+		{"module_diag", {&MtbModule::jsonGetDiag, false}},
+
+		// Commands for clients with write access
+		{"module_set_outputs", {&MtbModule::jsonSetOutput, true}},
+		{"module_set_config", {&MtbModule::jsonSetConfig, true}},
+		{"module_upgrade_fw", {&MtbModule::jsonUpgradeFw, true}},
+		{"module_reboot", {&MtbModule::jsonReboot, true}},
+		{"module_specific_command", {&MtbModule::jsonSpecificCommand, true}},
+		{"module_beacon", {&MtbModule::jsonBeacon, true}},
+		{"module_set_address", {&MtbModule::jsonSetAddress, true}},
+	};
+	return commands;
 }
 
-void MtbModule::jsonSetOutput(QTcpSocket *socket, const QJsonObject &request) {
+void MtbModule::jsonSetOutput(QIODevice *socket, const QJsonObject &request) {
 	sendError(socket, request, MTB_MODULE_UNSUPPORTED_COMMAND, "This module does not support output setting!");
 }
 
-void MtbModule::jsonSetConfig(QTcpSocket*, const QJsonObject &json) {
+void MtbModule::jsonSetConfig(QIODevice*, const QJsonObject &json) {
 	if (json.contains("type_code"))
 		this->type = static_cast<MtbModuleType>(QJsonSafe::safeUInt(json, "type_code"));
 	if (json.contains("name"))
 		this->name = QJsonSafe::safeString(json, "name");
+	this->stateChanged(); // after the change: exports current state
 }
 
-void MtbModule::jsonSetAddress(QTcpSocket *socket, const QJsonObject &request) {
+void MtbModule::jsonSetAddress(QIODevice *socket, const QJsonObject &request) {
 	if (this->isFirmwareUpgrading()) {
 		sendError(socket, request, MTB_MODULE_UPGRADING_FW, "Firmware of module is being upgraded!");
 		return;
@@ -167,11 +196,25 @@ void MtbModule::jsonSetAddress(QTcpSocket *socket, const QJsonObject &request) {
 	);
 }
 
-void MtbModule::jsonUpgradeFw(QTcpSocket *socket, const QJsonObject &request) {
-	sendError(socket, request, MTB_MODULE_UNSUPPORTED_COMMAND, "This module does not support firmware upgrading!");
+void MtbModule::jsonUpgradeFw(QIODevice *socket, const QJsonObject &request) {
+	if (this->fwPageSize() == 0) {
+		sendError(socket, request, MTB_MODULE_UNSUPPORTED_COMMAND, "This module does not support firmware upgrading!");
+		return;
+	}
+	if (this->isFirmwareUpgrading()) {
+		sendError(socket, request, MTB_MODULE_UPGRADING_FW, "Firmware is already being upgraded!");
+		return;
+	}
+
+	std::shared_ptr<const FirmwareImage> firmware = requestFirmware(request, this->fwPageSize());
+	if (firmware == nullptr) {
+		sendError(socket, request, MTB_FIRMWARE_UNKNOWN, "Unknown firmware_hash!");
+		return;
+	}
+	this->fwUpgdStart(ServerRequest(socket, request), firmware, {});
 }
 
-void MtbModule::jsonReboot(QTcpSocket *socket, const QJsonObject &request) {
+void MtbModule::jsonReboot(QIODevice *socket, const QJsonObject &request) {
 	if (this->isRebooting())
 		return sendError(socket, request, MTB_MODULE_REBOOTING, "Already rebooting!");
 
@@ -208,8 +251,20 @@ QString moduleTypeToStr(MtbModuleType type) {
 	}
 }
 
-void MtbModule::sendInputsChanged(QJsonObject inputs) const {
-	QJsonObject json{
+QJsonObject MtbModule::inputsJson() const { return {}; }
+QJsonObject MtbModule::outputsJson() const { return {}; }
+
+void MtbModule::exportState(MtbShm::ModuleState &state) const {
+	state.active = this->active;
+	state.type = static_cast<uint8_t>(this->type);
+	state.version = this->version;
+}
+
+void MtbModule::sendInputsChanged(QJsonObject inputs, uint32_t changedInputs, const QJsonObject &delta) const {
+	this->stateChanged();
+	// Event history holds full state, so resumed clients never miss a change
+	// Full state is built on every change even for delta-only subscribers: event history needs it
+	const QJsonObject json = eventLog.record({
 		{"command", "module_inputs_changed"},
 		{"type", "event"},
 		{"module_inputs_changed", QJsonObject{
@@ -218,14 +273,34 @@ void MtbModule::sendInputsChanged(QJsonObject inputs) const {
 			{"type_code", static_cast<int>(this->type)},
 			{"inputs", inputs},
 		}}
-	};
-
-	for (auto socket : subscribes[this->address])
-		server.send(socket, json);
+	}, this->address);
+
+	QJsonObject deltaJson;
+	for (ClientSession *session : sessions.subscribers(this->address)) {
+		if (session->coalescing) {
+			coalescer.inputsChanged(session->socket, this->address, changedInputs); // counted on flush
+		} else if ((session->inputsDelta) && (!delta.isEmpty())) {
+			if (delta["ports"].toObject().isEmpty())
+				continue; // nothing changed
+			if (deltaJson.isEmpty()) {
+				deltaJson = json;
+				QJsonObject event = json["module_inputs_changed"].toObject();
+				event.remove("inputs");
+				event["inputs_delta"] = delta;
+				deltaJson["module_inputs_changed"] = event;
+			}
+			session->stats.events++;
+			server.send(*session, deltaJson);
+		} else {
+			session->stats.events++;
+			server.send(*session, json);
+		}
+	}
 }
 
-void MtbModule::sendOutputsChanged(QJsonObject outputs, const std::vector<QTcpSocket*>& ignore) const {
-	QJsonObject json{
+void MtbModule::sendOutputsChanged(QJsonObject outputs, const std::vector<QIODevice*>& ignore) const {
+	this->stateChanged();
+	const QJsonObject json = eventLog.record({
 		{"command", "module_outputs_changed"},
 		{"type", "event"},
 		{"module_outputs_changed", QJsonObject{
@@ -234,16 +309,24 @@ void MtbModule::sendOutputsChanged(QJsonObject outputs, const std::vector<QTcpSo
 			{"type_code", static_cast<int>(this->type)},
 			{"outputs", outputs},
 		}}
-	};
-
-	for (auto socket : subscribes[this->address])
-		if (std::find(ignore.begin(), ignore.end(), socket) == ignore.end())
-			server.send(socket, json);
+	}, this->address);
+
+	for (ClientSession *session : sessions.subscribers(this->address)) {
+		if (std::find(ignore.begin(), ignore.end(), session->socket) != ignore.end())
+			continue;
+		if (session->coalescing) {
+			coalescer.outputsChanged(session->socket, this->address); // counted on flush
+		} else {
+			session->stats.events++;
+			server.send(*session, json);
+		}
+	}
 }
 
 void MtbModule::loadConfig(const QJsonObject &json) {
 	this->name = QJsonSafe::safeString(json, "name");
 	this->type = static_cast<MtbModuleType>(QJsonSafe::safeUInt(json, "type"));
+	this->stateChanged();
 }
 
 void MtbModule::saveConfig(QJsonObject &json) const {
@@ -251,38 +334,95 @@ void MtbModule::saveConfig(QJsonObject &json) const {
 	json["type"] = static_cast<int>(this->type);
 }
 
-void MtbModule::sendModuleInfo(QTcpSocket *ignore, bool sendConfig) const {
-	QJsonObject json{
+void MtbModule::sendModuleInfo(QIODevice *ignore, bool sendConfig) const {
+	this->stateChanged();
+	const QJsonObject json = eventLog.record({
 		{"command", "module"},
 		{"type", "event"},
-		{"module", this->moduleInfo(true, sendConfig)},
-	};
+		{"module", this->cachedModuleInfo(true, sendConfig)},
+	}, this->address);
 
 	// For simplicity, send module's 'state' to all clients, altrough clients with topology-only
 	// subscription probably don't need the state.
-	std::unordered_set<QTcpSocket*> sockets(topoSubscribes);
-	sockets.insert(subscribes[this->address].begin(), subscribes[this->address].end());
-	for (auto socket : sockets)
-		if (socket != ignore)
-			server.send(socket, json);
+	for (ClientSession *session : sessions.topoSubscribers())
+		if (session->socket != ignore)
+			server.send(*session, json);
+	for (ClientSession *session : sessions.subscribers(this->address))
+		if ((!session->topoSubscribed) && (session->socket != ignore))
+			server.send(*session, json);
 }
 
-void MtbModule::resetOutputsOfClient(QTcpSocket*) {}
+void MtbModule::resetOutputsOfClient(QIODevice*, std::function<void(const QJsonObject&)> onDone) {
+	if (onDone)
+		onDone({});
+}
 
-void MtbModule::clientDisconnected(QTcpSocket *socket) {
+void MtbModule::clientDisconnected(QIODevice *socket) {
 	if ((this->configWriting.has_value()) && (this->configWriting.value().socket == socket))
 		this->configWriting->socket = nullptr;
 	if ((this->fwUpgrade.fwUpgrading.has_value()) && (this->fwUpgrade.fwUpgrading.value().socket == socket))
 		this->fwUpgrade.fwUpgrading->socket = nullptr;
 }
 
-std::vector<QTcpSocket*> MtbModule::outputSetters() const {
-	return {};
+uint8_t MtbModule::outputFromJson(const QJsonObject&) const {
+	throw JsonParseError("Module has no outputs!");
+}
+
+void MtbModule::setOutputsDaemon(const std::map<size_t, uint8_t>&) {}
+
+void MtbModule::setOutputsBatch(QIODevice*, const std::map<size_t, uint8_t>&,
+                                std::function<void(const QJsonObject&)> onDone) {
+	onDone(jsonError(MTB_MODULE_UNSUPPORTED_COMMAND, "Module has no outputs!"));
+}
+
+/* Output pulses ------------------------------------------------------------ */
+
+void MtbModule::pulseStart(size_t port, uint8_t current, size_t durationMs) {
+	if (this->pulseGeneration.size() <= port) {
+		this->pulseGeneration.resize(std::max(port+1, this->outputsCnt()), 0);
+		this->pulseRevert.resize(this->pulseGeneration.size());
+	}
+	if (!this->pulseRevert[port].has_value()) // retriggered pulse reverts to value before the first pulse
+		this->pulseRevert[port] = current;
+	this->pulseGeneration[port]++;
+	outputPulses.add(this->address, port, this->pulseGeneration[port], durationMs);
+}
+
+void MtbModule::pulseCancel(size_t port) {
+	if (port < this->pulseGeneration.size()) {
+		this->pulseGeneration[port]++;
+		this->pulseRevert[port].reset();
+	}
+}
+
+void MtbModule::pulsesCancelAll() {
+	for (size_t port = 0; port < this->pulseGeneration.size(); port++)
+		this->pulseCancel(port);
+}
+
+void MtbModule::pulsesExpired(const std::vector<std::pair<size_t, uint32_t>> &expired) {
+	std::map<size_t, uint8_t> ports;
+	for (const auto &[port, generation] : expired) {
+		if ((port < this->pulseGeneration.size()) && (this->pulseGeneration[port] == generation) &&
+		    (this->pulseRevert[port].has_value())) {
+			ports[port] = this->pulseRevert[port].value();
+			this->pulseRevert[port].reset();
+		}
+	}
+	if (!ports.empty())
+		this->pulsesEnded(ports);
+}
+
+void MtbModule::setOutputOwner(QIODevice *&owner, size_t port, QIODevice *newOwner) const {
+	if (owner == newOwner)
+		return;
+	sessions.outputOwnerChanged(owner, newOwner, this->address, port);
+	owner = newOwner;
 }
 
 bool MtbModule::isConfigSetting() const { return this->configWriting.has_value(); }
 
-void MtbModule::jsonGetDiag(QTcpSocket *socket, const QJsonObject &request) {
+void MtbModule::jsonGetDiag(QIODevice *socket, const QJsonObject &request) {
 	uint8_t dv_num = 0;
 	if (request.contains("DVnum")) {
 		dv_num = QJsonSafe::safeUInt(request, "DVnum");
@@ -293,35 +433,33 @@ void MtbModule::jsonGetDiag(QTcpSocket *socket, const QJsonObject &request) {
 		dv_num = dv.value();
 	}
 
+	if (request.contains("max_age_ms")) {
+		const qint64 maxAge = QJsonSafe::safeUInt(request, "max_age_ms");
+		auto cached = this->dvCache.find(dv_num);
+		if (cached != this->dvCache.end()) {
+			const qint64 age = cached->second.age.elapsed();
+			if (age <= maxAge) {
+				QJsonObject response = jsonOkResponse(request);
+				const QJsonObject dv = this->dvJson(dv_num, cached->second.data);
+				for (auto it = dv.begin(); it != dv.end(); ++it)
+					response[it.key()] = it.value();
+				response["age_ms"] = age;
+				return server.send(socket, response);
+			}
+		}
+	}
+
 	mtbusb.send(
 		Mtb::CmdMtbModuleGetDiagValue(
 			this->address, dv_num,
 			{[this, socket, request](uint8_t, uint8_t dvi, const std::vector<uint8_t> &data, void*) {
 				QJsonObject response = jsonOkResponse(request);
-				response["DVnum"] = dvi;
-				response["DVkey"] = this->DVToStr(dvi);
-				response["DVvalue"] = this->dvRepr(dvi, data);
-
-				QJsonArray dataAr;
-				for (const uint8_t byte : data)
-					dataAr.push_back(byte);
-				response["DVvalueRaw"] = dataAr;
-
+				const QJsonObject dv = this->dvJson(dvi, data);
+				for (auto it = dv.begin(); it != dv.end(); ++it)
+					response[it.key()] = it.value();
 				server.send(socket, response);
 
-				if (dvi == Mtb::DVCommon::State) {
-					this->mtbBusDiagStateChanged(data);
-				} else if ((dvi == Mtb::DVCommon::Errors) || (dvi == Mtb::DVCommon::Warnings)) {
-					bool anyNonZero = false;
-					for (uint8_t byte : data)
-						if (byte != 0)
-							anyNonZero = true;
-
-					if (dvi == Mtb::DVCommon::Errors)
-						this->mtbBusDiagStateChanged(anyNonZero, this->busModuleInfo.warning);
-					else if (dvi == Mtb::DVCommon::Warnings)
-						this->mtbBusDiagStateChanged(this->busModuleInfo.error, anyNonZero);
-				}
+				this->dvReceived(dvi, data);
 			}},
 			{[socket, request](Mtb::CmdError error, void*) {
 				sendError(socket, request, error);
@@ -330,33 +468,113 @@ void MtbModule::jsonGetDiag(QTcpSocket *socket, const QJsonObject &request) {
 	);
 }
 
-/* Firmware Upgrade ----------------------------------------------------------*/
+void MtbModule::pollDv(uint8_t dvi, std::function<void()> onDone) {
+	mtbusb.send(
+		Mtb::CmdMtbModuleGetDiagValue(
+			this->address, dvi,
+			{[this, onDone](uint8_t, uint8_t dvi, const std::vector<uint8_t> &data, void*) {
+				this->dvReceived(dvi, data);
+				onDone();
+			}},
+			{[onDone](Mtb::CmdError, void*) { onDone(); }}
+		)
+	);
+}
 
-std::map<size_t, std::vector<uint8_t>> MtbModule::parseFirmware(const QJsonObject &json) {
-	std::map<size_t, std::vector<uint8_t>> result;
+std::optional<uint32_t> MtbModule::dvCounter(uint8_t dvi) const {
+	auto it = this->dvCache.find(dvi);
+	if ((it == this->dvCache.end()) || (it->second.data.size() != 4))
+		return std::nullopt;
+	const std::vector<uint8_t> &data = it->second.data;
+	return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24); // little-endian
+}
 
-	for (const QString &key : json.keys()) {
-		size_t addr = key.toInt();
-		const QString &dataStr = QJsonSafe::safeString(json[key]);
-		std::vector<uint8_t> data;
-		for (int i = 0; i < dataStr.size(); i += 2)
-			data.push_back(dataStr.mid(i, 2).toInt(nullptr, 16));
+QJsonObject MtbModule::dvJson(uint8_t dvi, const std::vector<uint8_t> &data) const {
+	QJsonArray dataAr;
+	for (const uint8_t byte : data)
+		dataAr.push_back(byte);
 
-		for (size_t i = 0; i < data.size(); i++) {
-			size_t block = (addr+i) / MtbModule::FwUpgrade::BLOCK_SIZE;
-			size_t offset = (addr+i) % MtbModule::FwUpgrade::BLOCK_SIZE;
-			if (result.find(block) == result.end())
-				result.emplace(block, std::vector<uint8_t>(MtbModule::FwUpgrade::BLOCK_SIZE, 0xFF));
+	return {
+		{"DVnum", dvi},
+		{"DVkey", this->DVToStr(dvi)},
+		{"DVvalue", this->dvRepr(dvi, data)},
+		{"DVvalueRaw", dataAr},
+	};
+}
+
+void MtbModule::dvReceived(uint8_t dvi, const std::vector<uint8_t> &data) {
+	DvCacheEntry &cached = this->dvCache[dvi];
+	const bool changed = (!cached.age.isValid()) || (cached.data != data);
+	cached.data = data;
+	cached.age.start();
+
+	if (dvi == Mtb::DVCommon::State) {
+		this->mtbBusDiagStateChanged(data);
+	} else if ((dvi == Mtb::DVCommon::Errors) || (dvi == Mtb::DVCommon::Warnings)) {
+		bool anyNonZero = false;
+		for (uint8_t byte : data)
+			if (byte != 0)
+				anyNonZero = true;
+
+		if (dvi == Mtb::DVCommon::Errors)
+			this->mtbBusDiagStateChanged(anyNonZero, this->busModuleInfo.warning);
+		else if (dvi == Mtb::DVCommon::Warnings)
+			this->mtbBusDiagStateChanged(this->busModuleInfo.error, anyNonZero);
+	}
 
-			result[block][offset] = data[i];
+	if (changed)
+		this->sendDiagChanged(dvi, data);
+}
+
+void MtbModule::sendDiagChanged(uint8_t dvi, const std::vector<uint8_t> &data) const {
+	QJsonObject json;
+	for (ClientSession *session : sessions.subscribers(this->address)) {
+		if (!session->diagEvents)
+			continue;
+		if (json.isEmpty()) {
+			QJsonObject dv = this->dvJson(dvi, data);
+			dv["address"] = this->address;
+			// Diagnostics are not part of resumable event history, 'seq' says which events precede this one
+			json = {
+				{"command", "module_diag_changed"},
+				{"type", "event"},
+				{"seq", static_cast<qint64>(eventLog.lastSeq())},
+				{"module_diag_changed", dv},
+			};
 		}
+		session->stats.events++;
+		server.send(*session, json);
 	}
+}
+
+/* Firmware Upgrade ----------------------------------------------------------*/
 
-	return result;
+std::shared_ptr<const FirmwareImage> MtbModule::requestFirmware(const QJsonObject &request, size_t pageSize) {
+	if (request.contains("firmware_hash"))
+		return firmwareStore.get(QJsonSafe::safeString(request, "firmware_hash"), pageSize);
+	return std::make_shared<const FirmwareImage>(parseFirmware(request, pageSize));
 }
 
 bool MtbModule::isFirmwareUpgrading() const { return this->fwUpgrade.fwUpgrading.has_value(); }
 
+void MtbModule::upgradeFw(const ServerRequest &request, std::shared_ptr<const FirmwareImage> firmware,
+                          FwUpgradeHooks hooks) {
+	this->fwUpgdStart(request, firmware, hooks);
+}
+
+void MtbModule::fwUpgdStart(const ServerRequest &request, std::shared_ptr<const FirmwareImage> firmware,
+                            FwUpgradeHooks hooks) {
+	this->fwUpgrade.fwUpgrading = request;
+	this->fwUpgrade.data = firmware;
+	this->fwUpgrade.toWrite = 0;
+	this->fwUpgrade.hooks = hooks;
+	this->stateChanged();
+
+	// Otherwise upgrade is initialized when pending operation finishes
+	if (this->fwUpgdCanInit())
+		this->fwUpgdInit();
+}
+
 void MtbModule::fwUpgdInit() {
 	this->mlog("Initializing firmware upgrade", Mtb::LogLevel::Info);
 	this->sendModuleInfo(this->fwUpgrade.fwUpgrading.value().socket);
@@ -381,7 +599,7 @@ void MtbModule::fwUpgdInit() {
 void MtbModule::fwUpgdReqAck() {
 	// Wait for module to reboot & initialize communication
 	// Check if module is in bootloader
-	QTimer::singleShot(200, [this](){
+	QTimer::singleShot(200, this->fwUpgdGuarded([this](){
 		mtbusb.send(
 			Mtb::CmdMtbModuleInfoRequest(
 				this->address,
@@ -389,19 +607,21 @@ void MtbModule::fwUpgdReqAck() {
 				{[this](Mtb::CmdError, void*) { this->fwUpgdError("Unable to get rebooted module information"); }}
 			)
 		);
-	});
+	}));
 }
 
 void MtbModule::fwUpgdGotInfo(Mtb::ModuleInfo info) {
 	this->busModuleInfo = info;
+	this->stateChanged();
 	if (!this->busModuleInfo.inBootloader())
 		return this->fwUpgdError("Module rebooted, but not in bootloader!");
 
-	this->fwUpgrade.toWrite = this->fwUpgrade.data.begin();
+	this->fwUpgrade.toWrite = 0;
 	this->fwUpgdGetStatus();
 }
 
 void MtbModule::fwUpgdGetStatus() {
+	this->fwUpgrade.statusRequests++;
 	mtbusb.send(
 		Mtb::CmdMtbModuleFwWriteFlashStatusRequest(
 			this->address,
@@ -411,22 +631,87 @@ void MtbModule::fwUpgdGetStatus() {
 	);
 }
 
+void MtbModule::fwUpgdScheduleStatus(size_t delayMs) {
+	if (delayMs == 0)
+		this->fwUpgdGetStatus();
+	else
+		QTimer::singleShot(delayMs, this->fwUpgdGuarded([this]() { this->fwUpgdGetStatus(); }));
+}
+
 void MtbModule::fwUpgdGotStatus(Mtb::FwWriteFlashStatus status) {
+	FwUpgrade &upgd = this->fwUpgrade;
 	if (status == Mtb::FwWriteFlashStatus::WritingFlash) {
-		this->fwUpgdGetStatus();
+		// Geometric backoff instead of busy-polling the bus during page programming
+		if (upgd.sinceWrite.isValid())
+			upgd.lastBusyMs = upgd.sinceWrite.elapsed();
+		const size_t delay = upgd.statusDelayMs;
+		upgd.statusDelayMs = std::min(std::max(2*upgd.statusDelayMs, FWUPGD_STATUS_BACKOFF_MIN_MS),
+		                              FWUPGD_STATUS_BACKOFF_MAX_MS);
+		this->fwUpgdScheduleStatus(delay);
 		return;
 	}
 
-	if (this->fwUpgrade.toWrite == this->fwUpgrade.data.end())
+	if ((upgd.pageWritten) && (upgd.sinceWrite.isValid())) {
+		// Programming finished between the last 'WritingFlash' response & now
+		const qint64 elapsed = upgd.sinceWrite.elapsed();
+		if (upgd.lastBusyMs >= 0)
+			this->fwUpgdPageWriteMeasured((upgd.lastBusyMs + elapsed) / 2.0);
+		else if (s_fwPageWriteMs.find(this->type) != s_fwPageWriteMs.end())
+			this->fwUpgdPageWriteMeasured(elapsed * FWUPGD_EARLY_SHRINK); // waited too long
+		else
+			this->fwUpgdPageWriteMeasured(elapsed);
+	}
+	upgd.pageWritten = false;
+
+	if (upgd.toWrite >= upgd.data->blocksCnt())
 		return fwUpgdAllWritten();
 
-	uint16_t fwAddr = (*this->fwUpgrade.toWrite).first * MtbModule::FwUpgrade::BLOCK_SIZE;
-	const std::vector<uint8_t> &fwBlob = (*this->fwUpgrade.toWrite).second;
+	if (upgd.hooks.beforeWrite)
+		upgd.hooks.beforeWrite(this->fwUpgdGuarded([this]() { this->fwUpgdWriteBlock(); }));
+	else
+		this->fwUpgdWriteBlock();
+}
+
+void MtbModule::fwUpgdPageWriteMeasured(double ms) {
+	auto it = s_fwPageWriteMs.find(this->type);
+	if (it == s_fwPageWriteMs.end())
+		s_fwPageWriteMs.emplace(this->type, ms);
+	else
+		it->second = FWUPGD_PAGE_WRITE_EWMA_ALPHA*ms + (1-FWUPGD_PAGE_WRITE_EWMA_ALPHA)*it->second;
+}
 
+std::function<void()> MtbModule::fwUpgdGuarded(std::function<void()> func) const {
+	std::weak_ptr<const bool> alive = this->fwUpgrade.alive;
+	return [alive, func]() {
+		if (!alive.expired())
+			func();
+	};
+}
+
+void MtbModule::fwUpgdWriteBlock() {
+	const size_t block = this->fwUpgrade.toWrite;
+	const uint16_t blockAddr = this->fwUpgrade.data->blockAddr(block);
+	const bool pageEnd = (((blockAddr + FirmwareImage::BLOCK_SIZE) % this->fwPageSize()) == 0);
 	mtbusb.send(
 		Mtb::CmdMtbModuleFwWriteFlash(
-			this->address, fwAddr, fwBlob,
-			{[this](uint8_t, void*) { this->fwUpgdGetStatus(); }},
+			this->address, blockAddr, this->fwUpgrade.data->block(block),
+			{[this, pageEnd](uint8_t, void*) {
+				FwUpgrade &upgd = this->fwUpgrade;
+				if (upgd.hooks.onProgress)
+					upgd.hooks.onProgress(upgd.toWrite, upgd.data->blocksCnt());
+
+				upgd.pageWritten = pageEnd;
+				upgd.sinceWrite.start();
+				upgd.lastBusyMs = -1;
+				upgd.statusDelayMs = FWUPGD_STATUS_BACKOFF_MIN_MS;
+
+				// Page is being programmed -> first ask when it is expected to be done
+				auto it = s_fwPageWriteMs.find(this->type);
+				if ((pageEnd) && (it != s_fwPageWriteMs.end()))
+					this->fwUpgdScheduleStatus(static_cast<size_t>(it->second));
+				else
+					this->fwUpgdGetStatus();
+			}},
 			{[this](Mtb::CmdError error, void*) {
 				if (error == Mtb::CmdError::BadAddress)
 					this->fwUpgdError("Bad address!");
@@ -435,28 +720,36 @@ void MtbModule::fwUpgdGotStatus(Mtb::FwWriteFlashStatus status) {
 			}}
 		)
 	);
-	++(this->fwUpgrade.toWrite);
+	this->fwUpgrade.toWrite++;
 }
 
 void MtbModule::fwUpgdError(const QString &error, size_t code) {
-	QJsonObject json{
-		{"command", "module_upgrade_fw"},
-		{"type", "response"},
-		{"status", "error"},
-		{"error", jsonError(code, error)},
-	};
+	if (!this->fwUpgrade.fwUpgrading.has_value())
+		return; // already failed (e.g. on MTB-USB disconnect), late error of pending command
 	const ServerRequest request = this->fwUpgrade.fwUpgrading.value();
-	if (request.id.has_value())
-		json["id"] = static_cast<int>(request.id.value());
-	server.send(request.socket, json);
+	const FwUpgradeHooks hooks = this->fwUpgrade.hooks;
+	if (!hooks.onDone) {
+		QJsonObject json{
+			{"command", "module_upgrade_fw"},
+			{"type", "response"},
+			{"status", "error"},
+			{"error", jsonError(code, error)},
+		};
+		if (request.id.has_value())
+			json["id"] = static_cast<int>(request.id.value());
+		server.send(request.socket, json);
+	}
 
-	this->fwUpgrade.fwUpgrading.reset();
-	this->fwUpgrade.data.clear();
+	this->fwUpgrade = FwUpgrade();
 	this->sendModuleInfo(request.socket);
+	if (hooks.onDone)
+		hooks.onDone(error);
 }
 
 void MtbModule::fwUpgdAllWritten() {
-	this->mlog("Firmware programming finished, rebooting module...", Mtb::LogLevel::Info);
+	this->mlog("Firmware programming finished ("+QString::number(this->fwUpgrade.data->blocksCnt())+" blocks, "+
+	           QString::number(this->fwUpgrade.statusRequests)+" status requests), rebooting module...",
+	           Mtb::LogLevel::Info);
 
 	this->reboot(
 		{[this]() { this->fwUpgdRebooted(); }},
@@ -470,20 +763,24 @@ void MtbModule::fwUpgdRebooted() {
 
 	this->mlog("Firmware successfully upgraded", Mtb::LogLevel::Info);
 
-	QJsonObject json{
-		{"command", "module_upgrade_fw"},
-		{"type", "response"},
-		{"status", "ok"},
-		{"address", this->address},
-	};
 	const ServerRequest request = this->fwUpgrade.fwUpgrading.value();
-	if (request.id.has_value())
-		json["id"] = static_cast<int>(request.id.value());
-	server.send(request.socket, json);
+	const FwUpgradeHooks hooks = this->fwUpgrade.hooks;
+	if (!hooks.onDone) {
+		QJsonObject json{
+			{"command", "module_upgrade_fw"},
+			{"type", "response"},
+			{"status", "ok"},
+			{"address", this->address},
+		};
+		if (request.id.has_value())
+			json["id"] = static_cast<int>(request.id.value());
+		server.send(request.socket, json);
+	}
 
-	this->fwUpgrade.fwUpgrading.reset();
-	this->fwUpgrade.data.clear();
+	this->fwUpgrade = FwUpgrade();
 	this->sendModuleInfo(request.socket, true);
+	if (hooks.onDone)
+		hooks.onDone({});
 }
 
 void MtbModule::reboot(std::function<void()> onOk, std::function<void()> onError) {
@@ -498,13 +795,16 @@ void MtbModule::reboot(std::function<void()> onOk, std::function<void()> onError
 
 	this->sendModuleInfo(nullptr, true);
 
+	// Follow-up is sent from timer, but on behalf of the same client as the reboot
+	const Mtb::CmdOrigin origin = mtbusb.origin();
 	mtbusb.send(
 		Mtb::CmdMtbModuleReboot(
 			this->address,
-			{[this](uint8_t, void*) {
-				QTimer::singleShot(1000, [this](){
+			{[this, origin](uint8_t, void*) {
+				QTimer::singleShot(1000, [this, origin](){
 					if (this->rebooting.activatedByMtbUsb)
 						return;
+					Mtb::MtbUsb::OriginScope scope(mtbusb, origin);
 					mtbusb.send(
 						Mtb::CmdMtbModuleInfoRequest(
 							this->address,
@@ -533,6 +833,7 @@ void MtbModule::fullyActivated() {
 	this->active = true;
 	this->mlog("Activated", Mtb::LogLevel::Info);
 	this->sendModuleInfo(nullptr, true);
+	rulesEngine.moduleActivated(this->address);
 
 	if (this->isRebooting()) {
 		this->rebooting.rebooting = false;
@@ -540,7 +841,7 @@ void MtbModule::fullyActivated() {
 	}
 }
 
-void MtbModule::jsonSpecificCommand(QTcpSocket *socket, const QJsonObject &request) {
+void MtbModule::jsonSpecificCommand(QIODevice *socket, const QJsonObject &request) {
 	const QJsonArray dataAr = QJsonSafe::safeArray(request, "data");
 	std::vector<uint8_t> data;
 	for (const auto var : dataAr) {
@@ -572,7 +873,7 @@ void MtbModule::jsonSpecificCommand(QTcpSocket *socket, const QJsonObject &reque
 	);
 }
 
-void MtbModule::jsonBeacon(QTcpSocket *socket, const QJsonObject &request) {
+void MtbModule::jsonBeacon(QIODevice *socket, const QJsonObject &request) {
 	bool beacon = QJsonSafe::safeBool(request, "beacon");
 
 	mtbusb.send(
@@ -580,6 +881,7 @@ void MtbModule::jsonBeacon(QTcpSocket *socket, const QJsonObject &request) {
 			this->address, beacon,
 			{[this, socket, request, beacon](uint8_t, void*) {
 				this->beacon = beacon;
+				this->stateChanged();
 				QJsonObject response = jsonOkResponse(request);
 				response["beacon"] = beacon;
 				server.send(socket, response);
@@ -1,11 +1,15 @@
 #ifndef _MODULE_H_
 #define _MODULE_H_
 
-#include <QTcpSocket>
+#include <QIODevice>
 #include <QJsonObject>
+#include <QHash>
+#include <QElapsedTimer>
 #include "mtbusb.h"
 #include "server.h"
 #include "errors.h"
+#include "mtb-shm.h"
+#include "firmware.h"
 
 enum class MtbModuleType {
 	Unknown = 0x00,
@@ -18,8 +22,33 @@ enum class MtbModuleType {
 };
 
 constexpr size_t MTB_MODULE_ACTIVATIONS = 5;
+constexpr size_t FWUPGD_STATUS_BACKOFF_MIN_MS = 2;
+constexpr size_t FWUPGD_STATUS_BACKOFF_MAX_MS = 50;
+constexpr double FWUPGD_PAGE_WRITE_EWMA_ALPHA = 0.2; // weight of the newest page
+constexpr double FWUPGD_EARLY_SHRINK = 0.75; // page written before the first status request -> estimate shrinks
 QString moduleTypeToStr(MtbModuleType);
 
+// Hooks of firmware upgrade orchestrated by the daemon (not requested by 'module_upgrade_fw')
+struct FwUpgradeHooks {
+	std::function<void(std::function<void()> write)> beforeWrite; // called before each block write, could delay it
+	std::function<void(size_t written, size_t total)> onProgress; // blocks
+	std::function<void(const QString &error)> onDone; // empty error = success
+};
+
+// Set-outputs request waiting for MTBbus; 'onDone' (if set) is called instead of sending response
+// to 'module_set_outputs', it gets empty object on success, error otherwise
+// 'origin' = MTBbus origin at creation: command sent later on behalf of the request is accounted to it
+struct SetOutputsRequest : public ServerRequest {
+	std::function<void(const QJsonObject &error)> onDone;
+	Mtb::CmdOrigin origin;
+
+	SetOutputsRequest(QIODevice *socket, std::optional<size_t> id = std::nullopt,
+	                  std::function<void(const QJsonObject&)> onDone = nullptr);
+};
+
+// Origin of the first request sent on behalf of a client, ORIGIN_DAEMON if none
+Mtb::CmdOrigin requestsOrigin(const std::vector<SetOutputsRequest>&);
+
 class MtbModule {
 protected:
 	bool active = false;
@@ -32,6 +61,20 @@ protected:
 	size_t activationsRemaining = 0;
 	bool activating = false;
 
+	// State versioning: version is assigned from global counter on each change of module's
+	// state/config. JSON of module info is cached until next change.
+	mutable uint64_t version;
+	mutable std::array<std::optional<QJsonObject>, 4> infoCache; // index: state*2 + config
+	static uint64_t s_globalVersion;
+	static std::map<MtbModuleType, double> s_fwPageWriteMs; // learned flash page write time
+
+	// Last known diagnostic values (from client requests & DV poller)
+	struct DvCacheEntry {
+		std::vector<uint8_t> data;
+		QElapsedTimer age; // monotonic: wall clock steps must not make old values fresh
+	};
+	std::map<uint8_t, DvCacheEntry> dvCache;
+
 	struct Rebooting {
 		bool rebooting = false;
 		bool activatedByMtbUsb;
@@ -41,35 +84,54 @@ protected:
 	Rebooting rebooting;
 
 	struct FwUpgrade {
-		static constexpr size_t BLOCK_SIZE = 64;
-		using FirmwareStorage = std::map<size_t, std::vector<uint8_t>>;
 		std::optional<ServerRequest> fwUpgrading;
-		FirmwareStorage data; // block to data map
-		FirmwareStorage::iterator toWrite;
+		std::shared_ptr<const FirmwareImage> data; // shared with other modules being upgraded
+		size_t toWrite = 0; // index of next block in 'data'
+		FwUpgradeHooks hooks;
+
+		// Flash status polling: first request is delayed by predicted page write time, then backs off
+		bool pageWritten = false; // last written block completed a page -> module is programming flash
+		QElapsedTimer sinceWrite; // since last block write was acknowledged
+		qint64 lastBusyMs = -1; // time of last 'WritingFlash' status since write
+		size_t statusDelayMs = 0;
+		size_t statusRequests = 0;
+
+		// Expires when the upgrade ends or the module is destroyed; guards delayed callbacks
+		std::shared_ptr<const bool> alive = std::make_shared<const bool>(true);
 	};
 	FwUpgrade fwUpgrade;
 
-	void sendInputsChanged(QJsonObject inputs) const;
-	void sendOutputsChanged(QJsonObject outputs, const std::vector<QTcpSocket*> &ignore) const;
-	void sendModuleInfo(QTcpSocket *ignore = nullptr, bool sendConfig = false) const;
-
-	virtual void jsonSetOutput(QTcpSocket*, const QJsonObject&);
-	virtual void jsonUpgradeFw(QTcpSocket*, const QJsonObject&);
-	virtual void jsonReboot(QTcpSocket*, const QJsonObject&);
-	virtual void jsonSpecificCommand(QTcpSocket*, const QJsonObject&);
-	virtual void jsonBeacon(QTcpSocket*, const QJsonObject&);
-	virtual void jsonGetDiag(QTcpSocket*, const QJsonObject&);
-
+	void stateChanged() const;
+	// 'delta' (if not empty) is sent instead of 'inputs' to clients subscribed with 'inputs_delta'
+	void sendInputsChanged(QJsonObject inputs, uint32_t changedInputs = 0, const QJsonObject &delta = {}) const;
+	void sendOutputsChanged(QJsonObject outputs, const std::vector<QIODevice*> &ignore) const;
+	void sendModuleInfo(QIODevice *ignore = nullptr, bool sendConfig = false) const;
+
+	virtual void jsonSetOutput(QIODevice*, const QJsonObject&);
+	virtual void jsonUpgradeFw(QIODevice*, const QJsonObject&);
+	virtual void jsonReboot(QIODevice*, const QJsonObject&);
+	virtual void jsonSpecificCommand(QIODevice*, const QJsonObject&);
+	virtual void jsonBeacon(QIODevice*, const QJsonObject&);
+	virtual void jsonGetDiag(QIODevice*, const QJsonObject&);
+
+	// Module is ready to start firmware upgrade (e.g. no configuration being written)
+	virtual bool fwUpgdCanInit() const { return true; }
+	void fwUpgdStart(const ServerRequest&, std::shared_ptr<const FirmwareImage>, FwUpgradeHooks);
 	void fwUpgdInit();
 	void fwUpgdError(const QString&, size_t code = MTB_MODULE_FWUPGD_ERROR);
 	void fwUpgdReqAck();
 	void fwUpgdGotInfo(Mtb::ModuleInfo);
 	void fwUpgdGetStatus();
+	void fwUpgdScheduleStatus(size_t delayMs);
+	void fwUpgdPageWriteMeasured(double ms);
 	void fwUpgdGotStatus(Mtb::FwWriteFlashStatus);
+	void fwUpgdWriteBlock();
 	void fwUpgdAllWritten();
+	std::function<void()> fwUpgdGuarded(std::function<void()>) const;
 	void fwUpgdRebooted();
 
-	static std::map<size_t, std::vector<uint8_t>> parseFirmware(const QJsonObject&);
+	// Image referenced by 'firmware_hash' or sent in the request; nullptr = unknown hash
+	static std::shared_ptr<const FirmwareImage> requestFirmware(const QJsonObject &request, size_t pageSize);
 
 	void reboot(std::function<void()> onOk, std::function<void()> onError);
 	void fullyActivated();
@@ -78,8 +140,23 @@ protected:
 	void mlog(const QString& message, Mtb::LogLevel) const;
 
 	virtual QJsonObject dvRepr(uint8_t dvi, const std::vector<uint8_t> &data) const;
+	QJsonObject dvJson(uint8_t dvi, const std::vector<uint8_t> &data) const;
+	void dvReceived(uint8_t dvi, const std::vector<uint8_t> &data);
+	void sendDiagChanged(uint8_t dvi, const std::vector<uint8_t> &data) const;
 
 	void mtbBusDiagStateChanged(bool isError, bool isWarning);
+	// Set owner of output & keep reverse index in client sessions in sync
+	void setOutputOwner(QIODevice *&owner, size_t port, QIODevice *newOwner) const;
+
+	// Output pulses ('duration_ms'), indexed by port, sized lazily
+	std::vector<uint32_t> pulseGeneration;
+	std::vector<std::optional<uint8_t>> pulseRevert;
+	// Output 'port' changes to pulse value now, reverts to 'current' after 'durationMs'
+	void pulseStart(size_t port, uint8_t current, size_t durationMs);
+	void pulseCancel(size_t port);
+	void pulsesCancelAll();
+	// Revert outputs after pulse, port -> value
+	virtual void pulsesEnded(const std::map<size_t, uint8_t>&) {}
 
 public:
 	MtbModule(uint8_t addr);
@@ -94,6 +171,14 @@ public:
 	bool isConfigSetting() const;
 
 	virtual QJsonObject moduleInfo(bool state, bool config) const;
+	const QJsonObject& cachedModuleInfo(bool state, bool config) const;
+	uint64_t stateVersion() const { return this->version; }
+	static uint64_t globalVersion() { return s_globalVersion; }
+	static uint64_t nextGlobalVersion() { return ++s_globalVersion; }
+	virtual QJsonObject inputsJson() const;
+	virtual QJsonObject outputsJson() const;
+	// Fill binary state for shared-memory export, 'state' is zeroed by caller
+	virtual void exportState(MtbShm::ModuleState &state) const;
 
 	virtual void mtbBusActivate(Mtb::ModuleInfo);
 	virtual void mtbBusLost();
@@ -101,20 +186,47 @@ public:
 	virtual void mtbBusDiagStateChanged(const std::vector<uint8_t>&);
 	virtual void mtbUsbDisconnected();
 
-	virtual void jsonCommand(QTcpSocket*, const QJsonObject&, bool hasWriteAccess);
-	virtual void jsonSetConfig(QTcpSocket*, const QJsonObject&);
-	virtual void jsonSetAddress(QTcpSocket*, const QJsonObject&);
+	struct JsonCommand {
+		void (MtbModule::*handler)(QIODevice*, const QJsonObject&);
+		bool needsWriteAccess;
+	};
+	// Commands for specific module ('address' in request), registered to server's dispatch table
+	static const QHash<QString, JsonCommand>& jsonCommands();
+
+	virtual void jsonSetConfig(QIODevice*, const QJsonObject&);
+	virtual void jsonSetAddress(QIODevice*, const QJsonObject&);
 
 	virtual void loadConfig(const QJsonObject&);
 	virtual void saveConfig(QJsonObject&) const;
 
-	virtual std::vector<QTcpSocket*> outputSetters() const;
-	virtual void resetOutputsOfClient(QTcpSocket*);
+	// Safe state of outputs owned by the client, 'onDone' is called when the module confirms (or nothing to reset)
+	virtual void resetOutputsOfClient(QIODevice*, std::function<void(const QJsonObject &error)> onDone);
 	virtual void allOutputsReset();
-	virtual void clientDisconnected(QTcpSocket*);
+	virtual void clientDisconnected(QIODevice*);
+
+	// Outputs controlled by the daemon itself (rules), no client owns them afterwards
+	virtual size_t inputsCnt() const { return 0; }
+	virtual size_t outputsCnt() const { return 0; }
+	virtual uint8_t outputFromJson(const QJsonObject&) const; // throws JsonParseError
+	virtual void setOutputsDaemon(const std::map<size_t, uint8_t> &ports);
+	// Outputs set on behalf of client 'owner' in single MTBbus request (scenes)
+	virtual void setOutputsBatch(QIODevice *owner, const std::map<size_t, uint8_t> &ports,
+	                             std::function<void(const QJsonObject &error)> onDone);
+	// Bit i = input i, empty when inputs are not known
+	virtual std::optional<uint32_t> packedInputs() const { return std::nullopt; }
+	// Called by output pulses wheel, (port, generation)
+	void pulsesExpired(const std::vector<std::pair<size_t, uint32_t>>&);
 	virtual bool fwDeprecated() const;
+	// Page size of module's flash, 0 = firmware upgrade not supported
+	virtual size_t fwPageSize() const { return 0; }
+	// Firmware upgrade orchestrated by the daemon, result is reported via hooks only
+	void upgradeFw(const ServerRequest&, std::shared_ptr<const FirmwareImage>, FwUpgradeHooks);
 
 	virtual void reactivateCheck();
+	// Read DV from module to the cache, 'onDone' is called on both success & error
+	void pollDv(uint8_t dvi, std::function<void()> onDone);
+	// Value of 4-byte counter DV (e.g. mtbbus_bad_crc) from the cache
+	std::optional<uint32_t> dvCounter(uint8_t dvi) const;
 
 	virtual QString DVToStr(uint8_t dv) const;
 	virtual std::optional<uint8_t> StrToDV(const QString&) const;
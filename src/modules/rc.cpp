@@ -1,5 +1,7 @@
 #include <QJsonArray>
 #include <QJsonObject>
+#include <algorithm>
+#include <iterator>
 #include "utils.h"
 #include "rc.h"
 #include "mtbusb.h"
@@ -23,6 +25,20 @@ QJsonObject MtbRc::moduleInfo(bool state, bool config) const {
 	return response;
 }
 
+QJsonObject MtbRc::inputsJson() const { return this->inputsToJson(); }
+
+void MtbRc::exportState(MtbShm::ModuleState &state) const {
+	static_assert(RC_IN_CNT <= MtbShm::RC_INPUTS_CNT);
+	MtbModule::exportState(state);
+	state.inputsCnt = RC_IN_CNT;
+	for (size_t i = 0; i < RC_IN_CNT; i++) {
+		state.rcAddrsCnt[i] = this->inputs[i].size();
+		size_t j = 0;
+		for (auto it = this->inputs[i].begin(); (it != this->inputs[i].end()) && (j < MtbShm::RC_ADDRS_CNT); ++it, j++)
+			state.rcAddrs[i][j] = *it;
+	}
+}
+
 QJsonObject MtbRc::inputsToJson() const {
 	QJsonArray arrayOfInputs;
 	for (const auto& input : this->inputs) {
@@ -36,7 +52,7 @@ QJsonObject MtbRc::inputsToJson() const {
 
 /* Json Set Config ---------------------------------------------------------- */
 
-void MtbRc::jsonSetConfig(QTcpSocket *socket, const QJsonObject &request) {
+void MtbRc::jsonSetConfig(QIODevice *socket, const QJsonObject &request) {
 	// Just set general MtbModule configuration (e.g. name of the module)
 
 	if (this->isFirmwareUpgrading()) {
@@ -53,7 +69,7 @@ void MtbRc::jsonSetConfig(QTcpSocket *socket, const QJsonObject &request) {
 
 /* Json Upgrade Firmware ---------------------------------------------------- */
 
-void MtbRc::jsonUpgradeFw(QTcpSocket *socket, const QJsonObject &request) {
+void MtbRc::jsonUpgradeFw(QIODevice *socket, const QJsonObject &request) {
 	if (this->isFirmwareUpgrading()) {
 		sendError(socket, request, MTB_MODULE_UPGRADING_FW, "Firmware is already being upgraded!");
 		return;
@@ -63,29 +79,18 @@ void MtbRc::jsonUpgradeFw(QTcpSocket *socket, const QJsonObject &request) {
 	return;
 
 	// TODO
-	/*this->fwUpgrade.fwUpgrading = ServerRequest(socket, request);
-	this->fwUpgrade.data = parseFirmware(request["firmware"].toObject());
-	this->alignFirmware(this->fwUpgrade.data, this->pageSize());
+	/*std::shared_ptr<const FirmwareImage> firmware = requestFirmware(request, this->pageSize());
+	if (firmware == nullptr) {
+		sendError(socket, request, MTB_FIRMWARE_UNKNOWN, "Unknown firmware_hash!");
+		return;
+	}
+	this->fwUpgrade.fwUpgrading = ServerRequest(socket, request);
+	this->fwUpgrade.data = firmware;
 
 	if (!this->configWriting.has_value() && this->setOutputsSent.empty())
 		this->fwUpgdInit();*/
 }
 
-void MtbRc::alignFirmware(std::map<size_t, std::vector<uint8_t>> &fw, size_t pageSize) {
-	// TODO
-	const size_t blocksPerPage = pageSize / MtbModule::FwUpgrade::BLOCK_SIZE;
-	std::vector<size_t> blocks;
-	for (auto const &imap : fw)
-		blocks.push_back(imap.first);
-	for (size_t block : blocks) {
-		size_t page = block / blocksPerPage;
-		for (size_t i = 0; i < blocksPerPage; i++) {
-			if (fw.find((page*blocksPerPage)+i) == fw.end())
-				fw.emplace((page*blocksPerPage) + i, std::vector<uint8_t>(MtbModule::FwUpgrade::BLOCK_SIZE, 0xFF));
-		}
-	}
-}
-
 /* -------------------------------------------------------------------------- */
 
 /* MTB-RC activation ---------------------------------------------------------
@@ -101,6 +106,7 @@ void MtbRc::mtbBusActivate(Mtb::ModuleInfo info) {
 		// In bootloader → mark as active, don't do anything else
 		this->mlog("Module is in bootloader!", Mtb::LogLevel::Info);
 		this->active = true;
+		this->stateChanged();
 		return;
 	}
 
@@ -133,23 +139,56 @@ void MtbRc::inputsRead(const std::vector<uint8_t> &data) {
 	this->fullyActivated();
 }
 
-void MtbRc::storeInputsState(const std::vector<uint8_t> &data) {
-	for (auto& input : this->inputs)
+uint8_t MtbRc::storeInputsState(const std::vector<uint8_t> &data) {
+	for (auto& input : this->inputsNew)
 		input.clear();
 
 	for (size_t i = 0; i+1 < data.size(); i += 2) {
 		size_t input = (data[i] >> 5);
 		DccAddr addr = data[i+1] | ((data[i] & 0x1F) << 8);
-		this->inputs[input].insert(addr);
+		this->inputsNew[input].push_back(addr);
+	}
+
+	uint8_t changedPorts = 0;
+	for (size_t i = 0; i < RC_IN_CNT; i++) {
+		std::vector<DccAddr> &now = this->inputsNew[i];
+		std::sort(now.begin(), now.end());
+		now.erase(std::unique(now.begin(), now.end()), now.end());
+
+		const std::vector<DccAddr> &old = this->inputs[i];
+		this->added[i].clear();
+		this->removed[i].clear();
+		std::set_difference(now.begin(), now.end(), old.begin(), old.end(), std::back_inserter(this->added[i]));
+		std::set_difference(old.begin(), old.end(), now.begin(), now.end(), std::back_inserter(this->removed[i]));
+		if ((!this->added[i].empty()) || (!this->removed[i].empty()))
+			changedPorts |= (1 << i);
+	}
+
+	std::swap(this->inputs, this->inputsNew);
+	return changedPorts;
+}
+
+QJsonObject MtbRc::inputsDeltaToJson(uint8_t changedPorts) const {
+	QJsonObject ports;
+	for (size_t i = 0; i < RC_IN_CNT; i++) {
+		if ((changedPorts & (1 << i)) == 0)
+			continue;
+		QJsonArray added, removed;
+		for (const DccAddr addr : this->added[i])
+			added.push_back(addr);
+		for (const DccAddr addr : this->removed[i])
+			removed.push_back(addr);
+		ports[QString::number(i)] = QJsonObject{{"added", added}, {"removed", removed}};
 	}
+	return {{"ports", ports}};
 }
 
 /* Inputs changed ----------------------------------------------------------- */
 
 void MtbRc::mtbBusInputsChanged(const std::vector<uint8_t> &data) {
 	if (this->active || this->activating) {
-		this->storeInputsState(data);
-		this->sendInputsChanged(this->inputsToJson());
+		const uint8_t changedPorts = this->storeInputsState(data);
+		this->sendInputsChanged(this->inputsToJson(), changedPorts, this->inputsDeltaToJson(changedPorts));
 	}
 }
 
@@ -157,6 +196,7 @@ void MtbRc::mtbUsbDisconnected() {
 	MtbModule::mtbUsbDisconnected();
 	for (auto& input : this->inputs)
 		input.clear();
+	this->stateChanged(); // export cleared state
 }
 
 /* -------------------------------------------------------------------------- */
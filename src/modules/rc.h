@@ -1,7 +1,7 @@
 #ifndef _MODULE_MTB_RC_H_
 #define _MODULE_MTB_RC_H_
 
-#include <set>
+#include <vector>
 #include <QMap>
 #include "module.h"
 #include "server.h"
@@ -107,15 +107,20 @@ const QMap<uint8_t, QString> dvsRC {
 
 class MtbRc : public MtbModule {
 protected:
-	std::array<std::set<DccAddr>, RC_IN_CNT> inputs;
-
-	void storeInputsState(const std::vector<uint8_t>&);
+	// Sorted addresses per port; buffers are reused, so input change does not allocate in steady state
+	std::array<std::vector<DccAddr>, RC_IN_CNT> inputs;
+	std::array<std::vector<DccAddr>, RC_IN_CNT> inputsNew; // scratch for storeInputsState
+	std::array<std::vector<DccAddr>, RC_IN_CNT> added; // by the last storeInputsState
+	std::array<std::vector<DccAddr>, RC_IN_CNT> removed;
+
+	// Returns bitmask of changed ports
+	uint8_t storeInputsState(const std::vector<uint8_t>&);
 	void inputsRead(const std::vector<uint8_t>&);
 	QJsonObject inputsToJson() const;
+	QJsonObject inputsDeltaToJson(uint8_t changedPorts) const;
 
-	void jsonUpgradeFw(QTcpSocket*, const QJsonObject&) override;
+	void jsonUpgradeFw(QIODevice*, const QJsonObject&) override;
 	void activate();
-	static void alignFirmware(std::map<size_t, std::vector<uint8_t>>&, size_t pageSize);
 
 	QJsonObject dvRepr(uint8_t dvi, const std::vector<uint8_t> &data) const override;
 
@@ -123,12 +128,14 @@ public:
 	MtbRc(uint8_t addr);
 	~MtbRc() override = default;
 	QJsonObject moduleInfo(bool state, bool config) const override;
+	QJsonObject inputsJson() const override;
+	void exportState(MtbShm::ModuleState&) const override;
 
 	void mtbBusActivate(Mtb::ModuleInfo) override;
 	void mtbBusInputsChanged(const std::vector<uint8_t>&) override;
 	void mtbUsbDisconnected() override;
 
-	void jsonSetConfig(QTcpSocket*, const QJsonObject&) override;
+	void jsonSetConfig(QIODevice*, const QJsonObject&) override;
 	void reactivateCheck() override;
 
 	QString DVToStr(uint8_t dv) const override;
@@ -5,11 +5,21 @@
 #include "main.h"
 #include "errors.h"
 #include "utils.h"
+#include "rules.h"
+#include "outputpulses.h"
+
+static_assert(UNI_IO_CNT <= SESSION_MAX_OWNED_PORTS, "Outputs owners index too small");
 
 MtbUni::MtbUni(uint8_t addr) : MtbModule(addr) {
 	std::fill(this->whoSetOutput.begin(), this->whoSetOutput.end(), nullptr);
 }
 
+MtbUni::~MtbUni() {
+	// Remove ownership from clients' reverse index
+	for (size_t i = 0; i < UNI_IO_CNT; i++)
+		this->setOutputOwner(this->whoSetOutput[i], i, nullptr);
+}
+
 bool MtbUni::isIrSupport() const { return this->type == MtbModuleType::Univ2ir; }
 
 size_t MtbUni::pageSize() const {
@@ -55,9 +65,21 @@ QJsonObject MtbUni::moduleInfo(bool state, bool config) const {
 	return response;
 }
 
+QJsonObject MtbUni::inputsJson() const { return inputsToJson(this->inputs); }
+QJsonObject MtbUni::outputsJson() const { return outputsToJson(this->outputsConfirmed); }
+
+void MtbUni::exportState(MtbShm::ModuleState &state) const {
+	static_assert(UNI_IO_CNT <= MtbShm::OUTPUTS_CNT);
+	MtbModule::exportState(state);
+	state.inputsCnt = UNI_IO_CNT;
+	state.outputsCnt = UNI_IO_CNT;
+	state.inputs = this->inputs;
+	std::copy(this->outputsConfirmed.begin(), this->outputsConfirmed.end(), state.outputs);
+}
+
 /* Json Set Outputs --------------------------------------------------------- */
 
-void MtbUni::jsonSetOutput(QTcpSocket *socket, const QJsonObject &request) {
+void MtbUni::jsonSetOutput(QIODevice *socket, const QJsonObject &request) {
 	if (!this->active) {
 		sendError(socket, request, MTB_MODULE_FAILED, "Cannot set output of inactive module!");
 		return;
@@ -77,6 +99,7 @@ void MtbUni::jsonSetOutput(QTcpSocket *socket, const QJsonObject &request) {
 
 	QJsonObject outputs = QJsonSafe::safeObject(request, "outputs");
 	QMap<size_t, uint8_t> ports; // code per port
+	QMap<size_t, size_t> durations; // pulses, ms per port
 
 	// Validate ports
 	bool ok;
@@ -88,7 +111,13 @@ void MtbUni::jsonSetOutput(QTcpSocket *socket, const QJsonObject &request) {
 		}
 
 		try {
-			ports[port] = jsonOutputToByte(QJsonSafe::safeObject(outputs[key]));
+			const QJsonObject output = QJsonSafe::safeObject(outputs[key]);
+			ports[port] = jsonOutputToByte(output);
+			if (output.contains("duration_ms")) {
+				durations[port] = QJsonSafe::safeUInt(output, "duration_ms");
+				if ((durations[port] == 0) || (durations[port] > PULSE_MAX_DURATION_MS))
+					throw JsonParseError("'duration_ms' must be 1-"+QString::number(PULSE_MAX_DURATION_MS)+"!");
+			}
 		} catch (const JsonParseError& e) {
 			sendError(socket, request, MTB_MODULE_INVALID_PORT, "Invalid port "+key+" content: "+e.what());
 			return;
@@ -105,8 +134,12 @@ void MtbUni::jsonSetOutput(QTcpSocket *socket, const QJsonObject &request) {
 			if ((this->whoSetOutput[port] != nullptr) && (this->whoSetOutput[port] != socket))
 				this->mlog("Multiple clients set same output: "+QString::number(port),
 				           Mtb::LogLevel::Warning);
-			this->whoSetOutput[port] = socket;
+			this->setOutputOwner(this->whoSetOutput[port], port, socket);
 		}
+		if (durations.contains(port))
+			this->pulseStart(port, this->outputsWant[port], durations[port]);
+		else
+			this->pulseCancel(port);
 		this->outputsWant[port] = ports[port];
 	}
 
@@ -150,6 +183,10 @@ uint8_t MtbUni::jsonOutputToByte(const QJsonObject &json) {
 void MtbUni::setOutputs() {
 	this->setOutputsSent = this->setOutputsWaiting;
 	this->setOutputsWaiting.clear();
+	// Queued requests are flushed from callbacks -> account to the client explicitly
+	Mtb::MtbUsb::OriginScope origin(mtbusb, requestsOrigin(this->setOutputsSent));
+	Mtb::MtbUsb::PriorityScope priority(mtbusb, this->outputsResetPending);
+	this->outputsResetPending = false;
 
 	mtbusb.send(
 		Mtb::CmdMtbModuleSetOutput(
@@ -168,8 +205,13 @@ void MtbUni::mtbBusOutputsSet(const std::vector<uint8_t>& data) {
 	// TODO: check if output really set?
 
 	// Report ok callback to clients
-	std::vector<QTcpSocket*> ignore;
-	for (const ServerRequest &sr : this->setOutputsSent) {
+	std::vector<QIODevice*> ignore;
+	for (const SetOutputsRequest &sr : this->setOutputsSent) {
+		if (sr.onDone) {
+			sr.onDone({});
+			ignore.push_back(sr.socket); // outputs are in the response of the batch
+			continue;
+		}
 		QJsonObject response{
 			{"command", "module_set_outputs"},
 			{"type", "response"},
@@ -229,7 +271,11 @@ QJsonObject MtbUni::inputsToJson(uint16_t inputs) {
 
 void MtbUni::mtbBusOutputsNotSet(Mtb::CmdError error) {
 	// Report err callback to clients
-	for (const ServerRequest &sr : this->setOutputsSent) {
+	for (const SetOutputsRequest &sr : this->setOutputsSent) {
+		if (sr.onDone) {
+			sr.onDone(jsonError(error));
+			continue;
+		}
 		QJsonObject response{
 			{"command", "module_set_outputs"},
 			{"type", "response"},
@@ -256,7 +302,7 @@ void MtbUni::mtbBusOutputsNotSet(Mtb::CmdError error) {
 
 /* Json Set Config ---------------------------------------------------------- */
 
-void MtbUni::jsonSetConfig(QTcpSocket *socket, const QJsonObject &request) {
+void MtbUni::jsonSetConfig(QIODevice *socket, const QJsonObject &request) {
 	if (this->configWriting.has_value()) {
 		sendError(socket, request, MTB_MODULE_ALREADY_WRITING, "Another client is writing config now!");
 		return;
@@ -310,7 +356,9 @@ void MtbUni::mtbBusConfigWritten() {
 		response["id"] = static_cast<int>(request.id.value());
 	server.send(request.socket, response);
 
-	if (this->isFirmwareUpgrading())
+	if ((!this->setOutputsWaiting.empty()) && (this->setOutputsSent.empty()))
+		this->setOutputs(); // outputs queued while config was being written
+	else if (this->isFirmwareUpgrading())
 		this->fwUpgdInit();
 }
 
@@ -329,69 +377,116 @@ void MtbUni::mtbBusConfigNotWritten(Mtb::CmdError error) {
 		response["id"] = static_cast<int>(request.id.value());
 	server.send(request.socket, response);
 
-	if (this->isFirmwareUpgrading())
+	if ((!this->setOutputsWaiting.empty()) && (this->setOutputsSent.empty()))
+		this->setOutputs(); // outputs queued while config was being written
+	else if (this->isFirmwareUpgrading())
 		this->fwUpgdInit();
 }
 
-/* Json Upgrade Firmware ---------------------------------------------------- */
+/* Firmware Upgrade --------------------------------------------------------- */
 
-void MtbUni::jsonUpgradeFw(QTcpSocket *socket, const QJsonObject &request) {
-	if (this->isFirmwareUpgrading()) {
-		sendError(socket, request, MTB_MODULE_UPGRADING_FW, "Firmware is already being upgraded!");
-		return;
-	}
-
-	this->fwUpgrade.fwUpgrading = ServerRequest(socket, request);
-	this->fwUpgrade.data = parseFirmware(QJsonSafe::safeObject(request, "firmware"));
-	this->alignFirmware(this->fwUpgrade.data, this->pageSize());
-
-	if (!this->configWriting.has_value() && this->setOutputsSent.empty())
-		this->fwUpgdInit();
-}
+size_t MtbUni::fwPageSize() const { return this->pageSize(); }
 
-void MtbUni::alignFirmware(std::map<size_t, std::vector<uint8_t>> &fw, size_t pageSize) {
-	const size_t blocksPerPage = pageSize / MtbModule::FwUpgrade::BLOCK_SIZE;
-	std::vector<size_t> blocks;
-	for (auto const &imap : fw)
-		blocks.push_back(imap.first);
-	for (size_t block : blocks) {
-		size_t page = block / blocksPerPage;
-		for (size_t i = 0; i < blocksPerPage; i++) {
-			if (fw.find((page*blocksPerPage)+i) == fw.end())
-				fw.emplace((page*blocksPerPage) + i, std::vector<uint8_t>(MtbModule::FwUpgrade::BLOCK_SIZE, 0xFF));
-		}
-	}
+bool MtbUni::fwUpgdCanInit() const {
+	return (!this->configWriting.has_value() && this->setOutputsSent.empty());
 }
 
 /* -------------------------------------------------------------------------- */
 
-void MtbUni::resetOutputsOfClient(QTcpSocket *socket) {
-	MtbModule::resetOutputsOfClient(socket);
+void MtbUni::resetOutputsOfClient(QIODevice *socket, std::function<void(const QJsonObject&)> onDone) {
+	MtbModule::resetOutputsOfClient(socket, nullptr);
 
 	bool send = false;
 	if (this->config.has_value()) {
 		for (size_t i = 0; i < UNI_IO_CNT; i++) {
 			if (this->whoSetOutput[i] == socket) {
 				this->outputsWant[i] = this->config.value().outputsSafe[i];
-				this->whoSetOutput[i] = nullptr;
+				this->setOutputOwner(this->whoSetOutput[i], i, nullptr);
+				this->pulseCancel(i);
 				send = true;
 			}
 		}
 	}
 
-	if (send) {
+	if (!send) {
+		if (onDone)
+			onDone({});
+		return;
+	}
+
+	// Merged with outputs waiting to be sent, not queued behind other MTBbus traffic
+	this->outputsResetPending = true;
+	this->setOutputsWaiting.push_back({nullptr, std::nullopt, onDone});
+	if (this->setOutputsSent.empty())
+		this->setOutputs();
+}
+
+void MtbUni::setOutputsDaemon(const std::map<size_t, uint8_t> &ports) {
+	for (const auto &[port, value] : ports)
+		this->pulseCancel(port);
+	this->queueOutputs(ports, true);
+}
+
+void MtbUni::setOutputsBatch(QIODevice *owner, const std::map<size_t, uint8_t> &ports,
+                             std::function<void(const QJsonObject&)> onDone) {
+	if (!this->active)
+		return onDone(jsonError(MTB_MODULE_FAILED, "Module is not active!"));
+	if (this->isFirmwareUpgrading())
+		return onDone(jsonError(MTB_MODULE_UPGRADING_FW, "Firmware of module is being upgraded!"));
+	if (this->busModuleInfo.inBootloader())
+		return onDone(jsonError(MTB_MODULE_IN_BOOTLOADER, "Module is in bootloader!"));
+	if (this->isConfigSetting())
+		return onDone(jsonError(MTB_MODULE_CONFIG_SETTING, "Configuration of module is being changed!"));
+
+	bool changed = false;
+	for (const auto &[port, value] : ports) {
+		if (port >= UNI_IO_CNT)
+			continue;
+		this->pulseCancel(port);
+		if (this->outputsWant[port] != value) {
+			this->outputsWant[port] = value;
+			this->setOutputOwner(this->whoSetOutput[port], port, owner);
+			changed = true;
+		}
+	}
+
+	if (!changed)
+		return onDone({});
+	this->setOutputsWaiting.push_back({owner, std::nullopt, onDone});
+	if (this->setOutputsSent.empty())
+		this->setOutputs();
+}
+
+void MtbUni::pulsesEnded(const std::map<size_t, uint8_t> &ports) {
+	this->queueOutputs(ports, false); // output stays owned by the client which started the pulse
+}
+
+void MtbUni::queueOutputs(const std::map<size_t, uint8_t> &ports, bool releaseOwner) {
+	if ((!this->active) || (this->isFirmwareUpgrading()) || (this->busModuleInfo.inBootloader()))
+		return; // outputs are reset on module activation
+
+	bool changed = false;
+	for (const auto &[port, value] : ports) {
+		if ((port < UNI_IO_CNT) && (this->outputsWant[port] != value)) {
+			this->outputsWant[port] = value;
+			if (releaseOwner)
+				this->setOutputOwner(this->whoSetOutput[port], port, nullptr);
+			changed = true;
+		}
+	}
+
+	if (changed) {
 		this->setOutputsWaiting.push_back({nullptr});
-		if (this->setOutputsSent.empty())
+		// Pulse reverts must not be lost while config is being written -> sent after it is written
+		if ((this->setOutputsSent.empty()) && (!this->isConfigSetting()))
 			this->setOutputs();
 	}
 }
 
-std::vector<QTcpSocket*> MtbUni::outputSetters() const {
-	std::vector<QTcpSocket*> result;
-	for (QTcpSocket* socket : this->whoSetOutput)
-		if ((socket != nullptr) && (std::find(result.begin(), result.end(), socket) == result.end()))
-			result.push_back(socket);
-	return result;
+std::optional<uint32_t> MtbUni::packedInputs() const {
+	if (!this->active)
+		return std::nullopt;
+	return this->inputs;
 }
 
 std::vector<uint8_t> MtbUni::mtbBusOutputsData() const {
@@ -448,8 +543,9 @@ void MtbUni::allOutputsReset() {
 	for (size_t i = 0; i < UNI_IO_CNT; i++) {
 		this->outputsWant[i] = this->config.has_value() ? this->config.value().outputsSafe[i] : 0;
 		this->outputsConfirmed[i] = this->outputsWant[i];
-		this->whoSetOutput[i] = nullptr;
+		this->setOutputOwner(this->whoSetOutput[i], i, nullptr);
 	}
+	this->pulsesCancelAll();
 	this->sendOutputsChanged(outputsToJson(this->outputsConfirmed), {});
 }
 
@@ -560,7 +656,8 @@ void MtbUni::outputsReset() {
 	}
 
 	for (size_t i = 0; i < UNI_IO_CNT; i++)
-		this->whoSetOutput[i] = nullptr;
+		this->setOutputOwner(this->whoSetOutput[i], i, nullptr);
+	this->pulsesCancelAll();
 
 	this->fullyActivated();
 }
@@ -569,8 +666,11 @@ void MtbUni::outputsReset() {
 
 void MtbUni::mtbBusInputsChanged(const std::vector<uint8_t> &data) {
 	if (this->active || this->activating) {
+		const uint16_t old = this->inputs;
 		this->storeInputsState(data);
-		this->sendInputsChanged(inputsToJson(this->inputs));
+		this->sendInputsChanged(inputsToJson(this->inputs), old ^ this->inputs);
+		if (this->active)
+			rulesEngine.inputsChanged(this->address, old, this->inputs);
 	}
 }
 
@@ -578,6 +678,7 @@ void MtbUni::mtbUsbDisconnected() {
 	MtbModule::mtbUsbDisconnected();
 	this->allOutputsReset();
 	this->inputs = 0;
+	this->stateChanged(); // export cleared state
 }
 
 /* MtbUniConfig ------------------------------------------------------------- */
@@ -715,6 +816,7 @@ void MtbUni::reactivateCheck() {
 void MtbUni::loadConfig(const QJsonObject &json) {
 	MtbModule::loadConfig(json);
 	this->config.emplace(MtbUniConfig(QJsonSafe::safeObject(json, "config")));
+	this->stateChanged();
 }
 
 void MtbUni::saveConfig(QJsonObject &json) const {
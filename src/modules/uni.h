@@ -41,10 +41,11 @@ protected:
 	std::array<uint8_t, UNI_IO_CNT> outputsConfirmed;
 	std::optional<MtbUniConfig> config;
 	std::optional<MtbUniConfig> configToWrite;
-	std::array<QTcpSocket*, UNI_IO_CNT> whoSetOutput;
+	std::array<QIODevice*, UNI_IO_CNT> whoSetOutput;
 
-	std::vector<ServerRequest> setOutputsWaiting;
-	std::vector<ServerRequest> setOutputsSent;
+	std::vector<SetOutputsRequest> setOutputsWaiting;
+	std::vector<SetOutputsRequest> setOutputsSent;
+	bool outputsResetPending = false; // next set outputs is safe-state reset -> sent with priority
 
 	void configSet();
 	bool isIrSupport() const;
@@ -59,10 +60,13 @@ protected:
 	static QJsonObject outputsToJson(const std::array<uint8_t, UNI_IO_CNT>&);
 	static QJsonObject inputsToJson(uint16_t inputs);
 
-	void jsonSetOutput(QTcpSocket*, const QJsonObject&) override;
-	void jsonUpgradeFw(QTcpSocket*, const QJsonObject&) override;
+	void jsonSetOutput(QIODevice*, const QJsonObject&) override;
+	bool fwUpgdCanInit() const override;
 
 	void setOutputs();
+	// Enqueue outputs set by the daemon (rules, pulses) to standard set-outputs path
+	void queueOutputs(const std::map<size_t, uint8_t> &ports, bool releaseOwner);
+	void pulsesEnded(const std::map<size_t, uint8_t>&) override;
 	void mtbBusOutputsSet(const std::vector<uint8_t> &data);
 	void mtbBusOutputsNotSet(Mtb::CmdError);
 	void mtbBusConfigWritten();
@@ -76,34 +80,44 @@ protected:
 	static uint8_t flickPerMinToMtbUniValue(size_t flickPerMin);
 	static size_t flickMtbUniToPerMin(uint8_t mtbUniFlick);
 
-	static void alignFirmware(std::map<size_t, std::vector<uint8_t>>&, size_t pageSize);
-
 	QJsonObject dvRepr(uint8_t dvi, const std::vector<uint8_t> &data) const override;
 
 	float adcbg() const;
 
 public:
 	MtbUni(uint8_t addr);
-	~MtbUni() override = default;
+	~MtbUni() override;
 	QJsonObject moduleInfo(bool state, bool config) const override;
+	QJsonObject inputsJson() const override;
+	QJsonObject outputsJson() const override;
+	void exportState(MtbShm::ModuleState&) const override;
 
 	void mtbBusActivate(Mtb::ModuleInfo) override;
 	void mtbBusInputsChanged(const std::vector<uint8_t>&) override;
 	void mtbUsbDisconnected() override;
 
-	void jsonSetConfig(QTcpSocket*, const QJsonObject&) override;
+	void jsonSetConfig(QIODevice*, const QJsonObject&) override;
 
 	void loadConfig(const QJsonObject&) override;
 	void saveConfig(QJsonObject&) const override;
 
-	std::vector<QTcpSocket*> outputSetters() const override;
-	void resetOutputsOfClient(QTcpSocket*) override;
+	void resetOutputsOfClient(QIODevice*, std::function<void(const QJsonObject&)> onDone) override;
 	void allOutputsReset() override;
 	void reactivateCheck() override;
 
 	static uint8_t jsonOutputToByte(const QJsonObject&);
 
+	size_t inputsCnt() const override { return UNI_IO_CNT; }
+	size_t outputsCnt() const override { return UNI_IO_CNT; }
+	uint8_t outputFromJson(const QJsonObject &json) const override { return jsonOutputToByte(json); }
+	void setOutputsDaemon(const std::map<size_t, uint8_t> &ports) override;
+	void setOutputsBatch(QIODevice *owner, const std::map<size_t, uint8_t> &ports,
+	                     std::function<void(const QJsonObject&)> onDone) override;
+	std::optional<uint32_t> packedInputs() const override;
+
+
 	bool fwDeprecated() const override;
+	size_t fwPageSize() const override;
 };
 
 #endif
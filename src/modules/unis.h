@@ -53,10 +53,11 @@ protected:
 	std::array<uint8_t, UNIS_OUT_CNT> outputsConfirmed;
 	std::optional<MtbUnisConfig> config;
 	std::optional<MtbUnisConfig> configToWrite;
-	std::array<QTcpSocket*, UNIS_OUT_CNT> whoSetOutput;
+	std::array<QIODevice*, UNIS_OUT_CNT> whoSetOutput;
 
-	std::vector<ServerRequest> setOutputsWaiting;
-	std::vector<ServerRequest> setOutputsSent;
+	std::vector<SetOutputsRequest> setOutputsWaiting;
+	std::vector<SetOutputsRequest> setOutputsSent;
+	bool outputsResetPending = false; // next set outputs is safe-state reset -> sent with priority
 
 	void configSet();
 	bool isIrSupport() const;
@@ -68,10 +69,13 @@ protected:
 	static QJsonObject outputsToJson(const std::array<uint8_t, UNIS_OUT_CNT>&);
 	static QJsonObject inputsToJson(uint32_t inputs);
 
-	void jsonSetOutput(QTcpSocket*, const QJsonObject&) override;
-	void jsonUpgradeFw(QTcpSocket*, const QJsonObject&) override;
+	void jsonSetOutput(QIODevice*, const QJsonObject&) override;
+	bool fwUpgdCanInit() const override;
 
 	void setOutputs();
+	// Enqueue outputs set by the daemon (rules, pulses) to standard set-outputs path
+	void queueOutputs(const std::map<size_t, uint8_t> &ports, bool releaseOwner);
+	void pulsesEnded(const std::map<size_t, uint8_t>&) override;
 	void mtbBusOutputsSet(const std::vector<uint8_t> &data);
 	void mtbBusOutputsNotSet(Mtb::CmdError);
 	void mtbBusConfigWritten();
@@ -85,31 +89,42 @@ protected:
 	static uint8_t flickPerMinToMtbUnisValue(size_t flickPerMin);
 	static size_t flickMtbUnisToPerMin(uint8_t MtbUnisFlick);
 
-	static void alignFirmware(std::map<size_t, std::vector<uint8_t>>&, size_t pageSize);
     bool fwDeprecated() const override;
 
 	QJsonObject dvRepr(uint8_t dvi, const std::vector<uint8_t> &data) const override;
 
 public:
 	MtbUnis(uint8_t addr);
-	~MtbUnis() override = default;
+	~MtbUnis() override;
 	QJsonObject moduleInfo(bool state, bool config) const override;
+	QJsonObject inputsJson() const override;
+	QJsonObject outputsJson() const override;
+	void exportState(MtbShm::ModuleState&) const override;
 
 	void mtbBusActivate(Mtb::ModuleInfo) override;
 	void mtbBusInputsChanged(const std::vector<uint8_t>&) override;
 	void mtbUsbDisconnected() override;
 
-	void jsonSetConfig(QTcpSocket*, const QJsonObject&) override;
+	void jsonSetConfig(QIODevice*, const QJsonObject&) override;
 
 	void loadConfig(const QJsonObject&) override;
 	void saveConfig(QJsonObject&) const override;
 
-	std::vector<QTcpSocket*> outputSetters() const override;
-	void resetOutputsOfClient(QTcpSocket*) override;
+	void resetOutputsOfClient(QIODevice*, std::function<void(const QJsonObject&)> onDone) override;
 	void allOutputsReset() override;
 	void reactivateCheck() override;
 
 	static uint8_t jsonOutputToByte(const QJsonObject&);
+
+	size_t inputsCnt() const override { return UNIS_IN_CNT; }
+	size_t outputsCnt() const override { return UNIS_OUT_CNT; }
+	uint8_t outputFromJson(const QJsonObject &json) const override { return jsonOutputToByte(json); }
+	void setOutputsDaemon(const std::map<size_t, uint8_t> &ports) override;
+	void setOutputsBatch(QIODevice *owner, const std::map<size_t, uint8_t> &ports,
+	                     std::function<void(const QJsonObject&)> onDone) override;
+	std::optional<uint32_t> packedInputs() const override;
+
+	size_t fwPageSize() const override;
 };
 
 #endif
@@ -8,6 +8,10 @@ See mtbusb.h or README for more documentation.
 */
 
 #include <functional>
+#include <memory>
+#include <vector>
+#include <QDateTime>
+#include <QDeadlineTimer>
 #include "mtbusb-common.h"
 
 namespace Mtb {
@@ -28,25 +32,48 @@ struct CommandCallback {
 	    : func(func), data(data) {}
 };
 
+// Identification of client on whose behalf the command is sent (assigned by MtbUsb user)
+using CmdOrigin = uint64_t;
+constexpr CmdOrigin ORIGIN_DAEMON = 0; // daemon-internal traffic (activation, polling, ...)
+
 struct Cmd {
 	// Only 'error' callback has same type for all commands -> defined here
 	// 'ok' callback is defined in inherited commands, because it's different for diffent commands
 	// e.g. response to 'beacon' is just 'ok', but response to 'get module info' is the module info
 	const CommandCallback<ErrCallbackFunc> onError;
+	CmdOrigin origin = ORIGIN_DAEMON; // set by MtbUsb::send
+	// Set by MtbUsb::send, applies to expirable commands only; monotonic clock, so wall-clock steps do not matter
+	QDeadlineTimer deadline{QDeadlineTimer::Forever};
+	bool priority = false; // set by MtbUsb::send, queued ahead of non-priority commands
+	// Identical commands sent while this one is queued or in flight get the same result (see sharable)
+	mutable std::vector<std::shared_ptr<const Cmd>> followers;
+	mutable bool finished = false; // result is being delivered, no more followers accepted
 
 	Cmd(const CommandCallback<ErrCallbackFunc>& onError = {[](CmdError, void*){}}) : onError(onError) {}
 	virtual std::vector<uint8_t> getBytes() const = 0;
 	virtual QString msg() const = 0;
 	virtual ~Cmd() = default;
 	virtual bool conflict(const Cmd &) const { return false; }
+	// Command can be dropped from queue (deadline passed / client gone) without breaking daemon's state
+	virtual bool expirable() const { return false; }
+	// Idempotent read: identical command already queued / in flight is not sent again, its result is shared
+	virtual bool sharable() const { return false; }
 	virtual bool processUsbResponse(MtbUsbRecvCommand, const std::vector<uint8_t>&) const {
 		// return false for every unexpected response (used for request-response pairing)
 		// return true iff response processed
 		return false;
 	}
 	virtual void callError(CmdError error) const {
+		this->finished = true;
 		if (nullptr != onError.func)
 			onError.func(error, onError.data);
+		for (const auto &follower : this->takeFollowers())
+			follower->callError(error);
+	}
+	std::vector<std::shared_ptr<const Cmd>> takeFollowers() const {
+		std::vector<std::shared_ptr<const Cmd>> result;
+		result.swap(this->followers);
+		return result;
 	}
 };
 
@@ -197,6 +224,8 @@ struct CmdMtbModuleInfoRequest : public CmdMtbUsbForward {
 	 : CmdMtbUsbForward(module, _busCommandCode, onError), onInfo(onInfo) {}
 	std::vector<uint8_t> getBytes() const override { return {usbCommandCode, module, _busCommandCode}; }
 	QString msg() const override { return "Module "+QString::number(module)+" Information Request"; }
+	bool expirable() const override { return true; }
+	bool sharable() const override { return true; }
 
 	bool processBusResponse(MtbBusRecvCommand busCommand, const std::vector<uint8_t>& data) const override {
 		if ((busCommand == MtbBusRecvCommand::ModuleInfo) && (data.size() >= 6)) {
@@ -264,6 +293,8 @@ struct CmdMtbModuleGetConfig : public CmdMtbUsbForward {
 	 : CmdMtbUsbForward(module, _busCommandCode, onError), onGet(onGet) {}
 	std::vector<uint8_t> getBytes() const override { return {usbCommandCode, module, _busCommandCode}; }
 	QString msg() const override { return "Module "+QString::number(module)+" get configuration"; }
+	bool expirable() const override { return true; }
+	bool sharable() const override { return true; }
 
 	bool processBusResponse(MtbBusRecvCommand busCommand, const std::vector<uint8_t>& data) const override {
 		if (busCommand == MtbBusRecvCommand::ModuleConfig) {
@@ -309,6 +340,8 @@ struct CmdMtbModuleGetInputs : public CmdMtbUsbForward {
 	 : CmdMtbUsbForward(module, _busCommandCode, onError), onGet(onGet) {}
 	std::vector<uint8_t> getBytes() const override { return {usbCommandCode, module, _busCommandCode}; }
 	QString msg() const override { return "Module "+QString::number(module)+" get inputs"; }
+	bool expirable() const override { return true; }
+	bool sharable() const override { return true; }
 
 	bool processBusResponse(MtbBusRecvCommand busCommand, const std::vector<uint8_t>& data) const override {
 		if (busCommand == MtbBusRecvCommand::InputState) {
@@ -644,6 +677,8 @@ struct CmdMtbModuleGetDiagValue : public CmdMtbUsbForward {
 	}
 	std::vector<uint8_t> getBytes() const override { return {usbCommandCode, module, _busCommandCode, dvi}; }
 	QString msg() const override { return "Module "+QString::number(module)+" get DV "+QString::number(dvi); }
+	bool expirable() const override { return true; }
+	bool sharable() const override { return true; }
 
 	bool processBusResponse(MtbBusRecvCommand busCommand, const std::vector<uint8_t> &data) const override {
 		if ((busCommand == MtbBusRecvCommand::DiagValue) && (data.size() >= 1)) {
@@ -68,6 +68,10 @@ QString cmdErrorToStr(CmdError cmdError) {
 		return "Unknown command";
 	case CmdError::UnsupportedCommand:
 		return "Unsupported command";
+	case CmdError::Expired:
+		return "Deadline expired before sending";
+	case CmdError::Cancelled:
+		return "Cancelled before sending";
 	default:
 		return "Unknown error";
 	}
@@ -84,6 +84,8 @@ enum class CmdError {
 	UsbNoResponse = 0x11,
 	BusNoResponse = 0x12,
 	PendingConflict = 0x13,
+	Expired = 0x14, // deadline passed before the command was sent
+	Cancelled = 0x15, // command dropped from queue before it was sent (e.g. client disconnected)
 };
 
 QString cmdErrorToStr(CmdError);
@@ -9,10 +9,16 @@ void MtbUsb::pendingTimerTick() {
 		m_pending.clear();
 	}
 
+	if (!m_out.empty()) {
+		dropOut([](const Cmd &cmd) { return expired(cmd); }, CmdError::Expired);
+	}
+
 	if (m_pending.empty())
 		return;
 
 	if (m_pending.front().timeout < QDateTime::currentDateTime()) {
+		if (is<CmdMtbUsbForward>(*m_pending.front().cmd))
+			m_linkStats[dynamic_cast<const CmdMtbUsbForward&>(*m_pending.front().cmd).module].timeouts++;
 		if (m_pending.front().no_sent >= _PENDING_RESEND_MAX)
 			pendingTimeoutError(CmdError::UsbNoResponse);
 		else
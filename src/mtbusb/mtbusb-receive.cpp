@@ -110,6 +110,10 @@ void MtbUsb::parseMtbUsbMessage(uint8_t command_code, const std::vector<uint8_t>
 		if (data.size() >= 2) {
 			log("GET: module "+QString::number(data[0])+" no response for inquiry, remaining attempts: "+
 			    QString::number(data[1]), LogLevel::Commands);
+			if (data[1] > 0)
+				m_linkStats[data[0]].inquiryMisses++;
+			else
+				m_linkStats[data[0]].failures++;
 			if (data[1] == 0) {
 				log("GET: module "+QString::number(data[0])+" failed", LogLevel::Commands);
 				if (m_activeModules.has_value()) {
@@ -158,6 +162,11 @@ void MtbUsb::parseMtbBusMessage(uint8_t module, uint8_t attempts, uint8_t comman
 		if (attempts != 1)
 			log("Got attempts="+QString::number(attempts)+" for non-event!", LogLevel::Warning);
 	}
+	if ((!isBusEvent(command)) && (attempts > 0)) {
+		LinkStats &link = m_linkStats[module];
+		link.responses++;
+		link.attempts[std::min<size_t>(attempts, _LINK_ATTEMPTS_CNT)-1]++;
+	}
 
 	switch (command) {
 	case MtbBusRecvCommand::Error:
@@ -207,8 +216,13 @@ void MtbUsb::parseMtbBusMessage(uint8_t module, uint8_t attempts, uint8_t comman
 	for (size_t i = 0; i < m_pending.size(); i++) {
 		if (is<CmdMtbUsbForward>(*m_pending[i].cmd)) {
 			const CmdMtbUsbForward &forward = dynamic_cast<const CmdMtbUsbForward&>(*m_pending[i].cmd);
+			forward.finished = true; // callback may send identical command, it must not attach to this one
 			if ((forward.module == module) &&
 			    (forward.processBusResponse(command, data))) {
+				if (forward.origin != ORIGIN_DAEMON) // +1 = command code
+					emit onBusTime(forward.origin, busTimeUs(data.size()+_BUS_FRAME_OVERHEAD+1));
+				for (const auto &follower : forward.takeFollowers())
+					dynamic_cast<const CmdMtbUsbForward&>(*follower).processBusResponse(command, data);
 				for (auto it = m_pending.begin(); it != m_pending.end(); ++it) {
 					if (it->cmd.get() == m_pending[i].cmd.get()) {
 						m_pending.erase(it);
@@ -219,6 +233,7 @@ void MtbUsb::parseMtbBusMessage(uint8_t module, uint8_t attempts, uint8_t comman
 				}
 				return;
 			}
+			forward.finished = false;
 		}
 	}
 
@@ -239,6 +254,7 @@ void MtbUsb::handleMtbUsbError(uint8_t code, uint8_t out_command_code, uint8_t a
 			if (is<CmdMtbUsbForward>(*m_pending[i].cmd)) {
 				const CmdMtbUsbForward &forward = dynamic_cast<const CmdMtbUsbForward&>(*m_pending[i].cmd);
 				if ((out_command_code == forward.busCommandCode) && (addr == forward.module)) {
+					m_linkStats[addr].noResponse++;
 					log("GET: error: no response from module "+QString::number(addr)+" to command "+forward.msg(),
 					    LogLevel::Error);
 					pendingTimeoutError(CmdError::BusNoResponse, i);
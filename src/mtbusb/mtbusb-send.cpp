@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <optional>
+#include <typeinfo>
 #include "mtbusb.h"
 
 namespace Mtb {
@@ -23,7 +26,10 @@ void MtbUsb::write(std::unique_ptr<const Cmd> cmd, size_t no_sent) {
 	log("PUT: " + cmd->msg(), LogLevel::Commands);
 
 	try {
-		send(cmd->getBytes());
+		const std::vector<uint8_t> bytes = cmd->getBytes();
+		send(bytes);
+		if ((cmd->origin != ORIGIN_DAEMON) && (is<CmdMtbUsbForward>(*cmd))) // bytes: 0x10, address, command code, data
+			emit onBusTime(cmd->origin, busTimeUs(bytes.size()-2+_BUS_FRAME_OVERHEAD));
 		m_pending.emplace_back(
 			cmd,
 			QDateTime::currentDateTime().addMSecs(_PENDING_TIMEOUT),
@@ -36,23 +42,125 @@ void MtbUsb::write(std::unique_ptr<const Cmd> cmd, size_t no_sent) {
 }
 
 void MtbUsb::send(std::unique_ptr<const Cmd> &cmd, bool bypass_m_out_emptiness) {
+	if ((cmd->sharable()) && (!bypass_m_out_emptiness)) {
+		if (const Cmd *leader = findShareable(*cmd)) {
+			// Same read already queued or in flight -> wait for its result
+			log("ATTACH: " + cmd->msg(), LogLevel::Debug);
+			leader->followers.emplace_back(std::move(cmd));
+			return;
+		}
+	}
+
 	// Sends or queues
 	if ((m_pending.size() >= _MAX_PENDING) || (!m_out.empty() && !bypass_m_out_emptiness) ||
 	    conflictWithPending(*cmd)) {
 		// Pending full -> push & do not start timer (response from CS will send automatically)
 		// We ensure pending buffer never contains commands with conflict
 		log("ENQUEUE: " + cmd->msg(), LogLevel::Debug);
-		m_out.emplace_back(std::move(cmd));
+		enqueue(cmd);
 	} else {
 		write(std::move(cmd));
 	}
 }
 
+void MtbUsb::enqueue(std::unique_ptr<const Cmd> &cmd) {
+	if (!cmd->priority) {
+		m_out.emplace_back(std::move(cmd));
+		return;
+	}
+
+	// Behind other priority commands and behind any command it conflicts with
+	auto position = m_out.begin();
+	for (auto it = m_out.begin(); it != m_out.end(); ++it)
+		if (((*it)->priority) || (cmd->conflict(**it)) || ((*it)->conflict(*cmd)))
+			position = std::next(it);
+	m_out.emplace(position, std::move(cmd));
+}
+
+uint32_t MtbUsb::busTimeUs(size_t bytes) const {
+	const int speed = m_mtbUsbInfo.has_value() ? mtbBusSpeedToInt(m_mtbUsbInfo->speed) : 38400;
+	return (bytes * _BUS_BITS_PER_BYTE * 1000000) / speed;
+}
+
 void MtbUsb::sendNextOut() {
-	std::unique_ptr<const Cmd> out = std::move(m_out.front());
-	log("DEQUEUE: " + out->msg(), LogLevel::Debug);
-	m_out.pop_front();
-	send(out, true);
+	while (!m_out.empty()) {
+		std::unique_ptr<const Cmd> out = std::move(m_out.front());
+		m_out.pop_front();
+		if (expired(*out)) {
+			log("EXPIRED: " + out->msg(), LogLevel::Debug);
+			out->callError(CmdError::Expired);
+			continue;
+		}
+		log("DEQUEUE: " + out->msg(), LogLevel::Debug);
+		send(out, true);
+		return;
+	}
+}
+
+bool MtbUsb::expired(const Cmd &cmd) {
+	if ((!cmd.deadline.hasExpired()) || (!cmd.expirable())) // Forever never expires
+		return false;
+	// Shared command is still needed when any of its waiters is
+	return std::all_of(cmd.followers.begin(), cmd.followers.end(),
+	                   [](const auto &follower) { return expired(*follower); });
+}
+
+const Cmd* MtbUsb::findShareable(const Cmd &cmd) const {
+	// Latest identical command with no other command for the same module sent after it, except for shareable
+	// reads (e.g. GetConfig after SetConfig or ModuleInfo after Reboot must not get result from before it)
+	const auto *forward = dynamic_cast<const CmdMtbUsbForward*>(&cmd);
+	std::optional<std::vector<uint8_t>> bytes; // computed only for commands of the same type & module
+	const Cmd *leader = nullptr;
+
+	auto visit = [&cmd, forward, &bytes, &leader](const Cmd &other) {
+		const auto *otherForward = dynamic_cast<const CmdMtbUsbForward*>(&other);
+		const bool sameTarget = (forward == nullptr) ? (otherForward == nullptr) :
+			((otherForward != nullptr) && ((otherForward->module == forward->module) || (otherForward->broadcast())));
+		if (!sameTarget)
+			return;
+		if (typeid(other) == typeid(cmd)) {
+			if (other.finished)
+				return;
+			if (!bytes.has_value())
+				bytes = cmd.getBytes();
+			if (other.getBytes() == bytes.value())
+				leader = &other;
+		} else if (!other.sharable()) {
+			leader = nullptr;
+		}
+	};
+
+	for (const auto &pending : m_pending)
+		visit(*pending.cmd);
+	for (const auto &out : m_out)
+		visit(*out);
+	return leader;
+}
+
+void MtbUsb::dropOut(const std::function<bool(const Cmd&)> &predicate, CmdError error) {
+	// Callbacks are called after the queue is updated, they can send new commands
+	std::vector<std::unique_ptr<const Cmd>> dropped;
+	for (auto it = m_out.begin(); it != m_out.end(); ) {
+		if (predicate(**it)) {
+			dropped.emplace_back(std::move(*it));
+			it = m_out.erase(it);
+		} else {
+			++it;
+		}
+	}
+	for (const auto &cmd : dropped) {
+		log("DROP: " + cmd->msg() + ": " + cmdErrorToStr(error), LogLevel::Debug);
+		cmd->callError(error);
+	}
+}
+
+void MtbUsb::purgeOrigin(CmdOrigin origin) {
+	if (origin == ORIGIN_DAEMON)
+		return;
+	// Command with followers is kept: other clients wait for its result
+	dropOut([origin](const Cmd &cmd) {
+		return ((cmd.origin == origin) && (cmd.expirable()) && (cmd.followers.empty()));
+	}, CmdError::Cancelled);
 }
 
 } // namespace Mtb
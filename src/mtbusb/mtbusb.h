@@ -4,12 +4,14 @@
 /* Low-level access to MTB-USB module via CDC serial port. */
 
 #include <QDateTime>
+#include <QDeadlineTimer>
 #include <QObject>
 #include <QSerialPort>
 #include <QTimer>
 #include <functional>
 #include <memory>
 #include <optional>
+#include <array>
 #include <queue>
 
 #include "mtbusb-commands.h"
@@ -23,6 +25,9 @@ constexpr size_t _PENDING_RESEND_MAX = 3;
 constexpr size_t _BUF_IN_TIMEOUT = 50; // ms
 constexpr size_t _MAX_PENDING = 3; // maximum number of commands waiting for response
 constexpr size_t _PING_SEND_PERIOD_MS = 5000;
+// MTBbus frame = address, length, command code, data, CRC (2 bytes); byte = 9 data bits + start + stop bit
+constexpr size_t _BUS_FRAME_OVERHEAD = 4; // all but command code & data
+constexpr size_t _BUS_BITS_PER_BYTE = 11;
 
 struct EOpenError : public MtbUsbError {
 	EOpenError(const std::string &str) : MtbUsbError(str) {}
@@ -78,6 +83,17 @@ struct PendingCmd {
 	size_t no_sent = 0; // how many times this command was resent (for calculating of giving-up)
 };
 
+// Per-module MTBbus link counters
+constexpr size_t _LINK_ATTEMPTS_CNT = 4; // histogram of attempts: 1, 2, 3, 4+
+struct LinkStats {
+	uint64_t responses = 0;
+	std::array<uint64_t, _LINK_ATTEMPTS_CNT> attempts = {0, }; // [i] = responses after i+1 attempts of MTB-USB
+	uint64_t noResponse = 0; // MTB-USB reported no response from the module
+	uint64_t timeouts = 0; // no answer from MTB-USB in time (command resent / failed)
+	uint64_t inquiryMisses = 0; // 'module failed' reports with remaining attempts (module still active)
+	uint64_t failures = 0; // module failed
+};
+
 struct MtbUsbInfo {
 	uint8_t type;
 	MtbBusSpeed speed;
@@ -109,8 +125,55 @@ public:
 	template <typename T>
 	void send(const T &&cmd);
 
+	CmdOrigin origin() const { return m_origin; } // of commands sent now
+
+	// Commands sent while OriginScope exists are attributed to 'origin' (see onBusTime)
+	// and expirable commands are dropped when not written to MTB-USB before 'deadline'
+	class OriginScope {
+	public:
+		OriginScope(MtbUsb &mtbusb, CmdOrigin origin, QDeadlineTimer deadline = QDeadlineTimer::Forever)
+		    : mtbusb(mtbusb), previousOrigin(mtbusb.m_origin), previousDeadline(mtbusb.m_deadline) {
+			mtbusb.m_origin = origin;
+			mtbusb.m_deadline = deadline;
+		}
+		~OriginScope() {
+			mtbusb.m_origin = previousOrigin;
+			mtbusb.m_deadline = previousDeadline;
+		}
+		OriginScope(const OriginScope&) = delete;
+		OriginScope& operator=(const OriginScope&) = delete;
+
+	private:
+		MtbUsb &mtbusb;
+		const CmdOrigin previousOrigin;
+		const QDeadlineTimer previousDeadline;
+	};
+
+	// Commands sent while PriorityScope exists are queued ahead of other queued commands
+	// (e.g. safe-state reset of outputs), order among priority commands is kept
+	class PriorityScope {
+	public:
+		PriorityScope(MtbUsb &mtbusb, bool priority = true) : mtbusb(mtbusb), previous(mtbusb.m_priority) {
+			mtbusb.m_priority = (previous || priority);
+		}
+		~PriorityScope() { mtbusb.m_priority = previous; }
+		PriorityScope(const PriorityScope&) = delete;
+		PriorityScope& operator=(const PriorityScope&) = delete;
+
+	private:
+		MtbUsb &mtbusb;
+		const bool previous;
+	};
+
+	// Drop queued (not yet written) expirable commands of 'origin', e.g. when client disconnects
+	void purgeOrigin(CmdOrigin);
+
+	// Estimated MTBbus time of transfer of 'bytes' bytes with current speed
+	uint32_t busTimeUs(size_t bytes) const;
+
 	std::optional<MtbUsbInfo> mtbUsbInfo() const { return m_mtbUsbInfo; }
 	std::optional<std::array<bool, _MAX_MODULES>> activeModules() const { return m_activeModules; }
+	const LinkStats& linkStats(uint8_t addr) const { return m_linkStats[addr]; }
 
 	void changeSpeed(MtbBusSpeed, std::function<void()> onOk, std::function<void(Mtb::CmdError)> onError);
 
@@ -132,6 +195,8 @@ signals:
 	void onModuleFail(uint8_t addr);
 	void onModuleInputsChange(uint8_t addr, const std::vector<uint8_t> &data);
 	void onModuleDiagStateChange(uint8_t addr, const std::vector<uint8_t> &data);
+	// MTBbus time consumed by command of 'origin' (not emitted for ORIGIN_DAEMON)
+	void onBusTime(Mtb::CmdOrigin origin, uint32_t us);
 
 private:
 	QSerialPort m_serialPort;
@@ -143,6 +208,10 @@ private:
 	QDateTime m_receiveTimeout;
 	std::optional<MtbUsbInfo> m_mtbUsbInfo;
 	std::optional<std::array<bool, _MAX_MODULES>> m_activeModules;
+	std::array<LinkStats, _MAX_MODULES> m_linkStats;
+	CmdOrigin m_origin = ORIGIN_DAEMON;
+	QDeadlineTimer m_deadline{QDeadlineTimer::Forever};
+	bool m_priority = false;
 
 	void log(const QString &message, LogLevel loglevel);
 
@@ -154,8 +223,13 @@ private:
 	void write(std::unique_ptr<const Cmd> cmd, size_t no_sent = 1);
 	void send(std::unique_ptr<const Cmd> &cmd, bool bypass_m_out_emptiness = false);
 
+	static bool expired(const Cmd &);
+	const Cmd* findShareable(const Cmd &) const;
+	void dropOut(const std::function<bool(const Cmd&)> &predicate, CmdError);
+
 	bool conflictWithPending(const Cmd &) const;
 	bool conflictWithOut(const Cmd &) const;
+	void enqueue(std::unique_ptr<const Cmd> &cmd);
 
 	void handleMtbUsbError(uint8_t code, uint8_t out_command_code, uint8_t addr);
 	void handleMtbBusError(uint8_t errorCode, uint8_t addr);
@@ -167,7 +241,11 @@ private:
 
 template <typename T>
 void MtbUsb::send(const T &&cmd) {
-	std::unique_ptr<const Cmd> cmd2(std::make_unique<const T>(cmd));
+	std::unique_ptr<T> typed(std::make_unique<T>(cmd));
+	typed->origin = m_origin;
+	typed->deadline = m_deadline;
+	typed->priority = m_priority;
+	std::unique_ptr<const Cmd> cmd2(std::move(typed));
 	send(cmd2);
 }
 
@@ -0,0 +1,68 @@
+#include <algorithm>
+#include <map>
+#include "outputpulses.h"
+#include "main.h"
+
+OutputPulses outputPulses;
+
+OutputPulses::OutputPulses() {
+	this->timer.setTimerType(Qt::PreciseTimer);
+	this->timer.setInterval(PULSE_WHEEL_TICK_MS);
+	QObject::connect(&this->timer, &QTimer::timeout, [this]() { this->tick(); });
+	this->clock.start();
+}
+
+void OutputPulses::add(uint8_t addr, size_t port, uint32_t generation, size_t durationMs) {
+	if (this->pending == 0) // wheel was idle -> skip ticks with nothing to do
+		this->ticks = this->clock.elapsed() / PULSE_WHEEL_TICK_MS;
+
+	const qint64 target = (this->clock.elapsed() + durationMs + PULSE_WHEEL_TICK_MS - 1) / PULSE_WHEEL_TICK_MS;
+	const size_t delta = std::max<qint64>(target - this->ticks, 1);
+	this->wheel[(this->ticks + delta) % PULSE_WHEEL_SLOTS].push_back(
+		{addr, static_cast<uint16_t>(port), generation, (delta-1) / PULSE_WHEEL_SLOTS}
+	);
+	this->pending++;
+	this->started++;
+
+	if (!this->timer.isActive())
+		this->timer.start();
+}
+
+void OutputPulses::tick() {
+	// Timer could be late -> process all ticks due
+	const qint64 due = this->clock.elapsed() / PULSE_WHEEL_TICK_MS;
+	std::map<uint8_t, std::vector<std::pair<size_t, uint32_t>>> expired; // module -> (port, generation)
+
+	while ((this->ticks < due) && (this->pending > 0)) {
+		this->ticks++;
+		std::vector<Entry> &slot = this->wheel[this->ticks % PULSE_WHEEL_SLOTS];
+		for (size_t i = 0; i < slot.size(); ) {
+			if (slot[i].rounds > 0) {
+				slot[i].rounds--;
+				i++;
+				continue;
+			}
+			expired[slot[i].addr].push_back({slot[i].port, slot[i].generation});
+			slot[i] = slot.back();
+			slot.pop_back();
+			this->pending--;
+			this->reverted++;
+		}
+	}
+
+	// All reverts of a module in single set-outputs request
+	for (const auto &[addr, ports] : expired)
+		if (modules[addr] != nullptr)
+			modules[addr]->pulsesExpired(ports);
+
+	if (this->pending == 0)
+		this->timer.stop();
+}
+
+QJsonObject OutputPulses::json() const {
+	return {
+		{"pending", static_cast<qint64>(this->pending)},
+		{"started", static_cast<qint64>(this->started)},
+		{"reverted", static_cast<qint64>(this->reverted)},
+	};
+}
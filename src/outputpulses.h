@@ -0,0 +1,50 @@
+#ifndef _OUTPUTPULSES_H_
+#define _OUTPUTPULSES_H_
+
+/* Timed output pulses ('duration_ms' in 'module_set_outputs').
+ * Output is reverted by the daemon after the pulse, so the pulse length does
+ * not depend on client's timers & network and output is not left active when
+ * the client dies. Pending reverts of all modules are held in a single timer
+ * wheel driven by single QTimer (running only when any pulse is pending).
+ * Each revert carries generation of the output; any later change of the
+ * output increments the generation, so stale reverts are just dropped.
+ */
+
+#include <QJsonObject>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <array>
+#include <vector>
+
+constexpr size_t PULSE_WHEEL_TICK_MS = 5;
+constexpr size_t PULSE_WHEEL_SLOTS = 512; // longer pulses wait for more rounds of the wheel
+constexpr size_t PULSE_MAX_DURATION_MS = 600000;
+
+class OutputPulses {
+public:
+	OutputPulses();
+	void add(uint8_t addr, size_t port, uint32_t generation, size_t durationMs);
+	QJsonObject json() const;
+
+private:
+	struct Entry {
+		uint8_t addr;
+		uint16_t port;
+		uint32_t generation;
+		size_t rounds; // remaining full rounds of the wheel
+	};
+
+	std::array<std::vector<Entry>, PULSE_WHEEL_SLOTS> wheel;
+	QTimer timer;
+	QElapsedTimer clock;
+	qint64 ticks = 0; // ticks processed since 'clock' start
+	size_t pending = 0;
+	size_t started = 0;
+	size_t reverted = 0;
+
+	void tick();
+};
+
+extern OutputPulses outputPulses;
+
+#endif
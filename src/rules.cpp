@@ -0,0 +1,187 @@
+#include <algorithm>
+#include "rules.h"
+#include "main.h"
+#include "logging.h"
+#include "qjsonsafe.h"
+
+RulesEngine rulesEngine;
+
+void RulesEngine::set(const QJsonArray &json) {
+	std::vector<Rule> compiled;
+	for (qsizetype i = 0; i < json.size(); i++) {
+		try {
+			compiled.push_back(compile(QJsonSafe::safeObject(json[i])));
+		} catch (const JsonParseError &e) {
+			throw JsonParseError("Rule "+QString::number(i)+": "+e.what());
+		}
+	}
+	this->replace(std::move(compiled));
+}
+
+void RulesEngine::load(const QJsonArray &json) {
+	// Config could refer to modules deleted or changed since the rules were set -> do not prevent startup
+	std::vector<Rule> compiled;
+	for (qsizetype i = 0; i < json.size(); i++) {
+		try {
+			compiled.push_back(compile(QJsonSafe::safeObject(json[i])));
+		} catch (const JsonParseError &e) {
+			log("Rule "+QString::number(i)+" skipped: "+e.what(), Mtb::LogLevel::Warning);
+		}
+	}
+	this->replace(std::move(compiled));
+}
+
+void RulesEngine::replace(std::vector<Rule> &&compiled) {
+	this->rules = std::move(compiled);
+	this->reindex();
+
+	log("Rules set: "+QString::number(this->rules.size()), Mtb::LogLevel::Info);
+
+	// Rules describe desired state -> apply to current inputs immediately
+	for (Rule &rule : this->rules) {
+		const std::optional<uint32_t> inputs = modules[rule.addr]->packedInputs();
+		if (inputs.has_value())
+			this->evaluate(rule, inputs.value(), true);
+	}
+}
+
+void RulesEngine::reindex() {
+	for (auto &indexes : this->bySource)
+		indexes.clear();
+	for (size_t i = 0; i < this->rules.size(); i++)
+		this->bySource[this->rules[i].addr].push_back(i);
+}
+
+RulesEngine::Rule RulesEngine::compile(const QJsonObject &json) {
+	Rule rule;
+	rule.definition = json;
+
+	const QJsonObject when = QJsonSafe::safeObject(json, "when");
+	const size_t addr = QJsonSafe::safeUInt(when, "address");
+	if ((!Mtb::isValidModuleAddress(addr)) || (modules[addr] == nullptr))
+		throw JsonParseError("Invalid module address: "+QString::number(addr));
+	rule.addr = addr;
+
+	const QJsonObject inputs = QJsonSafe::safeObject(when, "inputs");
+	for (auto it = inputs.begin(); it != inputs.end(); ++it) {
+		bool ok;
+		const unsigned int port = it.key().toUInt(&ok);
+		if ((!ok) || (port >= modules[addr]->inputsCnt()) || (port >= 32))
+			throw JsonParseError("Invalid input: "+it.key());
+		rule.mask |= (1U << port);
+		if (QJsonSafe::safeBool(it.value()))
+			rule.value |= (1U << port);
+	}
+	if (rule.mask == 0)
+		throw JsonParseError("Rule must watch at least one input!");
+
+	rule.then = compileActions(json, "then");
+	rule.otherwise = compileActions(json, "else");
+	if ((rule.then.empty()) && (rule.otherwise.empty()))
+		throw JsonParseError("Rule has no action!");
+	return rule;
+}
+
+std::vector<RulesEngine::Action> RulesEngine::compileActions(const QJsonObject &json, const QString &key) {
+	std::vector<Action> actions;
+	if (!json.contains(key))
+		return actions;
+
+	for (const auto &value : QJsonSafe::safeArray(json, key)) {
+		const QJsonObject jsonAction = QJsonSafe::safeObject(value);
+		const size_t addr = QJsonSafe::safeUInt(jsonAction, "address");
+		if ((!Mtb::isValidModuleAddress(addr)) || (modules[addr] == nullptr))
+			throw JsonParseError("Invalid module address: "+QString::number(addr));
+
+		Action action{static_cast<uint8_t>(addr), {}};
+		const QJsonObject outputs = QJsonSafe::safeObject(jsonAction, "outputs");
+		for (auto it = outputs.begin(); it != outputs.end(); ++it) {
+			bool ok;
+			const size_t port = it.key().toUInt(&ok);
+			if ((!ok) || (port >= modules[addr]->outputsCnt()))
+				throw JsonParseError("Invalid output: "+it.key());
+			action.ports[port] = modules[addr]->outputFromJson(QJsonSafe::safeObject(it.value()));
+		}
+		actions.push_back(action);
+	}
+	return actions;
+}
+
+void RulesEngine::inputsChanged(uint8_t addr, uint32_t old, uint32_t inputs) {
+	const uint32_t changed = old ^ inputs;
+	for (size_t i : this->bySource[addr]) {
+		Rule &rule = this->rules[i];
+		if (((rule.mask & changed) != 0) || (!rule.matched.has_value()))
+			this->evaluate(rule, inputs, false);
+	}
+}
+
+void RulesEngine::moduleActivated(uint8_t addr) {
+	// Source module: inputs are known now; target module: outputs were reset to safe state
+	for (Rule &rule : this->rules) {
+		if (!refersTo(rule, addr))
+			continue;
+
+		const std::optional<uint32_t> inputs = (modules[rule.addr] != nullptr) ?
+			modules[rule.addr]->packedInputs() : std::nullopt;
+		if (inputs.has_value())
+			this->evaluate(rule, inputs.value(), true);
+	}
+}
+
+bool RulesEngine::moduleDeleted(uint8_t addr) {
+	const size_t count = this->rules.size();
+	this->rules.erase(std::remove_if(this->rules.begin(), this->rules.end(),
+	                                 [addr](const Rule &rule) { return refersTo(rule, addr); }),
+	                  this->rules.end());
+	if (this->rules.size() == count)
+		return false;
+
+	this->reindex();
+	log("Module "+QString::number(addr)+" deleted, removed rules: "+QString::number(count-this->rules.size()),
+	    Mtb::LogLevel::Info);
+	return true;
+}
+
+bool RulesEngine::refersTo(const Rule &rule, uint8_t addr) {
+	if (rule.addr == addr)
+		return true;
+	for (const auto *actions : {&rule.then, &rule.otherwise})
+		for (const Action &action : *actions)
+			if (action.addr == addr)
+				return true;
+	return false;
+}
+
+void RulesEngine::evaluate(Rule &rule, uint32_t inputs, bool force) {
+	const bool matched = ((inputs & rule.mask) == rule.value);
+	if ((!force) && (rule.matched == matched))
+		return;
+	rule.matched = matched;
+
+	const std::vector<Action> &actions = matched ? rule.then : rule.otherwise;
+	if (!actions.empty())
+		rule.fired++;
+	for (const Action &action : actions)
+		if (modules[action.addr] != nullptr)
+			modules[action.addr]->setOutputsDaemon(action.ports);
+}
+
+QJsonArray RulesEngine::json() const {
+	QJsonArray result;
+	for (const Rule &rule : this->rules) {
+		QJsonObject json = rule.definition;
+		if (rule.matched.has_value())
+			json["matched"] = rule.matched.value();
+		json["fired"] = static_cast<qint64>(rule.fired);
+		result.append(json);
+	}
+	return result;
+}
+
+QJsonArray RulesEngine::configJson() const {
+	QJsonArray result;
+	for (const Rule &rule : this->rules)
+		result.append(rule.definition);
+	return result;
+}
@@ -0,0 +1,68 @@
+#ifndef _RULES_H_
+#define _RULES_H_
+
+/* Input-to-output rules evaluated by the daemon itself.
+ * Rule watches inputs of single module and sets outputs of any modules when
+ * the condition starts ('then') or stops ('else') to hold, so simple logic
+ * (e.g. button -> indication) does not need a round trip through a client.
+ * Condition is compiled into mask & value over packed inputs of the module;
+ * on input change only rules of the module whose mask intersects changed
+ * bits are evaluated. Outputs are set via standard set-outputs path of the
+ * module, such outputs are not owned by any client.
+ */
+
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QString>
+#include <array>
+#include <map>
+#include <optional>
+#include <vector>
+#include "mtbusb.h"
+
+class RulesEngine {
+public:
+	// Replaces all rules, throws JsonParseError (no rule is changed in such case)
+	void set(const QJsonArray&);
+	// Replaces all rules by rules from config file, invalid rules are skipped with a warning
+	void load(const QJsonArray&);
+	QJsonArray json() const; // as set + statistics
+	QJsonArray configJson() const;
+	size_t count() const { return this->rules.size(); }
+
+	void inputsChanged(uint8_t addr, uint32_t old, uint32_t inputs);
+	void moduleActivated(uint8_t addr);
+	// Removes rules referring to the module, returns true iff any rule was removed
+	bool moduleDeleted(uint8_t addr);
+
+private:
+	struct Action {
+		uint8_t addr;
+		std::map<size_t, uint8_t> ports;
+	};
+
+	struct Rule {
+		QJsonObject definition;
+		uint8_t addr;
+		uint32_t mask = 0;
+		uint32_t value = 0;
+		std::vector<Action> then;
+		std::vector<Action> otherwise;
+		std::optional<bool> matched;
+		size_t fired = 0;
+	};
+
+	std::vector<Rule> rules;
+	std::array<std::vector<size_t>, Mtb::_MAX_MODULES> bySource; // module address -> indexes to 'rules'
+
+	void replace(std::vector<Rule>&&);
+	void reindex();
+	static Rule compile(const QJsonObject&);
+	static std::vector<Action> compileActions(const QJsonObject&, const QString &key);
+	static bool refersTo(const Rule&, uint8_t addr);
+	void evaluate(Rule&, uint32_t inputs, bool force);
+};
+
+extern RulesEngine rulesEngine;
+
+#endif
@@ -0,0 +1,156 @@
+#include <memory>
+#include "scenes.h"
+#include "main.h"
+#include "errors.h"
+#include "logging.h"
+#include "qjsonsafe.h"
+
+SceneStore sceneStore;
+
+void SceneStore::set(const QString &name, const QJsonObject &outputs) {
+	if (name.isEmpty())
+		throw JsonParseError("Scene name must not be empty!");
+	this->scenes[name] = compile(outputs);
+}
+
+void SceneStore::load(const QJsonObject &json) {
+	// Config could refer to modules deleted or changed since the scenes were set -> do not prevent startup
+	std::map<QString, Scene> loaded;
+	for (auto it = json.begin(); it != json.end(); ++it) {
+		try {
+			loaded[it.key()] = compile(QJsonSafe::safeObject(QJsonSafe::safeObject(it.value()), "outputs"));
+		} catch (const JsonParseError &e) {
+			log("Scene "+it.key()+" skipped: "+e.what(), Mtb::LogLevel::Warning);
+		}
+	}
+	this->scenes = std::move(loaded);
+}
+
+bool SceneStore::moduleDeleted(uint8_t addr) {
+	bool changed = false;
+	for (auto it = this->scenes.begin(); it != this->scenes.end(); ) {
+		Scene &scene = it->second;
+		if (scene.outputs.erase(addr) == 0) {
+			++it;
+			continue;
+		}
+		changed = true;
+		for (const QString &key : scene.definition.keys())
+			if (key.toUInt() == addr)
+				scene.definition.remove(key);
+		if (scene.outputs.empty()) {
+			log("Scene "+it->first+" removed: all its modules deleted", Mtb::LogLevel::Info);
+			it = this->scenes.erase(it);
+		} else {
+			++it;
+		}
+	}
+	return changed;
+}
+
+SceneStore::Scene SceneStore::compile(const QJsonObject &outputs) {
+	Scene scene;
+	scene.definition = outputs;
+
+	for (auto it = outputs.begin(); it != outputs.end(); ++it) {
+		bool ok;
+		const size_t addr = it.key().toUInt(&ok);
+		if ((!ok) || (!Mtb::isValidModuleAddress(addr)) || (modules[addr] == nullptr))
+			throw JsonParseError("Invalid module address: "+it.key());
+
+		std::map<size_t, uint8_t> &ports = scene.outputs[addr];
+		const QJsonObject moduleOutputs = QJsonSafe::safeObject(it.value());
+		for (auto portIt = moduleOutputs.begin(); portIt != moduleOutputs.end(); ++portIt) {
+			const size_t port = portIt.key().toUInt(&ok);
+			if ((!ok) || (port >= modules[addr]->outputsCnt()))
+				throw JsonParseError("Module "+it.key()+": invalid output: "+portIt.key());
+			ports[port] = modules[addr]->outputFromJson(QJsonSafe::safeObject(portIt.value()));
+		}
+	}
+
+	if (scene.outputs.empty())
+		throw JsonParseError("Scene has no outputs!");
+	return scene;
+}
+
+void SceneStore::apply(QIODevice *socket, const QJsonObject &request) {
+	const QString name = QJsonSafe::safeString(request, "name");
+	auto it = this->scenes.find(name);
+	if (it == this->scenes.end())
+		return sendError(socket, request, MTB_SCENE_UNKNOWN, "Unknown scene: "+name);
+	Scene &scene = it->second;
+	scene.applied++;
+
+	struct Pending {
+		ServerRequest request;
+		QString command;
+		QString name;
+		size_t remaining;
+		size_t failed = 0;
+		QJsonObject modules;
+	};
+	// +1: response must not be sent until all modules are enqueued (modules could finish synchronously)
+	auto pending = std::make_shared<Pending>(Pending{
+		ServerRequest(socket, request), request["command"].toString(), name, scene.outputs.size()+1, 0, {}
+	});
+
+	auto finish = [pending]() {
+		QJsonObject response{
+			{"command", pending->command},
+			{"type", "response"},
+			{"status", (pending->failed > 0) ? "error" : "ok"},
+			{"name", pending->name},
+			{"modules", pending->modules},
+		};
+		if (pending->failed > 0)
+			response["error"] = jsonError(MTB_MODULE_FAILED,
+			                              "Outputs of "+QString::number(pending->failed)+" module(s) not set");
+		if (pending->request.id.has_value())
+			response["id"] = static_cast<int>(pending->request.id.value());
+		server.send(pending->request.socket, response);
+	};
+
+	auto done = [pending, finish](uint8_t addr, const QJsonObject &error) {
+		QJsonObject result;
+		if (error.isEmpty()) {
+			result["status"] = "ok";
+			if (modules[addr] != nullptr)
+				result["outputs"] = modules[addr]->outputsJson();
+		} else {
+			result["status"] = "error";
+			result["error"] = error;
+			pending->failed++;
+		}
+		pending->modules[QString::number(addr)] = result;
+		if (--pending->remaining == 0)
+			finish();
+	};
+
+	for (const auto &[addr, ports] : scene.outputs) {
+		if (modules[addr] == nullptr) {
+			done(addr, jsonError(MTB_MODULE_INVALID_ADDR, "Module not present!"));
+			continue;
+		}
+		const uint8_t moduleAddr = addr;
+		modules[addr]->setOutputsBatch(socket, ports, [done, moduleAddr](const QJsonObject &error) {
+			done(moduleAddr, error);
+		});
+	}
+
+	if (--pending->remaining == 0)
+		finish();
+}
+
+QJsonObject SceneStore::json() const {
+	QJsonObject result;
+	for (const auto &[name, scene] : this->scenes)
+		result[name] = QJsonObject{{"outputs", scene.definition}, {"applied", static_cast<qint64>(scene.applied)}};
+	return result;
+}
+
+QJsonObject SceneStore::configJson() const {
+	QJsonObject result;
+	for (const auto &[name, scene] : this->scenes)
+		result[name] = QJsonObject{{"outputs", scene.definition}};
+	return result;
+}
@@ -0,0 +1,46 @@
+#ifndef _SCENES_H_
+#define _SCENES_H_
+
+/* Named output scenes (routes, lighting scenes).
+ * Scene = outputs of any number of modules stored in the daemon. Applying
+ * the scene sets outputs of each affected module in single set-outputs
+ * MTBbus command (only outputs differing from the wanted state make the
+ * module send anything); commands of all modules are enqueued back-to-back
+ * and the client gets single response when all modules confirm. Applying is
+ * not atomic: modules which failed do not roll back the others.
+ */
+
+#include <QIODevice>
+#include <QJsonObject>
+#include <QString>
+#include <map>
+
+class SceneStore {
+public:
+	// Adds or replaces scene, throws JsonParseError
+	void set(const QString &name, const QJsonObject &outputs);
+	bool remove(const QString &name) { return (this->scenes.erase(name) > 0); }
+	// Replaces all scenes by scenes from config file, invalid scenes are skipped with a warning
+	void load(const QJsonObject&);
+	void apply(QIODevice*, const QJsonObject &request);
+	// Removes outputs of the module from all scenes, returns true iff any scene was changed
+	bool moduleDeleted(uint8_t addr);
+
+	QJsonObject json() const; // with statistics
+	QJsonObject configJson() const;
+
+private:
+	struct Scene {
+		QJsonObject definition;
+		std::map<uint8_t, std::map<size_t, uint8_t>> outputs; // module -> port -> value
+		size_t applied = 0;
+	};
+
+	std::map<QString, Scene> scenes;
+
+	static Scene compile(const QJsonObject &outputs);
+};
+
+extern SceneStore sceneStore;
+
+#endif
@@ -1,14 +1,26 @@
 #include <QTcpSocket>
+#include <QLocalSocket>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <cctype>
 #include "server.h"
 #include "mtbusb.h"
 #include "main.h"
 #include "logging.h"
+#include "errors.h"
+#include "session.h"
+
+#ifdef Q_OS_LINUX
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
 
 DaemonServer::DaemonServer(QObject *parent) : QObject(parent) {
 	QObject::connect(&m_server, SIGNAL(newConnection()), this, SLOT(serverNewConnection()));
+	QObject::connect(&m_localServer, SIGNAL(newConnection()), this, SLOT(localServerNewConnection()));
 	QObject::connect(&this->m_tKeepAlive, SIGNAL(timeout()), this, SLOT(tKeepAliveTick()));
+	QObject::connect(&this->m_tHeartbeat, SIGNAL(timeout()), this, SLOT(tHeartbeatTick()));
 }
 
 void DaemonServer::listen(const QHostAddress &addr, quint16 port, bool keepAlive) {
@@ -20,17 +32,65 @@ void DaemonServer::listen(const QHostAddress &addr, quint16 port, bool keepAlive
 		this->m_tKeepAlive.start(SERVER_KEEP_ALIVE_SEND_PERIOD_MS);
 }
 
+void DaemonServer::listenLocal(const QString &path, QLocalServer::SocketOptions options) {
+	QLocalServer::removeServer(path); // remove stale socket file after crash
+	this->m_localServer.setSocketOptions(options);
+	if (!this->m_localServer.listen(path))
+		throw std::logic_error(this->m_localServer.errorString().toStdString());
+}
+
 void DaemonServer::serverNewConnection() {
-	QTcpSocket *client = m_server.nextPendingConnection();
-	log("New client: "+client->peerAddress().toString(), Mtb::LogLevel::Info);
-	QObject::connect(client, SIGNAL(disconnected()), this, SLOT(clientDisconnected()));
-	QObject::connect(client, SIGNAL(readyRead()), this, SLOT(clientReadyRead()));
-	this->clients.insert_or_assign(client, true);
+	this->addClient(m_server.nextPendingConnection(), Client());
+}
+
+void DaemonServer::localServerNewConnection() {
+	QLocalSocket *socket = this->m_localServer.nextPendingConnection();
+	Client client;
+#ifdef Q_OS_LINUX
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(socket->socketDescriptor(), SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+		client.peerUid = cred.uid;
+#endif
+	this->addClient(socket, std::move(client));
+}
+
+void DaemonServer::addClient(QIODevice *socket, Client&& client) {
+	client.id = this->nextClientId++;
+	client.lastReceived.start();
+	if (this->codec.enabled())
+		client.worker = this->codec.assign();
+	// Bound Qt's internal buffer too: when it is full, socket is not read -> sender is throttled by the OS
+	const qint64 readBufferSize = static_cast<qint64>(this->maxMessageSize) + 1;
+	if (auto tcpSocket = dynamic_cast<QAbstractSocket*>(socket))
+		tcpSocket->setReadBufferSize(readBufferSize);
+	else if (auto localSocket = dynamic_cast<QLocalSocket*>(socket))
+		localSocket->setReadBufferSize(readBufferSize);
+	QObject::connect(socket, SIGNAL(disconnected()), this, SLOT(clientDisconnected()));
+	QObject::connect(socket, SIGNAL(readyRead()), this, SLOT(clientReadyRead()));
+	this->clients.insert_or_assign(socket, std::move(client));
+	log("New client: "+clientName(socket), Mtb::LogLevel::Info);
+	emit clientConnected(socket);
+}
+
+QString DaemonServer::clientName(const QIODevice *socket) {
+	if (auto tcpSocket = dynamic_cast<const QTcpSocket*>(socket))
+		return tcpSocket->peerAddress().toString();
+	if (dynamic_cast<const QLocalSocket*>(socket) != nullptr) {
+		const std::optional<uint32_t> uid = server.peerUid(socket);
+		return uid.has_value() ? "local (uid "+QString::number(uid.value())+")" : "local";
+	}
+	return "unknown";
+}
+
+std::optional<uint32_t> DaemonServer::peerUid(const QIODevice *socket) const {
+	auto it = this->clients.find(const_cast<QIODevice*>(socket));
+	return (it != this->clients.end()) ? it->second.peerUid : std::nullopt;
 }
 
 void DaemonServer::clientDisconnected() {
-	auto client = dynamic_cast<QTcpSocket*>(QObject::sender());
-	log("Client disconnected: "+client->peerAddress().toString(), Mtb::LogLevel::Info);
+	auto client = dynamic_cast<QIODevice*>(QObject::sender());
+	log("Client disconnected: "+clientName(client), Mtb::LogLevel::Info);
 	client->deleteLater();
 
 	if (this->clients.find(client) != this->clients.end())
@@ -40,46 +100,215 @@ void DaemonServer::clientDisconnected() {
 }
 
 void DaemonServer::clientReadyRead() {
-	auto client = dynamic_cast<QTcpSocket*>(QObject::sender());
-	while (client->canReadLine()) {
-		QByteArray data = client->readLine();
-		if (data.trimmed().size() > 0) {
-			QJsonParseError parseError;
-			QJsonDocument doc = QJsonDocument::fromJson(data.trimmed(), &parseError);
-			if (doc.isNull()) {
-				log("Invalid json received from client "+client->peerAddress().toString()+"!",
-				    Mtb::LogLevel::Warning);
-				return;
-			}
+	auto client = dynamic_cast<QIODevice*>(QObject::sender());
+	auto it = this->clients.find(client);
+	if (it == this->clients.end())
+		return;
+	Client &state = it->second;
+	QByteArray &buffer = state.buffer;
+	state.lastReceived.restart(); // any data is a heartbeat
 
-			QJsonObject json = doc.object();
-			try {
-				emit jsonReceived(client, json);
-			} catch (const std::logic_error& err) {
-				log("Client received data Exception: "+QString(err.what()), Mtb::LogLevel::Error);
-			} catch (...) {
-				log("Client received data Exception: unknown", Mtb::LogLevel::Error);
-			}
+	{ // Read directly into the buffer (no temporary QByteArray)
+		const qsizetype available = client->bytesAvailable();
+		if (available <= 0)
+			return;
+		const qsizetype oldSize = buffer.size();
+		buffer.resize(oldSize + available);
+		const qint64 read = client->read(buffer.data() + oldSize, available);
+		buffer.resize(oldSize + std::max<qint64>(read, 0));
+	}
+
+	qsizetype start = 0;
+	qsizetype newline;
+	while ((newline = buffer.indexOf('\n', state.scanned)) != -1) {
+		const qsizetype size = newline - start;
+		state.scanned = newline+1;
+
+		if (state.discarding) {
+			state.discarding = false; // end of too long message
+		} else if (static_cast<size_t>(size) > this->maxMessageSize) {
+			this->processTooLong(client);
+		} else {
+			this->processMessage(client, buffer.constData()+start, size);
+			if (this->clients.find(client) == this->clients.end())
+				return; // client removed during processing -> 'state' is not valid anymore
+		}
+		start = state.scanned;
+	}
+
+	// Move unprocessed remainder to the beginning of the buffer (capacity is kept)
+	if (start > 0) {
+		buffer.remove(0, start);
+		state.scanned -= start;
+	}
+	state.scanned = buffer.size();
+
+	// Fail fast: do not wait for end of the message which is already too long
+	if ((!state.discarding) && (static_cast<size_t>(buffer.size()) > this->maxMessageSize)) {
+		state.discarding = true;
+		this->processTooLong(client);
+	}
+	if (state.discarding) {
+		buffer.resize(0);
+		state.scanned = 0;
+	}
+}
+
+void DaemonServer::processMessage(QIODevice *client, const char *data, qsizetype size) {
+	if (!this->codec.enabled()) {
+		// fromRawData: JSON is parsed directly from the client's buffer
+		return this->received(client, parse(data, size));
+	}
+
+	// Copy is necessary: client's buffer is reused for next data
+	QByteArray message(data, size);
+	this->deliver(client, [message]() { return parse(message.constData(), message.size()); });
+}
+
+void DaemonServer::processTooLong(QIODevice *client) {
+	// Delivered via worker too (if enabled) to keep order with responses to previous requests
+	ParseResult result;
+	result.status = ParseResult::Status::TooLong;
+	result.error = "Message too long (max "+QString::number(this->maxMessageSize)+" bytes)!";
+	this->deliver(client, [result]() { return result; });
+}
+
+void DaemonServer::deliver(QIODevice *client, std::function<ParseResult()> parse) {
+	auto it = this->clients.find(client);
+	if ((!this->codec.enabled()) || (it == this->clients.end()))
+		return this->received(client, parse());
+
+	this->codec.post(
+		it->second.worker,
+		parse,
+		[this, client, id = it->second.id](const ParseResult &result) {
+			if (this->isConnected(client, id))
+				this->received(client, result);
 		}
+	);
+}
+
+DaemonServer::ParseResult DaemonServer::parse(const char *data, qsizetype size) {
+	// Called from worker threads -> must not touch any shared state
+	ParseResult result;
+
+	// Ignore whitespace-only lines
+	qsizetype first = 0;
+	while ((first < size) && (std::isspace(static_cast<unsigned char>(data[first]))))
+		first++;
+	if (first == size)
+		return result;
+
+	QJsonParseError parseError;
+	QJsonDocument doc = QJsonDocument::fromJson(QByteArray::fromRawData(data+first, size-first), &parseError);
+	if ((doc.isNull()) || (!doc.isObject())) {
+		result.status = ParseResult::Status::InvalidJson;
+		result.error = "Invalid JSON: "+parseError.errorString()+" offset: "+QString::number(parseError.offset);
+		return result;
+	}
+
+	result.status = ParseResult::Status::Ok;
+	result.json = doc.object();
+	return result;
+}
+
+void DaemonServer::received(QIODevice *client, const ParseResult &result) {
+	switch (result.status) {
+	case ParseResult::Status::Empty:
+		return;
+	case ParseResult::Status::InvalidJson:
+		log("Invalid json received from client "+clientName(client)+"!", Mtb::LogLevel::Warning);
+		return this->sendFrameError(client, MTB_INVALID_JSON, result.error);
+	case ParseResult::Status::TooLong:
+		log("Too long message received from client "+clientName(client)+"!", Mtb::LogLevel::Warning);
+		return this->sendFrameError(client, MTB_MESSAGE_TOO_LONG, result.error);
+	case ParseResult::Status::Ok:
+		break;
 	}
+
+	try {
+		emit jsonReceived(client, result.json);
+	} catch (const std::logic_error& err) {
+		log("Client received data Exception: "+QString(err.what()), Mtb::LogLevel::Error);
+	} catch (...) {
+		log("Client received data Exception: unknown", Mtb::LogLevel::Error);
+	}
+}
+
+bool DaemonServer::isConnected(const QIODevice *client, uint64_t id) const {
+	auto it = this->clients.find(const_cast<QIODevice*>(client));
+	return (it != this->clients.end()) && (it->second.id == id);
 }
 
-void DaemonServer::send(QTcpSocket &socket, const QJsonObject &jsonObj) {
+void DaemonServer::sendFrameError(QIODevice *client, size_t code, const QString& message) {
+	// Request could not be parsed -> no 'id' is known
+	this->send(client, {
+		{"command", "invalid_message"},
+		{"type", "response"},
+		{"status", "error"},
+		{"error", DaemonServer::error(code, message)},
+	});
+}
+
+QByteArray DaemonServer::serialize(const QJsonObject &jsonObj) {
 	QByteArray data = QJsonDocument(jsonObj).toJson(QJsonDocument::Compact);
 	data.push_back('\n');
-	socket.write(data);
+	return data;
+}
+
+void DaemonServer::send(QIODevice &socket, const QJsonObject &jsonObj) {
+	auto it = this->clients.find(&socket);
+	if ((!this->codec.enabled()) || (it == this->clients.end())) {
+		socket.write(serialize(jsonObj));
+		return;
+	}
+
+	this->codec.post(
+		it->second.worker,
+		[jsonObj]() { return serialize(jsonObj); },
+		[this, socket = &socket, id = it->second.id](const QByteArray &data) {
+			if (this->isConnected(socket, id))
+				socket->write(data);
+		}
+	);
 }
 
-void DaemonServer::send(QTcpSocket *socket, const QJsonObject &jsonObj) {
+void DaemonServer::send(QIODevice *socket, const QJsonObject &jsonObj) {
 	// Prevent disconnected clients who started an ongoing operation (e.g. module reboot) to crash the server
 	if ((socket != nullptr) && (this->clients.find(socket) != this->clients.end()))
 		this->send(*socket, jsonObj);
 }
 
+void DaemonServer::send(const ClientSession &session, const QJsonObject &jsonObj) {
+	// Session exists iff client is connected -> no lookup needed
+	this->send(*session.socket, jsonObj);
+}
+
 void DaemonServer::broadcast(const QJsonObject &json) {
-	for (const auto &pair : this->clients) {
-		QTcpSocket *const socket = pair.first;
-		this->send(*socket, json);
+	if (!this->codec.enabled()) {
+		const QByteArray data = serialize(json);
+		for (const auto &pair : this->clients)
+			pair.first->write(data);
+		return;
+	}
+
+	// Serialize once per worker, write in client's worker order
+	std::vector<std::vector<std::pair<QIODevice*, uint64_t>>> targets(this->codec.size());
+	for (const auto &pair : this->clients)
+		targets[pair.second.worker].emplace_back(pair.first, pair.second.id);
+
+	for (size_t worker = 0; worker < targets.size(); worker++) {
+		if (targets[worker].empty())
+			continue;
+		this->codec.post(
+			worker,
+			[json]() { return serialize(json); },
+			[this, sockets = std::move(targets[worker])](const QByteArray &data) {
+				for (const auto &[socket, id] : sockets)
+					if (this->isConnected(socket, id))
+						socket->write(data);
+			}
+		);
 	}
 }
 
@@ -92,6 +321,65 @@ void DaemonServer::tKeepAliveTick() {
 		this->send(pair.first, {});
 }
 
+/* Heartbeat ---------------------------------------------------------------- */
+
+void DaemonServer::setHeartbeat(QIODevice *socket, size_t timeoutMs) {
+	auto it = this->clients.find(socket);
+	if (it == this->clients.end())
+		return;
+	it->second.heartbeatMs = timeoutMs;
+	it->second.lastReceived.restart();
+	setTcpTimeouts(socket, timeoutMs);
+
+	if ((timeoutMs > 0) && (!this->m_tHeartbeat.isActive()))
+		this->m_tHeartbeat.start(SERVER_HEARTBEAT_CHECK_PERIOD_MS);
+}
+
+void DaemonServer::tHeartbeatTick() {
+	std::vector<QIODevice*> dead;
+	bool any = false;
+	for (const auto &[socket, client] : this->clients) {
+		if (client.heartbeatMs == 0)
+			continue;
+		any = true;
+		if (client.lastReceived.elapsed() > static_cast<qint64>(client.heartbeatMs))
+			dead.push_back(socket);
+	}
+	if (!any)
+		this->m_tHeartbeat.stop();
+
+	// Abort emits 'disconnected' -> client is removed & its outputs are reset as with standard disconnect
+	for (QIODevice *socket : dead) {
+		log("Client "+clientName(socket)+" missed heartbeat ("+
+		    QString::number(this->clients[socket].heartbeatMs)+" ms), closing connection", Mtb::LogLevel::Warning);
+		if (auto tcpSocket = dynamic_cast<QTcpSocket*>(socket))
+			tcpSocket->abort();
+		else if (auto localSocket = dynamic_cast<QLocalSocket*>(socket))
+			localSocket->abort();
+	}
+}
+
+void DaemonServer::setTcpTimeouts(QIODevice *socket, size_t timeoutMs) {
+	// Kernel detects dead peer too: keep-alive probes when idle, limit of unacknowledged data when sending
+	auto tcpSocket = dynamic_cast<QTcpSocket*>(socket);
+	if (tcpSocket == nullptr)
+		return;
+	tcpSocket->setSocketOption(QAbstractSocket::KeepAliveOption, (timeoutMs > 0) ? 1 : 0);
+#ifdef Q_OS_LINUX
+	const int fd = tcpSocket->socketDescriptor();
+	if (timeoutMs > 0) {
+		const int idle = std::max<int>(1, timeoutMs/2000); // s
+		const int interval = 1; // s
+		const int count = 3;
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+	}
+	const unsigned int userTimeout = timeoutMs; // 0 = system default
+	setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof(userTimeout));
+#endif
+}
+
 QJsonObject jsonError(size_t code, const QString &msg) {
 	return QJsonObject{
 		{"code", static_cast<int>(code)},
@@ -103,7 +391,7 @@ QJsonObject jsonError(Mtb::CmdError error) {
 	return jsonError(static_cast<int>(error)+0x1000, Mtb::cmdErrorToStr(error));
 }
 
-void sendError(QTcpSocket *socket, const QJsonObject &request, const QJsonObject &error) {
+void sendError(QIODevice *socket, const QJsonObject &request, const QJsonObject &error) {
 	QJsonObject response {
 		{"command", request["command"]},
 		{"type", "response"},
@@ -115,18 +403,19 @@ void sendError(QTcpSocket *socket, const QJsonObject &request, const QJsonObject
 	if (request.contains("address"))
 		response["address"] = request["address"];
 	server.send(*socket, response);
+	emit server.errorSent(socket, response);
 }
 
-void sendError(QTcpSocket *socket, const QJsonObject &request, size_t code,
+void sendError(QIODevice *socket, const QJsonObject &request, size_t code,
                const QString& message) {
 	sendError(socket, request, jsonError(code, message));
 }
 
-void sendError(QTcpSocket *socket, const QJsonObject &request, Mtb::CmdError cmdError) {
+void sendError(QIODevice *socket, const QJsonObject &request, Mtb::CmdError cmdError) {
 	sendError(socket, request, jsonError(cmdError));
 }
 
-void sendAccessDenied(QTcpSocket *socket, const QJsonObject &request) {
+void sendAccessDenied(QIODevice *socket, const QJsonObject &request) {
 	sendError(socket, request, jsonError(403, "Forbidden"));
 }
 
@@ -3,19 +3,30 @@
 
 #include <QObject>
 #include <QTcpServer>
+#include <QLocalServer>
 #include <QJsonObject>
 #include <QTimer>
+#include <QElapsedTimer>
 #include "mtbusb.h"
+#include "codec.h"
 
 constexpr size_t SERVER_DEFAULT_PORT = 3841;
 constexpr size_t SERVER_KEEP_ALIVE_SEND_PERIOD_MS = 5000;
+constexpr size_t SERVER_DEFAULT_MAX_MESSAGE_SIZE = 4*1024*1024; // 4 MiB
+constexpr size_t SERVER_MIN_MAX_MESSAGE_SIZE = 1024;
+constexpr size_t SERVER_MAX_MAX_MESSAGE_SIZE = 256*1024*1024; // 256 MiB
+constexpr size_t SERVER_HEARTBEAT_MIN_TIMEOUT_MS = 200;
+constexpr size_t SERVER_HEARTBEAT_MAX_TIMEOUT_MS = 600000;
+constexpr size_t SERVER_HEARTBEAT_CHECK_PERIOD_MS = 50;
+
+struct ClientSession;
 
 struct ServerRequest {
-	QTcpSocket *socket;
+	QIODevice *socket;
 	std::optional<size_t> id;
 
-	ServerRequest(QTcpSocket *socket, std::optional<size_t> id = std::nullopt) : socket(socket), id(id) {}
-	ServerRequest(QTcpSocket *socket, const QJsonObject& request) : socket(socket) {
+	ServerRequest(QIODevice *socket, std::optional<size_t> id = std::nullopt) : socket(socket), id(id) {}
+	ServerRequest(QIODevice *socket, const QJsonObject& request) : socket(socket) {
 		if (request.contains("id"))
 			this->id = request["id"].toInt();
 	}
@@ -27,35 +38,84 @@ class DaemonServer : public QObject {
 public:
 	DaemonServer(QObject *parent = nullptr);
 	void listen(const QHostAddress&, quint16 port, bool keepAlive=true);
-	void send(QTcpSocket&, const QJsonObject&);
-	void send(QTcpSocket*, const QJsonObject&);
+	void listenLocal(const QString& path, QLocalServer::SocketOptions);
+	void send(QIODevice&, const QJsonObject&);
+	void send(QIODevice*, const QJsonObject&);
+	void send(const ClientSession&, const QJsonObject&);
 	void broadcast(const QJsonObject&);
+	void setMaxMessageSize(size_t size) { this->maxMessageSize = size; }
+	void startWorkers(size_t count) { this->codec.start(count, this); }
 
 	static QJsonObject error(size_t code, const QString& message);
+	static QString clientName(const QIODevice*);
+	// Credentials of local (unix domain socket) client; empty for TCP clients or if not supported by OS
+	std::optional<uint32_t> peerUid(const QIODevice*) const;
+	// Client must send anything at least once per 'timeoutMs', otherwise it is disconnected; 0 = disabled
+	void setHeartbeat(QIODevice*, size_t timeoutMs);
 
 private slots:
 	void serverNewConnection();
+	void localServerNewConnection();
 	void clientDisconnected();
 	void clientReadyRead();
 	void tKeepAliveTick();
+	void tHeartbeatTick();
 
 private:
+	// Incremental line framer: received data are appended to per-client buffer
+	// (capacity is reused), each byte is scanned for newline only once.
+	struct Client {
+		QByteArray buffer;
+		qsizetype scanned = 0; // buffer[0:scanned] contains no newline
+		bool discarding = false; // remainder of too long message is being thrown away
+		std::optional<uint32_t> peerUid;
+		uint64_t id = 0; // unique, pointer could be reused by next client after disconnect
+		size_t worker = 0;
+		size_t heartbeatMs = 0; // 0 = no heartbeat
+		QElapsedTimer lastReceived;
+	};
+
+	struct ParseResult {
+		enum class Status { Ok, Empty, InvalidJson, TooLong };
+		Status status = Status::Empty;
+		QJsonObject json;
+		QString error;
+	};
+
 	QTcpServer m_server;
+	QLocalServer m_localServer;
 	QTimer m_tKeepAlive;
-	std::map<QTcpSocket*, bool> clients;
+	QTimer m_tHeartbeat;
+	std::map<QIODevice*, Client> clients;
+	size_t maxMessageSize = SERVER_DEFAULT_MAX_MESSAGE_SIZE;
+	JsonCodecPool codec;
+	uint64_t nextClientId = 0;
+
+	void processMessage(QIODevice*, const char *data, qsizetype size);
+	void processTooLong(QIODevice*);
+	void deliver(QIODevice*, std::function<ParseResult()> parse);
+	void received(QIODevice*, const ParseResult&);
+	void sendFrameError(QIODevice*, size_t code, const QString& message);
+	bool isConnected(const QIODevice*, uint64_t id) const;
+	static ParseResult parse(const char *data, qsizetype size);
+	static QByteArray serialize(const QJsonObject&);
+	void addClient(QIODevice*, Client&&);
+	static void setTcpTimeouts(QIODevice*, size_t timeoutMs);
 
 signals:
-	void jsonReceived(QTcpSocket*, const QJsonObject&);
-	void clientDisconnected(QTcpSocket*);
+	void jsonReceived(QIODevice*, const QJsonObject&);
+	void clientConnected(QIODevice*);
+	void clientDisconnected(QIODevice*);
+	void errorSent(QIODevice*, const QJsonObject &response);
 
 };
 
 QJsonObject jsonError(size_t code, const QString &msg);
 QJsonObject jsonError(Mtb::CmdError);
 QJsonObject jsonOkResponse(const QJsonObject &request);
-void sendError(QTcpSocket*, const QJsonObject&, size_t code, const QString&);
-void sendError(QTcpSocket*, const QJsonObject&, Mtb::CmdError);
-void sendError(QTcpSocket*, const QJsonObject &request, const QJsonObject &error);
-void sendAccessDenied(QTcpSocket*, const QJsonObject&);
+void sendError(QIODevice*, const QJsonObject&, size_t code, const QString&);
+void sendError(QIODevice*, const QJsonObject&, Mtb::CmdError);
+void sendError(QIODevice*, const QJsonObject &request, const QJsonObject &error);
+void sendAccessDenied(QIODevice*, const QJsonObject&);
 
 #endif
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include "session.h"
+#include "server.h"
+
+Sessions sessions;
+
+QJsonObject ClientSession::statsJson() const {
+	return {
+		{"client", DaemonServer::clientName(this->socket)},
+		{"requests", static_cast<qint64>(this->stats.requests)},
+		{"handling_us", static_cast<qint64>(this->stats.handlingUs)},
+		{"events", static_cast<qint64>(this->stats.events)},
+		{"subscriptions", static_cast<int>(this->subscriptions.count())},
+		{"write_access", this->writeAccess},
+		{"bus_time_us", static_cast<qint64>(this->busQuota.usedUs)},
+		{"bus_quota_rejected", static_cast<qint64>(this->busQuota.rejected)},
+	};
+}
+
+void BusQuota::configure(double share, uint64_t burstUs) {
+	const bool wasLimited = this->limited();
+	this->share = share;
+	this->burstUs = burstUs;
+	this->tokens = wasLimited ? std::min(this->tokens, this->burstUs) : this->burstUs; // new client: full bucket
+	this->refilled = std::chrono::steady_clock::now();
+}
+
+void BusQuota::refill() {
+	const auto now = std::chrono::steady_clock::now();
+	const double elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(now - this->refilled).count();
+	this->refilled = now;
+	this->tokens = std::min(this->tokens + elapsedUs*this->share, this->burstUs);
+}
+
+bool BusQuota::admit() {
+	if (!this->limited())
+		return true;
+	this->refill();
+	if (this->tokens > 0)
+		return true;
+	this->rejected++;
+	return false;
+}
+
+void BusQuota::consume(uint32_t us) {
+	this->usedUs += us;
+	if (!this->limited())
+		return;
+	this->refill();
+	this->tokens -= us;
+}
+
+uint64_t BusQuota::retryAfterMs() const {
+	if ((!this->limited()) || (this->tokens > 0))
+		return 0;
+	return static_cast<uint64_t>(-this->tokens / this->share / 1000) + 1;
+}
+
+ClientSession& Sessions::open(QIODevice *socket, bool writeAccess) {
+	auto &session = this->sessions[socket];
+	session = std::make_unique<ClientSession>(socket, ++this->nextId, writeAccess);
+	this->byId[session->id] = session.get();
+	return *session;
+}
+
+void Sessions::close(QIODevice *socket) {
+	auto it = this->sessions.find(socket);
+	if (it == this->sessions.end())
+		return;
+	ClientSession &session = *it->second;
+	this->unsubscribeAll(session);
+	this->topoUnsubscribe(session);
+	if (!session.ownedOutputs.empty())
+		remove(this->m_outputSetters, &session);
+	this->byId.erase(session.id);
+	this->sessions.erase(it);
+}
+
+ClientSession* Sessions::find(const QIODevice *socket) const {
+	auto it = this->sessions.find(socket);
+	return (it != this->sessions.end()) ? it->second.get() : nullptr;
+}
+
+ClientSession* Sessions::findById(uint64_t id) const {
+	auto it = this->byId.find(id);
+	return (it != this->byId.end()) ? it->second : nullptr;
+}
+
+ClientSession& Sessions::at(const QIODevice *socket) const {
+	return *this->sessions.at(socket);
+}
+
+void Sessions::subscribe(ClientSession &session, uint8_t addr) {
+	if (session.subscriptions[addr])
+		return;
+	session.subscriptions[addr] = true;
+	this->m_subscribers[addr].push_back(&session);
+}
+
+void Sessions::unsubscribe(ClientSession &session, uint8_t addr) {
+	if (!session.subscriptions[addr])
+		return;
+	session.subscriptions[addr] = false;
+	remove(this->m_subscribers[addr], &session);
+}
+
+void Sessions::unsubscribeAll(ClientSession &session) {
+	for (size_t addr = 0; (addr < Mtb::_MAX_MODULES) && (session.subscriptions.any()); addr++)
+		this->unsubscribe(session, addr);
+}
+
+void Sessions::topoSubscribe(ClientSession &session) {
+	if (session.topoSubscribed)
+		return;
+	session.topoSubscribed = true;
+	this->m_topoSubscribers.push_back(&session);
+}
+
+void Sessions::topoUnsubscribe(ClientSession &session) {
+	if (!session.topoSubscribed)
+		return;
+	session.topoSubscribed = false;
+	remove(this->m_topoSubscribers, &session);
+}
+
+void Sessions::outputOwnerChanged(const QIODevice *oldOwner, const QIODevice *newOwner, uint8_t addr,
+                                  size_t port) {
+	if (port >= SESSION_MAX_OWNED_PORTS)
+		return;
+	if (ClientSession *session = this->find(oldOwner))
+		this->setOwned(*session, addr, port, false);
+	if (ClientSession *session = this->find(newOwner))
+		this->setOwned(*session, addr, port, true);
+}
+
+void Sessions::setOwned(ClientSession &session, uint8_t addr, size_t port, bool owned) {
+	const bool wasSetter = !session.ownedOutputs.empty();
+
+	if (owned) {
+		session.ownedOutputs[addr] |= (1U << port);
+	} else {
+		auto it = session.ownedOutputs.find(addr);
+		if (it != session.ownedOutputs.end()) {
+			it->second &= ~(1U << port);
+			if (it->second == 0)
+				session.ownedOutputs.erase(it);
+		}
+	}
+
+	const bool isSetter = !session.ownedOutputs.empty();
+	if ((!wasSetter) && (isSetter))
+		this->m_outputSetters.push_back(&session);
+	else if ((wasSetter) && (!isSetter))
+		remove(this->m_outputSetters, &session);
+}
+
+void Sessions::remove(std::vector<ClientSession*> &vector, const ClientSession *session) {
+	// Order of subscribers is not important -> swap with last, O(1) after find
+	auto it = std::find(vector.begin(), vector.end(), session);
+	if (it != vector.end()) {
+		*it = vector.back();
+		vector.pop_back();
+	}
+}
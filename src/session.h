@@ -0,0 +1,108 @@
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+/* Per-client state of the server.
+ * Session is created when client connects and destroyed when it disconnects.
+ * Subscriptions are held in both directions: bitset in the session
+ * (client → modules) and compact vector of sessions for each module address
+ * (module → clients), so event fan-out and disconnect are O(subscribers).
+ */
+
+#include <QIODevice>
+#include <QJsonObject>
+#include <array>
+#include <bitset>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <vector>
+#include "mtbusb.h"
+
+constexpr size_t SESSION_MAX_OWNED_PORTS = 32;
+constexpr int BUS_QUOTA_DEFAULT_BURST_MS = 1000;
+constexpr int BUS_QUOTA_MAX_BURST_MS = 600000;
+
+// Token bucket limiting client's share of MTBbus time, tokens = bus time [us]
+class BusQuota {
+public:
+	uint64_t usedUs = 0; // total MTBbus time consumed by the client
+	size_t rejected = 0; // requests refused because of exceeded quota
+
+	// share = allowed fraction of bus time (0 = unlimited), burstUs = bucket size
+	void configure(double share, uint64_t burstUs);
+	bool limited() const { return (this->share > 0); }
+	bool admit(); // false = quota exceeded, refuse request
+	void consume(uint32_t us); // may go into debt, next requests are refused until it's paid
+	uint64_t retryAfterMs() const;
+
+private:
+	double share = 0;
+	double burstUs = 0;
+	double tokens = 0;
+	std::chrono::steady_clock::time_point refilled = std::chrono::steady_clock::now();
+
+	void refill();
+};
+
+struct ClientSession {
+	QIODevice *const socket;
+	const uint64_t id; // unique during daemon run, used as origin of MTBbus commands
+	std::bitset<Mtb::_MAX_MODULES> subscriptions;
+	bool topoSubscribed = false;
+	bool writeAccess = false; // cached, updated on config load
+	bool coalescing = false; // events are sent via coalescer
+	bool diagEvents = false; // 'module_diag_changed' events of subscribed modules are sent
+	bool inputsDelta = false; // 'module_inputs_changed' of MTB-RC contains only added & removed addresses
+	// Reverse index of 'whoSetOutput' of modules: module address -> bitmask of ports set by the client
+	std::map<uint8_t, uint32_t> ownedOutputs;
+
+	struct Stats {
+		size_t requests = 0;
+		uint64_t handlingUs = 0;
+		size_t events = 0;
+	};
+	Stats stats;
+	BusQuota busQuota;
+
+	ClientSession(QIODevice *socket, uint64_t id, bool writeAccess) : socket(socket), id(id), writeAccess(writeAccess) {}
+	QJsonObject statsJson() const;
+};
+
+class Sessions {
+public:
+	ClientSession& open(QIODevice*, bool writeAccess);
+	void close(QIODevice*);
+	ClientSession* find(const QIODevice*) const;
+	ClientSession& at(const QIODevice*) const;
+	ClientSession* findById(uint64_t id) const;
+
+	void subscribe(ClientSession&, uint8_t addr);
+	void unsubscribe(ClientSession&, uint8_t addr);
+	void unsubscribeAll(ClientSession&);
+	void topoSubscribe(ClientSession&);
+	void topoUnsubscribe(ClientSession&);
+
+	const std::vector<ClientSession*>& subscribers(uint8_t addr) const { return this->m_subscribers[addr]; }
+	const std::vector<ClientSession*>& topoSubscribers() const { return this->m_topoSubscribers; }
+	const std::map<const QIODevice*, std::unique_ptr<ClientSession>>& all() const { return this->sessions; }
+
+	// Must be called whenever owner of module's output changes (see MtbModule::setOutputOwner)
+	void outputOwnerChanged(const QIODevice *oldOwner, const QIODevice *newOwner, uint8_t addr, size_t port);
+	// Clients owning at least one output
+	const std::vector<ClientSession*>& outputSetters() const { return this->m_outputSetters; }
+
+private:
+	std::map<const QIODevice*, std::unique_ptr<ClientSession>> sessions;
+	std::map<uint64_t, ClientSession*> byId;
+	uint64_t nextId = 0;
+	std::array<std::vector<ClientSession*>, Mtb::_MAX_MODULES> m_subscribers;
+	std::vector<ClientSession*> m_topoSubscribers;
+	std::vector<ClientSession*> m_outputSetters;
+
+	void setOwned(ClientSession&, uint8_t addr, size_t port, bool owned);
+	static void remove(std::vector<ClientSession*>&, const ClientSession*);
+};
+
+extern Sessions sessions;
+
+#endif
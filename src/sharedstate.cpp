@@ -0,0 +1,77 @@
+#include <QCoreApplication>
+#include <stdexcept>
+#include "sharedstate.h"
+#include "module.h"
+
+SharedState sharedState;
+
+SharedState::~SharedState() {
+	this->close();
+}
+
+void SharedState::open(const QString &path) {
+	this->close();
+
+	// Existing file is reused (not recreated), so readers with the file mapped keep working
+	auto qfile = std::make_unique<QFile>(path);
+	if (!qfile->open(QIODevice::ReadWrite))
+		throw std::logic_error("Unable to open shared state file "+path.toStdString()+": "+
+		                       qfile->errorString().toStdString());
+	if (!qfile->resize(sizeof(MtbShm::File)))
+		throw std::logic_error("Unable to resize shared state file "+path.toStdString());
+	qfile->setPermissions(QFile::ReadOwner | QFile::WriteOwner | QFile::ReadGroup | QFile::ReadOther);
+
+	uchar *mapped = qfile->map(0, sizeof(MtbShm::File));
+	if (mapped == nullptr)
+		throw std::logic_error("Unable to map shared state file "+path.toStdString());
+
+	this->qfile = std::move(qfile);
+	this->file = reinterpret_cast<MtbShm::File*>(mapped);
+
+	MtbShm::Header &header = this->file->header;
+	header.magic = 0; // invalidate for readers during initialization
+	std::atomic_thread_fence(std::memory_order_release);
+	for (size_t addr = 0; addr < MtbShm::MODULES_CNT; addr++) {
+		// Previous daemon could die during slot update -> make 'seq' even again
+		std::atomic<uint32_t> &seq = this->file->modules[addr].seq;
+		seq.store((seq.load(std::memory_order_relaxed) + 1) & ~1U, std::memory_order_relaxed);
+		this->clear(addr);
+	}
+	header.layoutVersion = MtbShm::LAYOUT_VERSION;
+	header.slotSize = sizeof(MtbShm::ModuleSlot);
+	header.modulesCnt = MtbShm::MODULES_CNT;
+	header.daemonPid = static_cast<uint32_t>(QCoreApplication::applicationPid());
+	std::atomic_thread_fence(std::memory_order_release);
+	header.magic = MtbShm::MAGIC;
+}
+
+void SharedState::close() {
+	if (this->file != nullptr) {
+		this->file->header.magic = 0; // daemon not running -> content not valid anymore
+		this->qfile->unmap(reinterpret_cast<uchar*>(this->file));
+	}
+	this->file = nullptr;
+	this->qfile.reset();
+}
+
+void SharedState::update(uint8_t addr, const MtbModule &module) {
+	if (this->file == nullptr)
+		return;
+	MtbShm::ModuleState state;
+	std::memset(&state, 0, sizeof(state));
+	module.exportState(state);
+	this->write(addr, state);
+}
+
+void SharedState::clear(uint8_t addr) {
+	if (this->file == nullptr)
+		return;
+	MtbShm::ModuleState state;
+	std::memset(&state, 0, sizeof(state));
+	this->write(addr, state);
+}
+
+void SharedState::write(uint8_t addr, const MtbShm::ModuleState &state) {
+	MtbShm::write(this->file->modules[addr], state);
+	this->file->header.changes.fetch_add(1, std::memory_order_release);
+}
@@ -0,0 +1,34 @@
+#ifndef _SHAREDSTATE_H_
+#define _SHAREDSTATE_H_
+
+/* Export of modules state to memory-mapped file (see shm/mtb-shm.h).
+ * Local read-only clients (visualisation, loggers) read the state directly
+ * from the memory instead of subscribing to JSON events.
+ */
+
+#include <QFile>
+#include <memory>
+#include "mtb-shm.h"
+
+class MtbModule;
+
+class SharedState {
+public:
+	~SharedState();
+	void open(const QString &path); // throws std::logic_error
+	void close();
+	bool isOpen() const { return (this->file != nullptr); }
+
+	void update(uint8_t addr, const MtbModule&);
+	void clear(uint8_t addr); // module deleted
+
+private:
+	std::unique_ptr<QFile> qfile;
+	MtbShm::File *file = nullptr;
+
+	void write(uint8_t addr, const MtbShm::ModuleState&);
+};
+
+extern SharedState sharedState;
+
+#endif
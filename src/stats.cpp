@@ -0,0 +1,29 @@
+#include <QJsonArray>
+#include "stats.h"
+
+void CommandStats::add(uint64_t us) {
+	this->count++;
+	this->totalUs += us;
+	if (us > this->maxUs)
+		this->maxUs = us;
+
+	size_t bucket = 0;
+	for (uint64_t value = us; (value > 1) && (bucket < STATS_HISTOGRAM_BUCKETS-1); value >>= 1)
+		bucket++;
+	this->histogram[bucket]++;
+}
+
+QJsonObject CommandStats::json() const {
+	QJsonArray jsonHistogram;
+	for (size_t value : this->histogram)
+		jsonHistogram.push_back(static_cast<qint64>(value));
+
+	return {
+		{"count", static_cast<qint64>(this->count)},
+		{"errors", static_cast<qint64>(this->errors)},
+		{"total_us", static_cast<qint64>(this->totalUs)},
+		{"avg_us", (this->count > 0) ? static_cast<qint64>(this->totalUs / this->count) : 0},
+		{"max_us", static_cast<qint64>(this->maxUs)},
+		{"histogram_us", jsonHistogram},
+	};
+}
@@ -0,0 +1,28 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+/* Per-command statistics of request handling.
+ * Handling time is the time spent synchronously in the command handler
+ * (parsing, validation, queueing of MTBbus commands, sending the response).
+ * Time spent waiting for MTBbus is not included.
+ */
+
+#include <QJsonObject>
+#include <array>
+#include <cstdint>
+
+constexpr size_t STATS_HISTOGRAM_BUCKETS = 16; // bucket i: [2^i, 2^(i+1)) us, last bucket unbounded
+
+struct CommandStats {
+	size_t count = 0;
+	size_t errors = 0; // error responses (rejected requests, exceptions, errors reported by handlers)
+	uint64_t totalUs = 0;
+	uint64_t maxUs = 0;
+	std::array<size_t, STATS_HISTOGRAM_BUCKETS> histogram = {0, };
+
+	void add(uint64_t us);
+	void reset() { *this = CommandStats(); }
+	QJsonObject json() const;
+};
+
+#endif
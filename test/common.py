@@ -22,6 +22,7 @@ assert INACTIVE_MODULE_ADDR in MODULES_JSON.keys()
 
 class MtbDaemonError:
     INVALID_JSON = 1000
+    MESSAGE_TOO_LONG = 1001
     MODULE_INVALID_ADDR = 1100
     MODULE_INVALID_PORT = 1101
     MODULE_FAILED = 1102
@@ -31,6 +32,7 @@ class MtbDaemonError:
     FILE_CANNOT_ACCESS = 1010
     MODULE_ALREADY_WRITING = 1110
     UNKNOWN_COMMAND = 1020
+    BUS_QUOTA_EXCEEDED = 1030
 
     DEVICE_DISCONNECTED = 2004
     ALREADY_STARTED = 2012
@@ -40,6 +42,8 @@ class MtbDaemonError:
     MODULE_CONFIG_SETTING = 3112
     MODULE_REBOOTING = 3113
     MODULE_FWUPGD_ERROR = 3114
+    FIRMWARE_UNKNOWN = 3115
+    SCENE_UNKNOWN = 3116
 
     MODULE_UNKNOWN_COMMAND = 0x1001
     MODULE_UNSUPPORTED_COMMAND = 0x1002
@@ -47,6 +51,8 @@ class MtbDaemonError:
     SERIAL_PORT_CLOSED = 0x1010
     USB_NO_RESPONSE = 0x1011
     BUS_NO_RESPONSE = 0x1012
+    CMD_EXPIRED = 0x1014
+    CMD_CANCELLED = 0x1015
 
 
 def check_version_format(version: str) -> None:
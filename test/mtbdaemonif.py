@@ -13,6 +13,7 @@ import time
 
 HOST = '127.0.0.1'
 PORT = 3841
+LOCAL_PATH = '/tmp/mtb-daemon-test.sock'
 
 
 class EMtbDaemon(Exception):
@@ -24,17 +25,23 @@ class EMtbDaemonTimeout(EMtbDaemon):
 
 
 class MtbDaemonIFace:
-    def __init__(self, host: str = HOST, port: int = PORT):
+    def __init__(self, host: str = HOST, port: int = PORT, local_path: str | None = None):
         self.host = host
         self.port = port
+        self.local_path = local_path
         self.buf_received = ''
         self.id: int = 0
         self.connect()
 
     def connect(self) -> None:
-        logging.info(f'Connecting to {self.host}:{self.port} ...')
-        self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-        self.sock.connect((self.host, self.port))
+        if self.local_path is not None:
+            logging.info(f'Connecting to {self.local_path} ...')
+            self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self.sock.connect(self.local_path)
+        else:
+            logging.info(f'Connecting to {self.host}:{self.port} ...')
+            self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            self.sock.connect((self.host, self.port))
         logging.info('Connected')
 
     def disconnect(self) -> None:
@@ -2,8 +2,10 @@
 Test common behavior of MTB Daemon TCP server using PyTest.
 """
 
+from typing import Dict, Any
+
 import common
-from mtbdaemonif import mtb_daemon
+from mtbdaemonif import mtb_daemon, MtbDaemonIFace, LOCAL_PATH
 
 
 def test_endpoint_present() -> None:
@@ -27,6 +29,13 @@ def test_version_response() -> None:
     assert isinstance(version['sw_version_minor'], int)
 
 
+def test_local_socket_version() -> None:
+    with MtbDaemonIFace(local_path=LOCAL_PATH) as local:
+        response = local.request_response({'command': 'version'})
+        assert 'version' in response
+        common.check_version_format(response['version']['sw_version'])
+
+
 def test_unknown_command() -> None:
     response = mtb_daemon.request_response(
         {'command': 'nonexisting_command'},
@@ -41,3 +50,60 @@ def test_unknown_command_module_prefix() -> None:
         ok=False
     )
     common.check_error(response, common.MtbDaemonError.UNKNOWN_COMMAND)
+
+
+def test_stats() -> None:
+    mtb_daemon.request_response({'command': 'version'})
+    response = mtb_daemon.request_response({'command': 'stats'})
+    assert 'stats' in response
+    stats = response['stats']
+    assert 'version' in stats['commands']
+    version = stats['commands']['version']
+    assert version['count'] >= 1
+    assert len(version['histogram_us']) == stats['histogram_buckets']
+    assert sum(version['histogram_us']) == version['count']
+    assert version['max_us'] >= version['avg_us']
+
+
+def command_stats(command: str) -> Dict[str, Any]:
+    response = mtb_daemon.request_response({'command': 'stats'})
+    return response['stats']['commands'].get(command, {'count': 0, 'errors': 0})
+
+
+def test_stats_rejected_request() -> None:
+    before = command_stats('module_reboot')
+    response = mtb_daemon.request_response(
+        {'command': 'module_reboot', 'address': 0},
+        ok=False
+    )
+    common.check_error(response, common.MtbDaemonError.MODULE_INVALID_ADDR)
+    after = command_stats('module_reboot')
+    assert after['count'] == before['count'] + 1
+    assert after['errors'] == before['errors'] + 1
+
+
+def test_stats_error_reported_by_module() -> None:
+    before = command_stats('module_diag')
+    response = mtb_daemon.request_response(
+        {'command': 'module_diag', 'address': common.INACTIVE_MODULE_ADDR, 'DVnum': 1},
+        ok=False
+    )
+    common.check_error(response, common.MtbDaemonError.BUS_NO_RESPONSE)
+    after = command_stats('module_diag')
+    assert after['count'] == before['count'] + 1
+    assert after['errors'] == before['errors'] + 1
+
+
+def test_invalid_json_does_not_block_next_message() -> None:
+    mtb_daemon.sock.send(b'{"command": "version", \n{"command": "version", "type": "request", "id": 1000}\n')
+    response = mtb_daemon.expect_response('invalid_message', ok=False)
+    common.check_error(response, common.MtbDaemonError.INVALID_JSON)
+    response = mtb_daemon.expect_response('version')
+    assert response['id'] == 1000
+
+
+def test_message_too_long() -> None:
+    mtb_daemon.sock.sendall(b'{"command": "version", "data": "' + b'x'*(5*1024*1024) + b'"}\n')
+    response = mtb_daemon.expect_response('invalid_message', ok=False, timeout=5)
+    common.check_error(response, common.MtbDaemonError.MESSAGE_TOO_LONG)
+    mtb_daemon.request_response({'command': 'version'})
@@ -3,9 +3,10 @@ Test diagnostics of MTB Daemon TCP server using PyTest.
 """
 
 from typing import Dict, Any
+import time
 
 import common
-from mtbdaemonif import mtb_daemon
+from mtbdaemonif import mtb_daemon, MtbDaemonIFace, LOCAL_PATH
 
 
 def check_dv_1(response: Dict[str, Any], address: int) -> None:
@@ -78,3 +79,145 @@ def test_dvkey_from_other_module() -> None:
         ok=False
     )
     common.check_error(response, common.MtbDaemonError.INVALID_DV)
+
+
+def test_dv_max_age() -> None:
+    mtb_daemon.request_response({
+        'command': 'module_diag',
+        'address': common.TEST_MODULE_ADDR,
+        'DVnum': 1,
+    })
+    response = mtb_daemon.request_response({
+        'command': 'module_diag',
+        'address': common.TEST_MODULE_ADDR,
+        'DVnum': 1,
+        'max_age_ms': 60000,
+    })
+    check_dv_1(response, common.TEST_MODULE_ADDR)
+    assert 0 <= response['age_ms'] <= 60000
+
+
+DV_KEYS = [
+    'version', 'state', 'uptime', 'errors', 'warnings', 'mcu_voltage',
+    'mcu_temperature', 'mtbbus_received', 'mtbbus_bad_crc', 'mtbbus_sent',
+    'mtbbus_not_sent',
+]
+
+
+def test_dv_deadline_expired() -> None:
+    # Different DVs are not shared, so the burst overfills MTB-USB's pending
+    # slots and the queued requests expire before being sent.
+    for i, dvkey in enumerate(DV_KEYS):
+        mtb_daemon.send_request({
+            'command': 'module_diag',
+            'address': common.TEST_MODULE_ADDR,
+            'DVkey': dvkey,
+            'deadline_ms': 0,
+            'id': i,
+        })
+
+    expired = 0
+    for _ in DV_KEYS:
+        response = mtb_daemon.expect_response('module_diag', timeout=2, ok=False)
+        assert response['id'] in range(len(DV_KEYS))
+        if response['status'] == 'error':
+            common.check_error(response, common.MtbDaemonError.CMD_EXPIRED)
+            expired += 1
+    assert expired > 0
+
+    # Later requests without deadline are sent normally
+    response = mtb_daemon.request_response({
+        'command': 'module_diag',
+        'address': common.TEST_MODULE_ADDR,
+        'DVnum': 1,
+    })
+    check_dv_1(response, common.TEST_MODULE_ADDR)
+
+
+def test_dv_cancelled_on_disconnect() -> None:
+    # Queued requests of a disconnected client are dropped (CMD_CANCELLED is
+    # not observable by the gone client), other clients are served normally.
+    with MtbDaemonIFace() as client:
+        for i, dvkey in enumerate(DV_KEYS):
+            client.send_request({
+                'command': 'module_diag',
+                'address': common.TEST_MODULE_ADDR,
+                'DVkey': dvkey,
+                'id': i,
+            })
+
+    response = mtb_daemon.request_response({
+        'command': 'module_diag',
+        'address': common.TEST_MODULE_ADDR,
+        'DVnum': 1,
+    }, timeout=2)
+    check_dv_1(response, common.TEST_MODULE_ADDR)
+
+
+def client_stats(client: MtbDaemonIFace, name_prefix: str) -> Dict[str, Any]:
+    # Previously closed client could still be listed until the daemon handles its disconnection
+    for _ in range(10):
+        response = client.request_response({'command': 'stats'})
+        clients = [c for c in response['stats']['clients'] if c['client'].startswith(name_prefix)]
+        if len(clients) == 1:
+            return clients[0]
+        time.sleep(0.1)
+    assert False, f'Client {name_prefix} not unique in stats'
+
+
+def test_bus_quota_exceeded() -> None:
+    # Local clients are read-only in the test config -> tight 'readOnly' quota applies
+    with MtbDaemonIFace(local_path=LOCAL_PATH) as local:
+        stats = client_stats(local, 'local')
+        assert not stats['write_access']
+        # Daemon-internal traffic (module polling) is not accounted to clients
+        assert stats['bus_time_us'] == 0
+        assert stats['bus_quota_rejected'] == 0
+
+        rejected = None
+        for _ in range(50):
+            response = local.request_response({
+                'command': 'module_diag',
+                'address': common.TEST_MODULE_ADDR,
+                'DVnum': 1,
+            }, ok=False)
+            if response['status'] == 'error':
+                rejected = response
+                break
+            check_dv_1(response, common.TEST_MODULE_ADDR)
+        assert rejected is not None, 'Bus quota not applied'
+        common.check_error(rejected, common.MtbDaemonError.BUS_QUOTA_EXCEEDED)
+        assert 'retry after' in rejected['error']['message']
+
+        stats = client_stats(local, 'local')
+        assert stats['bus_time_us'] >= 1000  # whole 1 ms burst consumed
+        assert stats['bus_quota_rejected'] == 1
+
+    # Other classes are not affected
+    response = mtb_daemon.request_response({
+        'command': 'module_diag',
+        'address': common.TEST_MODULE_ADDR,
+        'DVnum': 1,
+    })
+    check_dv_1(response, common.TEST_MODULE_ADDR)
+
+
+def test_dv_identical_requests_shared() -> None:
+    request = {'command': 'module_diag', 'address': common.TEST_MODULE_ADDR, 'DVnum': 1}
+
+    with MtbDaemonIFace(local_path=LOCAL_PATH) as single:
+        check_dv_1(single.request_response(dict(request)), common.TEST_MODULE_ADDR)
+        single_us = client_stats(single, 'local')['bus_time_us']
+    assert single_us > 0
+
+    # Second request is answered by the MTBbus command of the first one
+    with MtbDaemonIFace(local_path=LOCAL_PATH) as double:
+        double.send_request({**request, 'id': 1})
+        double.send_request({**request, 'id': 2})
+        responses = [double.expect_response('module_diag') for _ in range(2)]
+        assert sorted(response['id'] for response in responses) == [1, 2]
+        for response in responses:
+            check_dv_1(response, common.TEST_MODULE_ADDR)
+        assert responses[0]['DVvalueRaw'] == responses[1]['DVvalueRaw']
+        double_us = client_stats(double, 'local')['bus_time_us']
+    assert double_us < 2*single_us
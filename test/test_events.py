@@ -233,3 +233,88 @@ def test_module_changed_event_on_name_edit() -> None:
 
 # TODO: add some test for 'mtbusb' changed?
 # How? It requires e.g. disconnecting of power from a test MTB-UNI module
+
+
+def test_coalesced_events() -> None:
+    mtb_daemon.request_response({
+        'command': 'module_subscribe',
+        'addresses': [common.TEST_MODULE_ADDR],
+        'coalesce_ms': 200,
+        'edges': True,
+    })
+
+    try:
+        common.set_single_output(common.TEST_MODULE_ADDR, 0, 1)
+        common.set_single_output(common.TEST_MODULE_ADDR, 0, 0)
+
+        event = mtb_daemon.expect_event('module_states_changed')
+        msc_event = event['module_states_changed']
+        assert str(common.TEST_MODULE_ADDR) in msc_event['modules']
+        module = msc_event['modules'][str(common.TEST_MODULE_ADDR)]
+        assert module['address'] == common.TEST_MODULE_ADDR
+        assert 'inputs' in module
+        assert module['input_edges']['0'] >= 1
+        assert module['input_events'] >= 1
+    finally:
+        mtb_daemon.request_response({
+            'command': 'module_subscribe',
+            'addresses': [common.TEST_MODULE_ADDR],
+            'coalesce_ms': 0,
+        })
+        mtb_daemon.request_response({
+            'command': 'module_unsubscribe',
+            'addresses': [common.TEST_MODULE_ADDR],
+        })
+    time.sleep(0.3)
+    mtb_daemon.expect_no_message()
+
+
+def test_coalesce_invalid_window() -> None:
+    response = mtb_daemon.request_response(
+        {'command': 'module_subscribe', 'addresses': [common.TEST_MODULE_ADDR], 'coalesce_ms': 2},
+        ok=False
+    )
+    common.check_error(response, common.MtbDaemonError.INVALID_JSON)
+
+
+def test_resume_from() -> None:
+    with MtbDaemonIFace() as first:
+        response = first.request_response(
+            {'command': 'module_subscribe', 'addresses': [common.TEST_MODULE_ADDR]}
+        )
+        epoch = response['epoch']
+        common.set_single_output(common.TEST_MODULE_ADDR, 0, 1)
+        event = first.expect_event('module_inputs_changed')
+        seq = event['seq']
+
+    common.set_single_output(common.TEST_MODULE_ADDR, 0, 0)  # missed by the first client
+    time.sleep(0.2)  # wait for input change
+
+    with MtbDaemonIFace() as second:
+        response = second.request_response({
+            'command': 'module_subscribe',
+            'addresses': [common.TEST_MODULE_ADDR],
+            'resume_from': seq,
+            'epoch': epoch,
+        })
+        assert response['resume']['status'] == 'ok'
+        assert response['resume']['events'] >= 1
+        event = second.expect_event('module_inputs_changed')
+        assert event['seq'] > seq
+
+        response = second.request_response({
+            'command': 'module_subscribe',
+            'addresses': [common.TEST_MODULE_ADDR],
+            'resume_from': response['resume']['seq'] + 1000000,
+            'epoch': epoch,
+        })
+        assert response['resume']['status'] == 'gap'
+
+        # 'seq' from another run of the daemon
+        response = second.request_response({
+            'command': 'module_subscribe',
+            'addresses': [common.TEST_MODULE_ADDR],
+            'resume_from': 0,
+            'epoch': epoch-1,
+        })
+        assert response['resume']['status'] == 'gap'
@@ -3,6 +3,8 @@ Test general module endpoints of MTB Daemon TCP server using PyTest.
 """
 
 from typing import Dict, Any
+import base64
+import hashlib
 import time
 
 import common
@@ -186,6 +188,89 @@ def test_reboot_invalid_addr() -> None:
     common.check_invalid_addresses({'command': 'module_reboot'}, 'address')
 
 
+###############################################################################
+# Firmware upgrade
+
+def test_upgrade_fw_invalid_firmware() -> None:
+    # Firmware is parsed before any communication with the module
+    for request in [
+        {'firmware_format': 'ihex', 'firmware_data': ':0400000001020304F1\n'},  # bad checksum
+        {'firmware_format': 'ihex', 'firmware_data': ':00000001FF\n'},  # empty
+        {'firmware_format': 'elf', 'firmware_data': ''},
+        {'firmware_format': 'binary', 'firmware_data': 'DJQ0AQyU!0AQ=='},  # invalid character
+        {'firmware_format': 'binary', 'firmware_data': 'DJQ0AQyU-0AQ'},  # base64url character
+        {'firmware': {'0': '0C94XY01'}},
+    ]:
+        response = mtb_daemon.request_response(
+            {'command': 'module_upgrade_fw', 'address': common.TEST_MODULE_ADDR, **request},
+            ok=False
+        )
+        common.check_error(response, common.MtbDaemonError.INVALID_JSON)
+
+    response = mtb_daemon.request_response({
+        'command': 'module', 'address': common.TEST_MODULE_ADDR
+    })
+    assert response['module']['state'] == 'active'
+
+
+def test_upgrade_fw_unknown_hash() -> None:
+    response = mtb_daemon.request_response(
+        {'command': 'module_upgrade_fw', 'address': common.TEST_MODULE_ADDR, 'firmware_hash': '00'*32},
+        ok=False
+    )
+    common.check_error(response, common.MtbDaemonError.FIRMWARE_UNKNOWN)
+
+
+def test_firmware_upload() -> None:
+    ihex = ':0400000001020304F2\n:00000001FF\n'
+    binary = base64.b64encode(bytes([1, 2, 3, 4])).decode('ascii')
+
+    first = mtb_daemon.request_response({
+        'command': 'firmware_upload', 'firmware_format': 'ihex', 'firmware_data': ihex
+    })
+    expected = hashlib.sha256(bytes([1, 2, 3, 4] + [0xFF]*60 + [1])).hexdigest()
+    assert first['firmware_hash'] == expected
+    assert first['size'] == 64
+
+    second = mtb_daemon.request_response({
+        'command': 'firmware_upload', 'firmware_format': 'binary', 'firmware_data': binary
+    })
+    assert second['firmware_hash'] == expected
+    assert second['already_stored']
+
+    # Explicit 0xFF block is written to the module -> different image than omitted block
+    explicit = mtb_daemon.request_response({
+        'command': 'firmware_upload', 'firmware_format': 'binary',
+        'firmware_data': base64.b64encode(bytes([0xFF]*64 + [1, 2, 3, 4])).decode('ascii'),
+    })
+    omitted = mtb_daemon.request_response({
+        'command': 'firmware_upload', 'firmware_format': 'binary', 'firmware_address': 64,
+        'firmware_data': binary,
+    })
+    assert explicit['firmware_hash'] != omitted['firmware_hash']
+
+
+def test_modules_upgrade_fw_refused() -> None:
+    response = mtb_daemon.request_response(
+        {'command': 'modules_upgrade_fw', 'addresses': [common.TEST_MODULE_ADDR], 'firmware_hash': '00'*32},
+        ok=False
+    )
+    common.check_error(response, common.MtbDaemonError.FIRMWARE_UNKNOWN)
+
+    # Any invalid module -> nothing is upgraded
+    response = mtb_daemon.request_response(
+        {'command': 'modules_upgrade_fw', 'addresses': [common.TEST_MODULE_ADDR, 0],
+         'firmware_format': 'ihex', 'firmware_data': ':0400000001020304F2\n:00000001FF\n'},
+        ok=False
+    )
+    common.check_error(response, common.MtbDaemonError.MODULE_INVALID_ADDR)
+
+    response = mtb_daemon.request_response({
+        'command': 'module', 'address': common.TEST_MODULE_ADDR
+    })
+    assert response['module']['state'] == 'active'
+
+
 ###############################################################################
 # Beacon
 
@@ -279,3 +364,30 @@ def test_disconnect_while_operation_pending() -> None:
         {'command': 'module', 'address': common.TEST_MODULE_ADDR}
     )
     assert response['module']['state'] == 'active'
+
+
+def test_modules_since_version() -> None:
+    response = mtb_daemon.request_response({'command': 'modules'})
+    assert response['full']
+    version, epoch = response['version'], response['epoch']
+
+    response = mtb_daemon.request_response(
+        {'command': 'modules', 'since_version': version, 'epoch': epoch}
+    )
+    assert not response['full']
+    assert response['modules'] == {}
+    assert response['deleted'] == []
+
+    common.set_single_output(common.TEST_MODULE_ADDR, 0, 1)
+    common.set_single_output(common.TEST_MODULE_ADDR, 0, 0)
+    response = mtb_daemon.request_response(
+        {'command': 'modules', 'since_version': version, 'epoch': epoch}
+    )
+    assert str(common.TEST_MODULE_ADDR) in response['modules']
+    assert response['version'] > version
+
+    # Version from another run of the daemon
+    response = mtb_daemon.request_response(
+        {'command': 'modules', 'since_version': 0, 'epoch': epoch-1}
+    )
+    assert response['full']
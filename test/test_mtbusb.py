@@ -77,3 +77,42 @@ def test_invalid_speed() -> None:
 
 # TODO: save_config ?
 # TODO: load_config ?
+
+
+def validate_bus_health(health: Dict[str, Any], addr: int) -> None:
+    assert health['address'] == addr
+    assert health['level'] in ['unknown', 'ok', 'degraded', 'bad']
+    assert 0 <= health['score'] <= 100
+
+    rates = health['rates']
+    assert set(rates.keys()) == {'retry', 'fail', 'bad_crc', 'not_sent', 'inquiry_misses'}
+    for key in ['retry', 'fail', 'inquiry_misses']:
+        assert isinstance(rates[key], (int, float))
+    for key in ['bad_crc', 'not_sent']:  # null until module's counters are sampled
+        assert rates[key] is None or isinstance(rates[key], (int, float))
+
+    counters = health['counters']
+    assert set(counters.keys()) == \
+        {'responses', 'attempts', 'no_response', 'timeouts', 'inquiry_misses', 'failures'}
+    assert len(counters['attempts']) == 4
+    assert sum(counters['attempts']) == counters['responses']
+
+
+def test_bus_health() -> None:
+    response = mtb_daemon.request_response(
+        {'command': 'bus_health', 'address': common.TEST_MODULE_ADDR}
+    )
+    assert set(response['modules'].keys()) == {str(common.TEST_MODULE_ADDR)}
+    validate_bus_health(response['modules'][str(common.TEST_MODULE_ADDR)], common.TEST_MODULE_ADDR)
+
+    response = mtb_daemon.request_response({'command': 'bus_health'})
+    for addrstr, health in response['modules'].items():
+        validate_bus_health(health, int(addrstr))
+
+
+def test_bus_health_invalid_addr() -> None:
+    response = mtb_daemon.request_response(
+        {'command': 'bus_health', 'address': 0},
+        ok=False
+    )
+    common.check_error(response, common.MtbDaemonError.MODULE_INVALID_ADDR)
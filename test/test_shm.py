@@ -0,0 +1,66 @@
+"""
+Test shared-memory export of modules state (see shm/mtb-shm.h) using PyTest.
+"""
+
+from typing import Dict, Any
+import mmap
+import struct
+import time
+
+import common
+
+SHM_PATH = common.CONFIG_JSON['sharedState']['path']
+MAGIC = 0x5342544D
+LAYOUT_VERSION = 1
+MODULES_OFFSET = 64  # Header is aligned to 64 bytes
+HEADER_FORMAT = '<IIIIII'  # magic, layoutVersion, slotSize, modulesCnt, daemonPid, reserved
+STATE_OFFSET = 8  # seq, reserved
+STATE_FORMAT = '<BBBBI32s'  # active, type, inputsCnt, outputsCnt, inputs, outputs
+
+
+def read_header(shm: mmap.mmap) -> Dict[str, int]:
+    magic, layout, slot_size, modules_cnt, pid, _ = struct.unpack_from(HEADER_FORMAT, shm, 0)
+    return {'magic': magic, 'layout': layout, 'slot_size': slot_size,
+            'modules_cnt': modules_cnt, 'pid': pid}
+
+
+def read_slot(shm: mmap.mmap, addr: int) -> Dict[str, Any]:
+    offset = MODULES_OFFSET + addr*read_header(shm)['slot_size']
+    for _ in range(1000):  # seqlock: retry when the slot is being updated
+        seq, = struct.unpack_from('<I', shm, offset)
+        active, type_code, _, _, inputs, outputs = \
+            struct.unpack_from(STATE_FORMAT, shm, offset+STATE_OFFSET)
+        if (seq % 2 == 0) and (struct.unpack_from('<I', shm, offset)[0] == seq):
+            return {'active': active, 'type': type_code, 'inputs': inputs, 'outputs': outputs}
+    assert False, 'Shared-memory slot stays locked'
+
+
+def test_shm_state() -> None:
+    with open(SHM_PATH, 'rb') as file:
+        with mmap.mmap(file.fileno(), 0, access=mmap.ACCESS_READ) as shm:
+            header = read_header(shm)
+            assert header['magic'] == MAGIC
+            assert header['layout'] == LAYOUT_VERSION
+            assert header['modules_cnt'] == 256
+            assert header['pid'] > 0
+
+            slot = read_slot(shm, common.TEST_MODULE_ADDR)
+            assert slot['active'] == 1
+            assert slot['type'] == common.MODULES_JSON[common.TEST_MODULE_ADDR]['type']
+            assert slot['inputs'] == 0
+
+            # Output 0 is connected to input 0
+            common.set_single_output(common.TEST_MODULE_ADDR, 0, 1)
+            time.sleep(0.1)
+            slot = read_slot(shm, common.TEST_MODULE_ADDR)
+            assert slot['outputs'][0] == 1
+            assert slot['inputs'] == 1
+
+            common.set_single_output(common.TEST_MODULE_ADDR, 0, 0)
+            time.sleep(0.1)
+            slot = read_slot(shm, common.TEST_MODULE_ADDR)
+            assert slot['outputs'][0] == 0
+            assert slot['inputs'] == 0
+
+            slot = read_slot(shm, common.INACTIVE_MODULE_ADDR)
+            assert slot['active'] == 0
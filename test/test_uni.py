@@ -5,7 +5,7 @@ Test MTB-UNI module in MTB Daemon TCP server using PyTest.
 from typing import Dict, Any
 
 import common
-from mtbdaemonif import mtb_daemon
+from mtbdaemonif import mtb_daemon, MtbDaemonIFace
 import time
 
 
@@ -196,9 +196,56 @@ def test_set_output_of_inactive_module() -> None:
 ###############################################################################
 
 
+def outputs_reset_stats() -> Dict[str, Any]:
+    response = mtb_daemon.request_response({'command': 'stats'})
+    stats = response['stats']['outputs_reset']
+    assert set(stats.keys()) == {'batches', 'modules', 'failed', 'last_ms', 'max_ms'}
+    return stats
+
+
 def test_reset_my_outputs() -> None:
     set_uni_outputs_and_validate(common.TEST_MODULE_ADDR, {'1': {'type': 'plain', 'value': 1}})
-    mtb_daemon.request_response({'command': 'reset_my_outputs'})
+    before = outputs_reset_stats()
+    response = mtb_daemon.request_response({'command': 'reset_my_outputs'})
+    assert response['status'] == 'ok'
+    # Response is sent after the modules confirmed the reset
+    check_uni_state(common.TEST_MODULE_ADDR, 0)
+
+    after = outputs_reset_stats()
+    assert after['batches'] == before['batches'] + 1
+    assert after['modules'] > before['modules']
+    assert after['failed'] == before['failed']
+    assert 0 <= after['last_ms'] <= after['max_ms']
+
+
+def test_reset_my_outputs_other_client_keeps_outputs() -> None:
+    # More clients set outputs -> only outputs of the requesting client are reset (per-module batch)
+    with MtbDaemonIFace() as other:
+        other.request_response({
+            'command': 'module_set_outputs',
+            'address': common.TEST_MODULE_ADDR,
+            'outputs': {'2': {'type': 'plain', 'value': 1}},
+        })
+        common.set_single_output(common.TEST_MODULE_ADDR, 1, 1)
+        check_uni_state(common.TEST_MODULE_ADDR, 0b110)
+
+        before = outputs_reset_stats()
+        # Reset is merged with set-outputs still waiting to be sent to the module
+        mtb_daemon.send_request({
+            'command': 'module_set_outputs',
+            'address': common.TEST_MODULE_ADDR,
+            'outputs': {'3': {'type': 'plain', 'value': 1}},
+            'id': 1,
+        })
+        mtb_daemon.send_request({'command': 'reset_my_outputs', 'id': 2})
+        response = mtb_daemon.expect_response('reset_my_outputs')  # set-outputs response is skipped
+        assert response['id'] == 2
+
+        check_uni_state(common.TEST_MODULE_ADDR, 0b100)
+        after = outputs_reset_stats()
+        assert after['batches'] == before['batches'] + 1
+        assert after['modules'] == before['modules'] + 1
+        assert after['failed'] == before['failed']
     time.sleep(0.1)
     check_uni_state(common.TEST_MODULE_ADDR, 0)
 
@@ -211,6 +258,72 @@ def test_reset_outputs_on_disconnect() -> None:
     check_uni_state(common.TEST_MODULE_ADDR, 0)
 
 
+def test_output_pulse() -> None:
+    response = mtb_daemon.request_response({
+        'command': 'module_set_outputs',
+        'address': common.TEST_MODULE_ADDR,
+        'outputs': {'0': {'type': 'plain', 'value': 1, 'duration_ms': 300}},
+    })
+    assert response['outputs']['0'] == {'type': 'plain', 'value': 1}
+    time.sleep(0.1)
+    check_uni_state(common.TEST_MODULE_ADDR, 1)
+    time.sleep(0.4)
+    check_uni_state(common.TEST_MODULE_ADDR, 0)
+
+
+def test_output_pulse_invalid_duration() -> None:
+    response = mtb_daemon.request_response({
+        'command': 'module_set_outputs',
+        'address': common.TEST_MODULE_ADDR,
+        'outputs': {'0': {'type': 'plain', 'value': 1, 'duration_ms': 0}},
+    }, ok=False)
+    common.check_error(response, common.MtbDaemonError.MODULE_INVALID_PORT)
+
+
+def test_output_pulse_ends_during_config_write() -> None:
+    mtb_daemon.request_response({
+        'command': 'module_set_outputs',
+        'address': common.TEST_MODULE_ADDR,
+        'outputs': {'0': {'type': 'plain', 'value': 1, 'duration_ms': 50}},
+    })
+    # Long EEPROM write, pulse expires while config is being written
+    test_json = common.MODULES_JSON[common.TEST_MODULE_ADDR]
+    mtb_daemon.request_response({
+        'command': 'module_set_config',
+        'address': common.TEST_MODULE_ADDR,
+        'config': {
+            'inputsDelay': [0.5]*16,
+            'outputsSafe': test_json['config']['outputsSafe'],
+        },
+    })
+    mtb_daemon.request_response({
+        'command': 'module_set_config',
+        'address': common.TEST_MODULE_ADDR,
+        'config': {
+            'inputsDelay': test_json['config']['inputsDelay'],
+            'outputsSafe': test_json['config']['outputsSafe'],
+        },
+    })
+    time.sleep(0.2)
+    check_uni_state(common.TEST_MODULE_ADDR, 0)
+
+
+def test_reset_outputs_on_missed_heartbeat() -> None:
+    # Dedicated client: the daemon closes its connection, shared mtb_daemon stays intact
+    with MtbDaemonIFace() as client:
+        client.request_response({
+            'command': 'module_set_outputs',
+            'address': common.TEST_MODULE_ADDR,
+            'outputs': {'1': {'type': 'plain', 'value': 1}},
+        })
+        time.sleep(0.1)
+        check_uni_state(common.TEST_MODULE_ADDR, 0b10)
+
+        client.request_response({'command': 'heartbeat', 'timeout_ms': 300})
+        time.sleep(1)  # no heartbeat
+        check_uni_state(common.TEST_MODULE_ADDR, 0)
+
+
 ###############################################################################
 
 def check_set_name(addr: int) -> None:
@@ -381,3 +494,86 @@ def test_set_all_config() -> None:
             'outputsSafe': test_json['config']['outputsSafe'],
         },
     })
+
+
+###############################################################################
+
+def test_rule_input_to_output() -> None:
+    # Output 0 is connected to input 0, rule mirrors input 0 to output 1
+    outputs = {str(value): {'address': common.TEST_MODULE_ADDR,
+                            'outputs': {'1': {'type': 'plain', 'value': value}}}
+               for value in [0, 1]}
+    mtb_daemon.request_response({
+        'command': 'rules_set',
+        'rules': [{
+            'when': {'address': common.TEST_MODULE_ADDR, 'inputs': {'0': True}},
+            'then': [outputs['1']],
+            'else': [outputs['0']],
+        }],
+    })
+
+    try:
+        mtb_daemon.request_response({
+            'command': 'module_set_outputs',
+            'address': common.TEST_MODULE_ADDR,
+            'outputs': {'0': {'type': 'plain', 'value': 1}},
+        })
+        time.sleep(0.2)
+        check_uni_state(common.TEST_MODULE_ADDR, 0b11)
+
+        mtb_daemon.request_response({
+            'command': 'module_set_outputs',
+            'address': common.TEST_MODULE_ADDR,
+            'outputs': {'0': {'type': 'plain', 'value': 0}},
+        })
+        time.sleep(0.2)
+        check_uni_state(common.TEST_MODULE_ADDR, 0)
+
+        response = mtb_daemon.request_response({'command': 'rules'})
+        assert response['rules'][0]['matched'] is False
+        assert response['rules'][0]['fired'] >= 2
+    finally:
+        mtb_daemon.request_response({'command': 'rules_set', 'rules': []})
+
+
+def test_rule_invalid() -> None:
+    response = mtb_daemon.request_response({
+        'command': 'rules_set',
+        'rules': [{
+            'when': {'address': common.TEST_MODULE_ADDR, 'inputs': {'16': True}},
+            'then': [],
+        }],
+    }, ok=False)
+    common.check_error(response, common.MtbDaemonError.INVALID_JSON)
+
+
+def test_scene_apply() -> None:
+    for name, value in [('on', 1), ('off', 0)]:
+        mtb_daemon.request_response({
+            'command': 'scene_set',
+            'name': name,
+            'outputs': {str(common.TEST_MODULE_ADDR): {'0': {'type': 'plain', 'value': value}}},
+        })
+
+    try:
+        response = mtb_daemon.request_response({'command': 'scene_apply', 'name': 'on'})
+        module = response['modules'][str(common.TEST_MODULE_ADDR)]
+        assert module['status'] == 'ok'
+        assert module['outputs']['0'] == {'type': 'plain', 'value': 1}
+        time.sleep(0.1)
+        check_uni_state(common.TEST_MODULE_ADDR, 1)
+
+        mtb_daemon.request_response({'command': 'scene_apply', 'name': 'off'})
+        time.sleep(0.1)
+        check_uni_state(common.TEST_MODULE_ADDR, 0)
+
+        response = mtb_daemon.request_response({'command': 'scenes'})
+        assert response['scenes']['on']['applied'] >= 1
+    finally:
+        for name in ['on', 'off']:
+            mtb_daemon.request_response({'command': 'scene_delete', 'name': name})
+
+
+def test_scene_unknown() -> None:
+    response = mtb_daemon.request_response({'command': 'scene_apply', 'name': 'unknown'}, ok=False)
+    common.check_error(response, common.MtbDaemonError.SCENE_UNKNOWN)
@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+
+"""
+MTB Daemon Server Benchmark
+
+Measures latency & throughput of MTB Daemon server via loopback TCP and via
+local (unix domain) socket. Local socket must be enabled in mtb-daemon.json
+(server.local.path).
+
+Benchmarks:
+ * latency: sequential request-response ('version' command), reports
+   mean/median/99th percentile round-trip time.
+ * throughput: pipelined requests ('version' command), reports handled
+   requests per second.
+ * events: module_set_outputs toggling output 0 of <module_addr> with
+   pipelined requests while subscribed to the module, reports received
+   events per second. Requires active module & write access.
+
+Usage:
+  benchmark.py [options] [--events=<module_addr>]
+  benchmark.py --help
+
+Options:
+  -s <servername>    Specify MTB Daemon server address [default: 127.0.0.1]
+  -p <port>          Specify MTB Daemon port [default: 3841]
+  -l <path>          Local socket path [default: /tmp/mtb-daemon.sock]
+  -n <count>         Number of requests for each benchmark [default: 10000]
+  -h --help          Show this screen.
+"""
+
+import socket
+import json
+import time
+import statistics
+from docopt import docopt
+from typing import Dict, Any, List, Tuple
+
+
+class Connection:
+    def __init__(self, sock: socket.socket):
+        self.sock = sock
+        self.buf = b''
+
+    def send(self, request: Dict[str, Any]) -> None:
+        request['type'] = 'request'
+        self.sock.sendall((json.dumps(request)+'\n').encode('utf-8'))
+
+    def messages(self) -> List[Dict[str, Any]]:
+        while b'\n' not in self.buf:
+            data = self.sock.recv(0xFFFF)
+            if not data:
+                raise ConnectionError('Connection closed by server!')
+            self.buf += data
+        lines = self.buf.split(b'\n')
+        self.buf = lines[-1]
+        return [json.loads(line) for line in lines[:-1] if line.strip()]
+
+    def wait_response(self, command: str) -> Dict[str, Any]:
+        while True:
+            for message in self.messages():
+                if message.get('command') == command and message.get('type') == 'response':
+                    return message
+
+
+def bench_latency(conn: Connection, count: int) -> Tuple[float, float, float]:
+    times = []
+    for i in range(count):
+        start = time.perf_counter()
+        conn.send({'command': 'version', 'id': i})
+        conn.wait_response('version')
+        times.append(time.perf_counter() - start)
+    times.sort()
+    return (statistics.mean(times)*1e6, statistics.median(times)*1e6,
+            times[int(len(times)*0.99)]*1e6)
+
+
+def bench_throughput(conn: Connection, count: int) -> float:
+    start = time.perf_counter()
+    payload = b''.join(
+        (json.dumps({'command': 'version', 'type': 'request', 'id': i})+'\n').encode('utf-8')
+        for i in range(count)
+    )
+    conn.sock.sendall(payload)
+    received = 0
+    while received < count:
+        received += sum(1 for msg in conn.messages() if msg.get('command') == 'version')
+    return count / (time.perf_counter() - start)
+
+
+def bench_events(conn: Connection, count: int, module: int) -> float:
+    conn.send({'command': 'module_subscribe', 'addresses': [module]})
+    conn.wait_response('module_subscribe')
+
+    start = time.perf_counter()
+    payload = b''.join(
+        (json.dumps({'command': 'module_set_outputs', 'type': 'request', 'id': i,
+                     'address': module, 'outputs': {'0': i % 2}})+'\n').encode('utf-8')
+        for i in range(count)
+    )
+    conn.sock.sendall(payload)
+    responses, events = 0, 0
+    while responses < count:
+        for msg in conn.messages():
+            if msg.get('type') == 'event':
+                events += 1
+            elif msg.get('command') == 'module_set_outputs':
+                responses += 1
+    duration = time.perf_counter() - start
+
+    conn.send({'command': 'module_unsubscribe', 'addresses': [module]})
+    conn.wait_response('module_unsubscribe')
+    return events / duration
+
+
+def run(name: str, sock: socket.socket, args: Dict[str, Any]) -> None:
+    count = int(args['-n'])
+    conn = Connection(sock)
+    mean, median, p99 = bench_latency(conn, count)
+    print(f'{name}: latency mean {mean:.1f} us, median {median:.1f} us, p99 {p99:.1f} us')
+    print(f'{name}: throughput {bench_throughput(conn, count):.0f} requests/s')
+    if args['--events']:
+        rate = bench_events(conn, count, int(args['--events']))
+        print(f'{name}: events {rate:.0f} events/s')
+    sock.close()
+
+
+if __name__ == '__main__':
+    args = docopt(__doc__)
+
+    tcp = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    tcp.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    tcp.connect((args['-s'], int(args['-p'])))
+    run('tcp', tcp, args)
+
+    local = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    local.connect(args['-l'])
+    run('local', local, args)